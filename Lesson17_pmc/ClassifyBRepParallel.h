@@ -0,0 +1,108 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2020-present, Quaoar Studio
+// All rights reserved.
+//-----------------------------------------------------------------------------
+
+#ifndef ClassifyBRepParallel_h
+#define ClassifyBRepParallel_h
+
+// OpenCascade includes
+#include <BRepClass3d_SolidClassifier.hxx>
+#include <OSD_ThreadPool.hxx>
+
+// Standard includes
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+//-----------------------------------------------------------------------------
+
+//! Multi-threaded driver for OpenCascade's exact point membership
+//! classification. A classifier instance is not reentrant, so each thread
+//! of the pool gets its own one, loaded on first use and kept for the
+//! subsequent runs. The points are split into chunks handed out to the
+//! threads on demand, just like in ClassifyPtParallel, so the results of
+//! both drivers are comparable at equal numbers of threads.
+class ClassifyBRepParallel
+{
+public:
+
+  //! Ctor.
+  //! \param[in] shape     the solid to classify the points against.
+  //! \param[in] chunkSize the number of points in a single work item.
+  ClassifyBRepParallel(const TopoDS_Shape& shape,
+                       const int           chunkSize = 64)
+  //
+  : m_shape      (shape),
+    m_iChunkSize (Max(chunkSize, 1))
+  {}
+
+public:
+
+  //! Classifies the passed points.
+  //! \param[in]  points     the points to classify.
+  //! \param[in]  tol        the tolerance of the classifier.
+  //! \param[out] outMask    the output mask with 1 for the inner points and
+  //!                        0 for all others.
+  //! \param[in]  numThreads the max number of threads to use. Pass -1 to
+  //!                        use all threads of the default pool.
+  void Perform(const std::vector<gp_XYZ>& points,
+               const double               tol,
+               std::vector<uint8_t>&      outMask,
+               const int                  numThreads = -1)
+  {
+    const int numPts    = int( points.size() );
+    const int numChunks = (numPts + m_iChunkSize - 1) / m_iChunkSize;
+
+    // Each chunk writes its own range of the mask, so no sync is needed.
+    outMask.assign(points.size(), 0);
+
+    OSD_ThreadPool::Launcher launcher(*OSD_ThreadPool::DefaultPool(), numThreads);
+
+    // The slots are indexed by threads, so they are allocated beforehand,
+    // while the classifiers are loaded lazily by their threads.
+    if ( int( m_classifiers.size() ) <= launcher.UpperThreadIndex() )
+      m_classifiers.resize( launcher.UpperThreadIndex() + 1 );
+    //
+    launcher.Perform( 0, numChunks, [&](const int threadIndex, const int chunk)
+    {
+      std::unique_ptr<BRepClass3d_SolidClassifier>& classifier = m_classifiers[threadIndex];
+      //
+      if ( !classifier )
+        classifier.reset( new BRepClass3d_SolidClassifier(m_shape) );
+
+      const int first = chunk*m_iChunkSize;
+      const int last  = Min(first + m_iChunkSize, numPts);
+
+      for ( int i = first; i < last; ++i )
+      {
+        classifier->Perform(points[i], tol);
+        //
+        if ( classifier->State() == TopAbs_IN )
+          outMask[i] = 1;
+      }
+    } );
+  }
+
+  //! \return number of classifier instances loaded so far.
+  int GetNumClassifiers() const
+  {
+    int num = 0;
+    for ( const auto& classifier : m_classifiers )
+      if ( classifier )
+        num++;
+
+    return num;
+  }
+
+protected:
+
+  TopoDS_Shape m_shape;      //!< Solid to classify the points against.
+  int          m_iChunkSize; //!< Number of points per work item.
+
+  //! Classifiers of the threads.
+  std::vector< std::unique_ptr<BRepClass3d_SolidClassifier> > m_classifiers;
+
+};
+
+#endif
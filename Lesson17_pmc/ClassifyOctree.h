@@ -0,0 +1,280 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2020-present, Quaoar Studio
+// All rights reserved.
+//-----------------------------------------------------------------------------
+
+#ifndef ClassifyOctree_h
+#define ClassifyOctree_h
+
+// Local includes
+#include "ClassifyPt.h"
+
+//-----------------------------------------------------------------------------
+
+//! Adaptive voxelization of a regular grid with an octree. A cell which is
+//! far from all facets has the same state in all its nodes, so it is
+//! classified with a single query and stored as one leaf. Only the cells
+//! near the surface get refined down to the individual grid nodes. The
+//! number of queries therefore grows with the surface area and not with
+//! the volume of the grid.
+//!
+//! The leaves are stored in Morton order, so the resulting structure is a
+//! sorted array which is looked up with binary search.
+class ClassifyOctree
+{
+public:
+
+  //! Leaf cell of the octree.
+  struct t_cell
+  {
+    uint64_t Code;    //!< Morton code of the min node of the cell.
+    uint8_t  LogSize; //!< Cell size is 2^LogSize nodes along each axis.
+    uint8_t  IsIn;    //!< 1 for the inner cells, 0 for the others.
+  };
+
+public:
+
+  //! Ctor.
+  //! \param[in] classifier the classifier to use for the leaf cells.
+  ClassifyOctree(const ClassifyPt& classifier)
+  //
+  : m_classifier (classifier),
+    m_fStep      (0.),
+    m_fTol       (0.),
+    m_iNumQueries(0)
+  {
+    m_numNodes[0] = m_numNodes[1] = m_numNodes[2] = 0;
+  }
+
+public:
+
+  //! Classifies the nodes of a regular grid. The grid has the same layout
+  //! as in ClassifyPt::IsInGrid().
+  //! \param[in] origin   the first grid node.
+  //! \param[in] step     the grid step.
+  //! \param[in] numNodes the number of nodes along each axis.
+  //! \param[in] tol      the tolerance to reject the near-boundary nodes.
+  void Perform(const gp_XYZ& origin,
+               const double  step,
+               const int     numNodes[3],
+               const double  tol)
+  {
+    m_origin = origin;
+    m_fStep  = step;
+    m_fTol   = tol;
+    //
+    for ( int k = 0; k < 3; ++k )
+      m_numNodes[k] = numNodes[k];
+
+    m_cells.clear();
+    m_iNumQueries = 0;
+
+    // The root cell is the smallest power of two enclosing the grid.
+    int rootLog = 0;
+    while ( (1 << rootLog) < Max( numNodes[0], Max(numNodes[1], numNodes[2]) ) )
+      rootLog++;
+
+    // The subtrees are classified in parallel. Two levels below the root
+    // give up to 64 independent work items.
+    const int subLog   = Max(rootLog - 2, 0);
+    const int numRoots = 1 << ( 3*(rootLog - subLog) );
+
+    std::vector< std::vector<t_cell> > subCells(numRoots);
+    std::vector<int>                   subQueries(numRoots, 0);
+
+    OSD_Parallel::For( 0, numRoots, [&](const int idx)
+    {
+      int i, j, k;
+      decode(uint64_t(idx), i, j, k);
+
+      BullardRNG rng( BullardRNG::StreamSeed( unsigned(idx) ) );
+      //
+      this->classifyCell(i << subLog, j << subLog, k << subLog, subLog,
+                         rng, subCells[idx], subQueries[idx]);
+    } );
+
+    // Subtrees come in Morton order, so the concatenation stays sorted.
+    for ( int idx = 0; idx < numRoots; ++idx )
+    {
+      m_cells.insert( m_cells.end(), subCells[idx].begin(), subCells[idx].end() );
+      m_iNumQueries += subQueries[idx];
+    }
+  }
+
+  //! Checks the state of the grid node with the given indices.
+  //! \return true if the node is inside.
+  bool IsIn(const int i, const int j, const int k) const
+  {
+    if ( i < 0 || i >= m_numNodes[0] ||
+         j < 0 || j >= m_numNodes[1] ||
+         k < 0 || k >= m_numNodes[2] )
+      return false;
+
+    const uint64_t code = encode(i, j, k);
+
+    // Find the last leaf starting not after the node.
+    std::vector<t_cell>::const_iterator it =
+      std::upper_bound( m_cells.begin(), m_cells.end(), code,
+                        [](const uint64_t c, const t_cell& cell) { return c < cell.Code; } );
+    //
+    if ( it == m_cells.begin() )
+      return false;
+
+    --it;
+    return (code < it->Code + ( uint64_t(1) << (3*it->LogSize) )) && it->IsIn;
+  }
+
+  //! Expands the octree into a dense mask.
+  //! \param[out] outMask the output mask with 1 for the inner nodes. The
+  //!                     node (i, j, k) goes to (i*numNodes[1] + j)*numNodes[2] + k.
+  void GetMask(std::vector<uint8_t>& outMask) const
+  {
+    outMask.assign(size_t(m_numNodes[0])*m_numNodes[1]*m_numNodes[2], 0);
+
+    for ( const t_cell& cell : m_cells )
+    {
+      if ( !cell.IsIn )
+        continue;
+
+      int i0, j0, k0;
+      decode(cell.Code, i0, j0, k0);
+
+      const int size = 1 << cell.LogSize;
+      const int i1   = Min(i0 + size, m_numNodes[0]);
+      const int j1   = Min(j0 + size, m_numNodes[1]);
+      const int k1   = Min(k0 + size, m_numNodes[2]);
+
+      for ( int i = i0; i < i1; ++i )
+        for ( int j = j0; j < j1; ++j )
+          for ( int k = k0; k < k1; ++k )
+            outMask[(size_t(i)*m_numNodes[1] + j)*m_numNodes[2] + k] = 1;
+    }
+  }
+
+  //! \return leaf cells in Morton order.
+  const std::vector<t_cell>& GetCells() const { return m_cells; }
+
+  //! \return number of point queries done by the last Perform() call.
+  int GetNumQueries() const { return m_iNumQueries; }
+
+  //! \return memory occupied by the leaf cells in bytes.
+  size_t GetMemoryFootprint() const { return m_cells.capacity()*sizeof(t_cell); }
+
+protected:
+
+  //! Classifies the cell and its children recursively.
+  //! \param[in]     i0         the first node index of the cell along OX.
+  //! \param[in]     j0         the first node index of the cell along OY.
+  //! \param[in]     k0         the first node index of the cell along OZ.
+  //! \param[in]     logSize    the log2 of the cell size.
+  //! \param[in]     rng        the random number generator for queries.
+  //! \param[out]    cells      the output leaves.
+  //! \param[in,out] numQueries the number of queries done.
+  //! \return the state of the cell if it is stored as a single leaf, or -1
+  //!         if the cell is refined or lies completely out of the grid.
+  int classifyCell(const int            i0,
+                   const int            j0,
+                   const int            k0,
+                   const int            logSize,
+                   BullardRNG&          rng,
+                   std::vector<t_cell>& cells,
+                   int&                 numQueries) const
+  {
+    if ( i0 >= m_numNodes[0] || j0 >= m_numNodes[1] || k0 >= m_numNodes[2] )
+      return -1;
+
+    const int size = 1 << logSize;
+    const int i1   = Min(i0 + size, m_numNodes[0]) - 1;
+    const int j1   = Min(j0 + size, m_numNodes[1]) - 1;
+    const int k1   = Min(k0 + size, m_numNodes[2]) - 1;
+
+    // The box of the grid nodes of the cell extended by the tolerance. If
+    // no facet gets there, all nodes are on the same side and farther than
+    // the tolerance from the surface.
+    const BVH_Vec3d minPt( m_origin.X() + i0*m_fStep - m_fTol,
+                           m_origin.Y() + j0*m_fStep - m_fTol,
+                           m_origin.Z() + k0*m_fStep - m_fTol );
+    const BVH_Vec3d maxPt( m_origin.X() + i1*m_fStep + m_fTol,
+                           m_origin.Y() + j1*m_fStep + m_fTol,
+                           m_origin.Z() + k1*m_fStep + m_fTol );
+
+    if ( logSize == 0 || !m_classifier.GetBvh()->HasFacetsInBox(minPt, maxPt) )
+    {
+      const gp_XYZ P( 0.5*( minPt.x() + maxPt.x() ),
+                      0.5*( minPt.y() + maxPt.y() ),
+                      0.5*( minPt.z() + maxPt.z() ) );
+
+      const uint8_t isIn = m_classifier.IsIn(P, m_fTol, rng) ? 1 : 0;
+      numQueries++;
+
+      cells.push_back( { encode(i0, j0, k0), uint8_t(logSize), isIn } );
+      return isIn;
+    }
+
+    // Refine the cell. The children go in Morton order.
+    const size_t first     = cells.size();
+    const int    half      = size >> 1;
+    int          state     = -1;
+    bool         isUniform = true;
+    //
+    for ( int c = 0; c < 8; ++c )
+    {
+      const int childState = this->classifyCell( i0 + ( (c >> 2) & 1 )*half,
+                                                 j0 + ( (c >> 1) & 1 )*half,
+                                                 k0 + (  c       & 1 )*half,
+                                                 logSize - 1, rng, cells, numQueries );
+
+      if ( childState < 0 || (c > 0 && childState != state) )
+        isUniform = false;
+
+      state = childState;
+    }
+
+    // Merge the children of the same state back.
+    if ( isUniform )
+    {
+      cells.resize(first);
+      cells.push_back( { encode(i0, j0, k0), uint8_t(logSize), uint8_t(state) } );
+      return state;
+    }
+    return -1;
+  }
+
+  //! Interleaves the bits of node indices into a Morton code.
+  static uint64_t encode(const int i, const int j, const int k)
+  {
+    uint64_t code = 0;
+    for ( int b = 0; b < 21; ++b )
+    {
+      code |= uint64_t( (i >> b) & 1 ) << (3*b + 2);
+      code |= uint64_t( (j >> b) & 1 ) << (3*b + 1);
+      code |= uint64_t( (k >> b) & 1 ) << (3*b);
+    }
+    return code;
+  }
+
+  //! Extracts node indices from a Morton code.
+  static void decode(const uint64_t code, int& i, int& j, int& k)
+  {
+    i = j = k = 0;
+    for ( int b = 0; b < 21; ++b )
+    {
+      i |= int( (code >> (3*b + 2)) & 1 ) << b;
+      j |= int( (code >> (3*b + 1)) & 1 ) << b;
+      k |= int( (code >> (3*b))     & 1 ) << b;
+    }
+  }
+
+protected:
+
+  const ClassifyPt&   m_classifier;  //!< Point classifier.
+  gp_XYZ              m_origin;      //!< First grid node.
+  double              m_fStep;       //!< Grid step.
+  double              m_fTol;        //!< Tolerance for the near-boundary nodes.
+  int                 m_numNodes[3]; //!< Number of nodes along each axis.
+  std::vector<t_cell> m_cells;       //!< Leaves in Morton order.
+  int                 m_iNumQueries; //!< Number of point queries done.
+
+};
+
+#endif
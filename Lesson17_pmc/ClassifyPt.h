@@ -9,13 +9,28 @@
 // OpenCascade includes
 #include <BRep_Builder.hxx>
 #include <BRepBndLib.hxx>
+#include <BVH_BinnedBuilder.hxx>
+#include <BVH_LinearBuilder.hxx>
 #include <BVH_PrimitiveSet.hxx>
+#include <OSD_Parallel.hxx>
 #include <Poly_Triangulation.hxx>
 #include <Precision.hxx>
 #include <TopExp.hxx>
 #include <TopoDS.hxx>
 #include <TopoDS_Face.hxx>
 
+// Standard includes
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// SIMD includes
+#if defined(__AVX2__)
+  #include <immintrin.h>
+#endif
+
 //-----------------------------------------------------------------------------
 
 const static double REAL_MIN = std::numeric_limits<double>::min();
@@ -54,6 +69,22 @@ public:
     return RandInt() / (double) (0xFFFFFFFF);
   }
 
+  //! Derives a well-mixed seed for the stream with the given index, so that
+  //! consecutive indices (e.g., point indices) give unrelated sequences.
+  //! \param[in] stream index of the random stream.
+  //! \return seed to initialize the generator with.
+  static unsigned StreamSeed(const unsigned stream)
+  {
+    // Finalizer of MurmurHash3.
+    unsigned h = stream + 0x9E3779B9u;
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    return h;
+  }
+
 protected:
 
   unsigned m_iLo, m_iHi;
@@ -62,6 +93,170 @@ protected:
 
 //-----------------------------------------------------------------------------
 
+//! Structure-of-arrays storage of facets for the leaf loops of BVH queries.
+//! Besides the first node of each triangle, the two edges starting there
+//! are precomputed for the Moller-Trumbore intersection test. The scalar
+//! type can be float to halve the memory footprint. In that case, the
+//! coordinates are widened back to double on load, so only the storage
+//! precision is lost.
+template <typename T>
+class FacetsSoA
+{
+public:
+
+  //! Preallocates memory for the given number of facets.
+  void Reserve(const int numFacets)
+  {
+    for ( int k = 0; k < 3; ++k )
+    {
+      m_P0[k].reserve(numFacets);
+      m_E1[k].reserve(numFacets);
+      m_E2[k].reserve(numFacets);
+    }
+  }
+
+  //! Adds a triangle.
+  void Add(const BVH_Vec3d& P0, const BVH_Vec3d& P1, const BVH_Vec3d& P2)
+  {
+    for ( int k = 0; k < 3; ++k )
+    {
+      m_P0[k].push_back( T(P0[k]) );
+      m_E1[k].push_back( T(P1[k] - P0[k]) );
+      m_E2[k].push_back( T(P2[k] - P0[k]) );
+    }
+  }
+
+  //! Removes all facets.
+  void Clear()
+  {
+    for ( int k = 0; k < 3; ++k )
+    {
+      m_P0[k].clear(); m_P0[k].shrink_to_fit();
+      m_E1[k].clear(); m_E1[k].shrink_to_fit();
+      m_E2[k].clear(); m_E2[k].shrink_to_fit();
+    }
+  }
+
+  //! \return number of stored facets.
+  int Size() const { return (int) m_P0[0].size(); }
+
+  //! \return first node of a facet.
+  BVH_Vec3d P0(const int index) const
+  {
+    return BVH_Vec3d( m_P0[0][index], m_P0[1][index], m_P0[2][index] );
+  }
+
+  //! \return edge P1 - P0 of a facet.
+  BVH_Vec3d E1(const int index) const
+  {
+    return BVH_Vec3d( m_E1[0][index], m_E1[1][index], m_E1[2][index] );
+  }
+
+  //! \return edge P2 - P0 of a facet.
+  BVH_Vec3d E2(const int index) const
+  {
+    return BVH_Vec3d( m_E2[0][index], m_E2[1][index], m_E2[2][index] );
+  }
+
+  //! \return memory occupied by the facets in bytes.
+  size_t GetMemoryFootprint() const
+  {
+    size_t bytes = 0;
+    for ( int k = 0; k < 3; ++k )
+      bytes += ( m_P0[k].capacity() + m_E1[k].capacity() + m_E2[k].capacity() )*sizeof(T);
+
+    return bytes;
+  }
+
+protected:
+
+  std::vector<T> m_P0[3]; //!< Coordinates of the first nodes.
+  std::vector<T> m_E1[3]; //!< Coordinates of the first edges.
+  std::vector<T> m_E2[3]; //!< Coordinates of the second edges.
+
+};
+
+//-----------------------------------------------------------------------------
+
+//! Indexed storage of facets for very large meshes. The mesh nodes are
+//! shared by the facets and kept in single precision, while the facets
+//! refer to them with 32-bit indices. The coordinates are widened back to
+//! double on load.
+class FacetsIndexed
+{
+public:
+
+  //! Preallocates memory for the given number of facets.
+  void Reserve(const int numFacets)
+  {
+    m_tris.reserve(3*size_t(numFacets));
+  }
+
+  //! Adds a node.
+  //! \return 0-based index of the added node.
+  uint32_t AddNode(const BVH_Vec3d& P)
+  {
+    m_nodes.push_back( float( P.x() ) );
+    m_nodes.push_back( float( P.y() ) );
+    m_nodes.push_back( float( P.z() ) );
+    return uint32_t(m_nodes.size()/3 - 1);
+  }
+
+  //! Adds a triangle given by the 0-based indices of its nodes.
+  void Add(const uint32_t n0, const uint32_t n1, const uint32_t n2)
+  {
+    m_tris.push_back(n0);
+    m_tris.push_back(n1);
+    m_tris.push_back(n2);
+  }
+
+  //! Removes all facets and nodes.
+  void Clear()
+  {
+    m_nodes.clear(); m_nodes.shrink_to_fit();
+    m_tris.clear();  m_tris.shrink_to_fit();
+  }
+
+  //! Releases the memory reserved in excess.
+  void Shrink()
+  {
+    m_nodes.shrink_to_fit();
+    m_tris.shrink_to_fit();
+  }
+
+  //! \return number of stored facets.
+  int Size() const { return (int) (m_tris.size()/3); }
+
+  //! Returns nodes of a facet.
+  void Get(const int  index,
+           BVH_Vec3d& P0,
+           BVH_Vec3d& P1,
+           BVH_Vec3d& P2) const
+  {
+    const float* pNode0 = &m_nodes[3*size_t(m_tris[3*size_t(index) + 0])];
+    const float* pNode1 = &m_nodes[3*size_t(m_tris[3*size_t(index) + 1])];
+    const float* pNode2 = &m_nodes[3*size_t(m_tris[3*size_t(index) + 2])];
+
+    P0 = BVH_Vec3d( pNode0[0], pNode0[1], pNode0[2] );
+    P1 = BVH_Vec3d( pNode1[0], pNode1[1], pNode1[2] );
+    P2 = BVH_Vec3d( pNode2[0], pNode2[1], pNode2[2] );
+  }
+
+  //! \return memory occupied by the facets and nodes in bytes.
+  size_t GetMemoryFootprint() const
+  {
+    return m_nodes.capacity()*sizeof(float) + m_tris.capacity()*sizeof(uint32_t);
+  }
+
+protected:
+
+  std::vector<float>    m_nodes; //!< Node coordinates, three per node.
+  std::vector<uint32_t> m_tris;  //!< Node indices, three per facet.
+
+};
+
+//-----------------------------------------------------------------------------
+
 //! BVH-based accelerating structure representing CAD model's
 //! facets in computations.
 class ModelBvh : public BVH_PrimitiveSet<double, 3>
@@ -79,40 +274,255 @@ public:
     int       FaceIndex;  //!< Index of the host face.
   };
 
+  //! Layout of facets used by the leaf loops of BVH queries.
+  enum FacetStorage
+  {
+    FacetStorage_AoS = 0, //!< Array of t_facet structures (default).
+    FacetStorage_SoA64,   //!< Node and edges in double-precision SoA.
+    FacetStorage_SoA32,   //!< Node and edges in single-precision SoA.
+    FacetStorage_Indexed32 //!< Shared single-precision nodes with 32-bit indices.
+  };
+
+  //! Feature of a triangle closest to a point.
+  enum TriFeature
+  {
+    TriFeature_Face = 0, //!< Interior of the triangle.
+    TriFeature_V0,       //!< Node P0.
+    TriFeature_V1,       //!< Node P1.
+    TriFeature_V2,       //!< Node P2.
+    TriFeature_E01,      //!< Edge P0-P1.
+    TriFeature_E12,      //!< Edge P1-P2.
+    TriFeature_E20       //!< Edge P2-P0.
+  };
+
+  //! BVH construction algorithm.
+  enum BuilderType
+  {
+    Builder_Binned = 0, //!< Binned SAH builder, better trees.
+    Builder_Linear      //!< Morton-code builder, faster construction.
+  };
+
+  //! Max depth of the tree. The traversals keep fixed-size stacks of 64
+  //! nodes, which deeper trees would overrun.
+  static const int MaxTreeDepth = 32;
+
+  //! Options of BVH construction.
+  struct t_buildParams
+  {
+    BuilderType Builder;    //!< Construction algorithm.
+    int         LeafSize;   //!< Max number of facets in a leaf.
+    int         NumBins;    //!< Number of bins (4, 8, 16, 32, 48 or 64) for the binned builder.
+    int         MaxDepth;   //!< Max depth of the tree, at most MaxTreeDepth.
+    int         NumThreads; //!< Number of threads to build with, -1 for all cores.
+
+    //! Default ctor.
+    t_buildParams() : Builder(Builder_Binned), LeafSize(5), NumBins(32), MaxDepth(32), NumThreads(1) {}
+  };
+
+  //! Node of the 4-wide tree collapsed from the binary one. The boxes of
+  //! children are packed SoA, so that a single AVX2 register holds the
+  //! same coordinate of all four boxes.
+  struct alignas(32) t_wideNode
+  {
+    double MinX[4], MinY[4], MinZ[4]; //!< Min corners of the child boxes.
+    double MaxX[4], MaxY[4], MaxZ[4]; //!< Max corners of the child boxes.
+    int    Child[4];                  //!< Index of the child node or -1 for a leaf.
+    int    First[4];                  //!< First facet of a leaf child.
+    int    Last[4];                   //!< Last facet of a leaf child.
+    int    NumChildren;               //!< Number of occupied slots.
+  };
+
+  //! Node of the quantized tree. The boxes of both children are stored on
+  //! an 8-bit grid spanning the box of the node, which is in turn given by
+  //! a single-precision corner and a power-of-two cell size per axis. The
+  //! quantized boxes are rounded outwards, so they enclose the exact ones.
+  //! The leaves are not stored as nodes, they are referenced by parents.
+  struct t_quantNode
+  {
+    float    Origin[3]; //!< Min corner of the node box rounded down.
+    int8_t   Exp[3];    //!< Binary exponent of the grid cell size per axis.
+    uint8_t  LeafMask;  //!< Bit k is set if child k is a leaf.
+    uint8_t  Lo[2][3];  //!< Quantized min corners of the children.
+    uint8_t  Hi[2][3];  //!< Quantized max corners of the children.
+    uint32_t Child[2];  //!< Index of the child node or the first facet of a leaf.
+    uint16_t Count[2];  //!< Number of facets in a leaf child.
+
+    //! Decodes the box of a child.
+    void GetChildBox(const int k, BVH_Vec3d& minPt, BVH_Vec3d& maxPt) const
+    {
+      for ( int axis = 0; axis < 3; ++axis )
+      {
+        const double cell = std::ldexp(1., Exp[axis]);
+        //
+        minPt[axis] = Origin[axis] + Lo[k][axis]*cell;
+        maxPt[axis] = Origin[axis] + Hi[k][axis]*cell;
+      }
+    }
+  };
+
 public:
 
   //! Creates the accelerating structure with immediate initialization.
-  ModelBvh(const TopoDS_Shape& model)
+  ModelBvh(const TopoDS_Shape&  model,
+           const t_buildParams& params = t_buildParams())
   //
   : BVH_PrimitiveSet<double, 3> (),
-    m_fBoundingDiag             (0.0)
+    m_fBoundingDiag             (0.0),
+    m_storage                   (FacetStorage_AoS)
   {
-    this->init(model);
+    this->init(model, params);
     this->MarkDirty();
   }
 
   //! Creates the accelerating structure with immediate initialization.
-  ModelBvh(const Handle(Poly_Triangulation)& mesh)
+  ModelBvh(const Handle(Poly_Triangulation)& mesh,
+           const t_buildParams&              params = t_buildParams())
+  //
+  : BVH_PrimitiveSet<double, 3> (),
+    m_fBoundingDiag             (0.0),
+    m_storage                   (FacetStorage_AoS)
+  {
+    this->init(mesh, params);
+    this->MarkDirty();
+  }
+
+  //! Creates an empty accelerating structure to be filled with Restore().
+  ModelBvh()
   //
   : BVH_PrimitiveSet<double, 3> (),
-    m_fBoundingDiag             (0.0)
+    m_fBoundingDiag             (0.0),
+    m_storage                   (FacetStorage_AoS)
+  {
+    this->SetBuildParams( t_buildParams() );
+  }
+
+  //! Restores the facets together with the tree built for them earlier,
+  //! so that the tree is not rebuilt on the first access.
+  //! \param[in] facets       the facets in the order of the tree leaves.
+  //! \param[in] numFacets    the number of facets.
+  //! \param[in] nodeInfo     the node info buffer of the tree.
+  //! \param[in] minPoints    the min corners of the node boxes.
+  //! \param[in] maxPoints    the max corners of the node boxes.
+  //! \param[in] numNodes     the number of tree nodes.
+  //! \param[in] boundingDiag the characteristic size of the model.
+  void Restore(const t_facet*   facets,
+               const int        numFacets,
+               const BVH_Vec4i* nodeInfo,
+               const BVH_Vec3d* minPoints,
+               const BVH_Vec3d* maxPoints,
+               const int        numNodes,
+               const double     boundingDiag)
+  {
+    m_facets.assign(facets, facets + numFacets);
+    m_fBoundingDiag = boundingDiag;
+
+    this->clearDerived();
+    m_quantNodes.clear();
+
+    myBVH = new BVH_Tree<double, 3>;
+    myBVH->NodeInfoBuffer().assign(nodeInfo,  nodeInfo  + numNodes);
+    myBVH->MinPointBuffer().assign(minPoints, minPoints + numNodes);
+    myBVH->MaxPointBuffer().assign(maxPoints, maxPoints + numNodes);
+
+    myIsDirty = false;
+  }
+
+  //! Sets the options of BVH construction. The builder reorders facets, so
+  //! the facet storage, the wide tree and the pseudo-normals in use are
+  //! rebuilt here for the new tree. Otherwise, the tree is rebuilt on the
+  //! next access. The compact structure cannot be rebuilt, so it ignores
+  //! the call. The max depth is clamped to MaxTreeDepth.
+  //! \param[in] params the build options.
+  void SetBuildParams(const t_buildParams& params)
   {
-    this->init(mesh);
+    if ( this->IsCompact() )
+      return;
+
+    const int numThreads = params.NumThreads < 0 ? OSD_Parallel::NbLogicalProcessors()
+                                                 : Max(params.NumThreads, 1);
+    const int maxDepth   = Min( Max(params.MaxDepth, 1), MaxTreeDepth );
+
+    if ( params.Builder == Builder_Linear )
+    {
+      // The linear builder parallelizes the radix sort of Morton codes and
+      // the bottom-up update of node boxes.
+      myBuilder = new BVH_LinearBuilder<double, 3>(params.LeafSize, maxDepth);
+      myBuilder->SetParallel(numThreads > 1);
+    }
+    else
+    {
+      // The binned builder processes the subtrees in a queue shared by
+      // the given number of threads.
+      switch ( params.NumBins )
+      {
+        case 4:  myBuilder = new BVH_BinnedBuilder<double, 3, 4> (params.LeafSize, maxDepth, false, numThreads); break;
+        case 8:  myBuilder = new BVH_BinnedBuilder<double, 3, 8> (params.LeafSize, maxDepth, false, numThreads); break;
+        case 16: myBuilder = new BVH_BinnedBuilder<double, 3, 16>(params.LeafSize, maxDepth, false, numThreads); break;
+        case 48: myBuilder = new BVH_BinnedBuilder<double, 3, 48>(params.LeafSize, maxDepth, false, numThreads); break;
+        case 64: myBuilder = new BVH_BinnedBuilder<double, 3, 64>(params.LeafSize, maxDepth, false, numThreads); break;
+        default: myBuilder = new BVH_BinnedBuilder<double, 3, 32>(params.LeafSize, maxDepth, false, numThreads);
+      }
+    }
+
+    m_params          = params;
+    m_params.MaxDepth = maxDepth;
+
+    const FacetStorage storage          = m_storage;
+    const bool         hasWideNodes     = this->HasWideNodes();
+    const bool         hasPseudoNormals = this->HasPseudoNormals();
+
     this->MarkDirty();
+
+    if ( storage != FacetStorage_AoS || hasWideNodes || hasPseudoNormals )
+    {
+      this->BVH();
+
+      if ( storage != FacetStorage_AoS )
+        this->SetFacetStorage(storage);
+      //
+      if ( hasWideNodes )
+        this->SetWideNodes(true);
+      //
+      if ( hasPseudoNormals )
+        this->BuildPseudoNormals();
+    }
+  }
+
+  //! \return options of BVH construction.
+  const t_buildParams& GetBuildParams() const { return m_params; }
+
+  //! Marks the tree for rebuilding. The data indexed by the facet order of
+  //! the current tree is released, as the builder reorders facets. The
+  //! compact structure has no facets to rebuild from, so it stays intact.
+  virtual void MarkDirty() override
+  {
+    if ( this->IsCompact() )
+      return;
+
+    this->clearDerived();
+    BVH_PrimitiveSet<double, 3>::MarkDirty();
   }
 
 public:
 
   //! \return number of stored facets.
-  virtual int Size() const override { return (int) m_facets.size(); }
+  virtual int Size() const override
+  {
+    return m_quantNodes.empty() ? (int) m_facets.size() : m_facetsIdx.Size();
+  }
 
-  //! Builds an elementary box for a facet with the given index.
+  //! Builds an elementary box for a facet with the given index. The
+  //! vertices are taken from the active facet storage, so the box is
+  //! available in the compact structure as well.
   virtual BVH_Box<double, 3> Box(const int index) const override
   {
+    BVH_Vec3d V0, V1, V2;
+    this->GetVertices(index, V0, V1, V2);
+
     BVH_Box<double, 3> box;
-    box.Add(m_facets[index].P0);
-    box.Add(m_facets[index].P1);
-    box.Add(m_facets[index].P2);
+    box.Add(V0);
+    box.Add(V1);
+    box.Add(V2);
     return box;
   }
 
@@ -120,16 +530,17 @@ public:
   virtual double Center(const int index,
                         const int axis) const override
   {
-    const t_facet& facet = m_facets[index];
+    BVH_Vec3d V0, V1, V2;
+    this->GetVertices(index, V0, V1, V2);
 
     if ( axis == 0 )
-      return (1.0 / 3.0) * ( facet.P0.x() + facet.P1.x() + facet.P2.x() );
+      return (1.0 / 3.0) * ( V0.x() + V1.x() + V2.x() );
 
     if ( axis == 1 )
-      return (1.0 / 3.0) * ( facet.P0.y() + facet.P1.y() + facet.P2.y() );
+      return (1.0 / 3.0) * ( V0.y() + V1.y() + V2.y() );
 
     // The last possibility is "axis == 2"
-    return (1.0 / 3.0) * ( facet.P0.z() + facet.P1.z() + facet.P2.z() );
+    return (1.0 / 3.0) * ( V0.z() + V1.z() + V2.z() );
   }
 
   //! Swaps two elements for BVH building.
@@ -139,171 +550,871 @@ public:
     std::swap(m_facets[index1], m_facets[index2]);
   }
 
-  //! Returns vertices for a facet with the given 0-based index.
+  //! Returns vertices for a facet with the given 0-based index. The
+  //! vertices are taken from the active facet storage.
   void GetVertices(const int  index,
                    BVH_Vec3d& vertex1,
                    BVH_Vec3d& vertex2,
                    BVH_Vec3d& vertex3) const
   {
-    vertex1 = m_facets[index].P0;
-    vertex2 = m_facets[index].P1;
-    vertex3 = m_facets[index].P2;
-  }
-
-  //! \return characteristic diagonal of the full model.
-  double GetBoundingDiag() const { return m_fBoundingDiag; }
-
-  //! Returns a facet by its 0-based index.
-  //! \param[in] index index of the facet of interest.
-  //! \return requested facet.
-  const t_facet& GetFacet(const int index) { return m_facets[index]; }
-
-  //! \return AABB of the entire set of objects.
-  virtual BVH_Box<double, 3> Box() const
-  {
-    BVH_Box<double, 3> aabb;
-    const int size = this->Size();
-
-    for ( int i = 0; i < size; ++i )
+    switch ( m_storage )
     {
-      aabb.Combine( this->Box(i) );
+      case FacetStorage_SoA64:
+        vertex1 = m_facets64.P0(index);
+        vertex2 = vertex1 + m_facets64.E1(index);
+        vertex3 = vertex1 + m_facets64.E2(index);
+        break;
+      case FacetStorage_SoA32:
+        vertex1 = m_facets32.P0(index);
+        vertex2 = vertex1 + m_facets32.E1(index);
+        vertex3 = vertex1 + m_facets32.E2(index);
+        break;
+      case FacetStorage_Indexed32:
+        m_facetsIdx.Get(index, vertex1, vertex2, vertex3);
+        break;
+      default:
+        vertex1 = m_facets[index].P0;
+        vertex2 = m_facets[index].P1;
+        vertex3 = m_facets[index].P2;
     }
-    return aabb;
   }
 
-protected:
-
-  //! Initializes the accelerating structure with the given CAD model.
-  bool init(const TopoDS_Shape& model)
+  //! Selects the layout of facets for the leaf loops of BVH queries. As
+  //! the BVH builder reorders facets, the tree is built here if it is not
+  //! ready yet. The compact structure keeps its indexed storage.
+  //! \param[in] storage the facet storage to use.
+  void SetFacetStorage(const FacetStorage storage)
   {
-    if ( model.IsNull() )
-      return false;
-
-    // Prepare builder
-    myBuilder = new BVH_BinnedBuilder<double, 3, 32>(5, 32);
+    if ( this->IsCompact() )
+      return;
 
-    // Explode shape on faces to get face indices
-    if ( m_faces.IsEmpty() )
-      TopExp::MapShapes(model, TopAbs_FACE, m_faces);
+    this->BVH();
 
-    // Initialize with facets taken from faces
-    for ( int fidx = 1; fidx <= m_faces.Extent(); ++fidx )
+    m_facets64.Clear();
+    m_facets32.Clear();
+    m_facetsIdx.Clear();
+    //
+    if ( storage == FacetStorage_SoA64 )
     {
-      const TopoDS_Face& face = TopoDS::Face( m_faces(fidx) );
-      //
-      if ( !this->addFace(face, fidx) )
-        continue; // Do not return false, just skip as otherwise
-                  // BVH will be incorrect for faulty shapes!
+      m_facets64.Reserve( this->Size() );
+      for ( const t_facet& facet : m_facets )
+        m_facets64.Add(facet.P0, facet.P1, facet.P2);
+    }
+    else if ( storage == FacetStorage_SoA32 )
+    {
+      m_facets32.Reserve( this->Size() );
+      for ( const t_facet& facet : m_facets )
+        m_facets32.Add(facet.P0, facet.P1, facet.P2);
     }
+    else if ( storage == FacetStorage_Indexed32 )
+    {
+      // Nodes are shared by coordinates.
+      std::unordered_map<t_nodeKey, uint32_t, t_nodeKey::Hasher> nodeIds;
+      //
+      m_facetsIdx.Reserve( this->Size() );
+      //
+      for ( const t_facet& facet : m_facets )
+      {
+        const BVH_Vec3d P[3] = { facet.P0, facet.P1, facet.P2 };
+        uint32_t        ids[3];
+        //
+        for ( int k = 0; k < 3; ++k )
+        {
+          auto res = nodeIds.insert( { t_nodeKey(P[k]), 0 } );
+          //
+          if ( res.second )
+            res.first->second = m_facetsIdx.AddNode(P[k]);
 
-    // Calculate bounding diagonal
-    Bnd_Box aabb;
-    BRepBndLib::Add(model, aabb);
-    //
-    m_fBoundingDiag = ( aabb.CornerMax().XYZ() - aabb.CornerMin().XYZ() ).Modulus();
+          ids[k] = res.first->second;
+        }
 
-    return true;
-  }
+        m_facetsIdx.Add(ids[0], ids[1], ids[2]);
+      }
+      m_facetsIdx.Shrink();
+    }
 
-  //! Initializes the accelerating structure with the given triangulation.
-  bool init(const Handle(Poly_Triangulation)& mesh)
-  {
-    // Prepare builder
-    myBuilder = new BVH_BinnedBuilder<double, 3, 32>(5, 32);
+    m_storage = storage;
+  }
 
-    // Initialize with the passed facets
-    if ( !this->addTriangulation(mesh, TopLoc_Location(), -1, false) )
-      return false;
+  //! \return active facet storage.
+  FacetStorage GetFacetStorage() const { return m_storage; }
 
-    // Calculate bounding diagonal using fictive face to satisfy OpenCascade's API
-    BRep_Builder BB;
-    TopoDS_Face F;
-    BB.MakeFace(F, mesh);
-    Bnd_Box aabb;
-    BRepBndLib::Add(F, aabb);
-    //
-    m_fBoundingDiag = ( aabb.CornerMax().XYZ() - aabb.CornerMin().XYZ() ).Modulus();
+  //! \return double-precision SoA facets (empty unless activated).
+  const FacetsSoA<double>& GetFacets64() const { return m_facets64; }
 
-    return true;
-  }
+  //! \return single-precision SoA facets (empty unless activated).
+  const FacetsSoA<float>& GetFacets32() const { return m_facets32; }
 
-  //! Adds face to the accelerating structure.
-  bool addFace(const TopoDS_Face& face, const int face_idx)
-  {
-    TopLoc_Location loc;
-    const Handle(Poly_Triangulation)& tris = BRep_Tool::Triangulation(face, loc);
-    return this->addTriangulation( tris, loc, face_idx, (face.Orientation() == TopAbs_REVERSED) );
-  }
+  //! \return indexed single-precision facets (empty unless activated).
+  const FacetsIndexed& GetFacetsIndexed() const { return m_facetsIdx; }
 
-  //! Adds triangulation to the accelerating structure.
-  bool addTriangulation(const Handle(Poly_Triangulation)& triangulation,
-                        const TopLoc_Location&            loc,
-                        const int                         face_idx,
-                        const bool                        isReversed)
+  //! \return memory occupied by the facets in bytes. The AoS facets are
+  //!         kept next to the other storages to rebuild the tree, so they
+  //!         are counted for any storage until the structure is compacted.
+  size_t GetFacetsMemory() const
   {
-    if ( triangulation.IsNull() )
-      return false;
+    const size_t aosBytes = m_facets.capacity()*sizeof(t_facet);
 
-    // Internal collections of triangles and nodes
-    for ( int elemId = 1; elemId <= triangulation->NbTriangles(); ++elemId )
+    switch ( m_storage )
     {
-      const Poly_Triangle& tri = triangulation->Triangle(elemId);
-
-      int n1, n2, n3;
-      tri.Get(n1, n2, n3);
+      case FacetStorage_SoA64:     return aosBytes + m_facets64.GetMemoryFootprint();
+      case FacetStorage_SoA32:     return aosBytes + m_facets32.GetMemoryFootprint();
+      case FacetStorage_Indexed32: return aosBytes + m_facetsIdx.GetMemoryFootprint();
+      default:                     return aosBytes;
+    }
+  }
 
-      gp_Pnt P0 = triangulation->Node(isReversed ? n3 : n1);
-      P0.Transform(loc);
-      //
-      gp_Pnt P1 = triangulation->Node(n2);
-      P1.Transform(loc);
-      //
-      gp_Pnt P2 = triangulation->Node(isReversed ? n1 : n3);
-      P2.Transform(loc);
+  //! Computes angle-weighted pseudo-normals for the nodes and edges of the
+  //! mesh (Baerentzen and Aanaes, 2005). The nodes are identified by their
+  //! exact coordinates, so the seams between the faces are connected as
+  //! long as their nodes coincide. The pseudo-normals are indexed by
+  //! facets, hence the tree is built here if it is not ready yet.
+  void BuildPseudoNormals()
+  {
+    this->BVH();
 
-      // Create a new facet
-      t_facet facet(face_idx == -1 ? elemId : face_idx);
+    const int numFacets = this->Size();
 
-      // Initialize nodes
-      facet.P0 = BVH_Vec3d( P0.X(), P0.Y(), P0.Z() );
-      facet.P1 = BVH_Vec3d( P1.X(), P1.Y(), P1.Z() );
-      facet.P2 = BVH_Vec3d( P2.X(), P2.Y(), P2.Z() );
+    m_pnVertexIds.resize(3*numFacets);
+    m_pnEdgeIds.resize(3*numFacets);
+    m_pnVertices.clear();
+    m_pnEdges.clear();
 
-      /* Initialize normal */
+    // Nodes are shared by coordinates.
+    std::unordered_map<t_nodeKey, int, t_nodeKey::Hasher> nodeIds;
+    //
+    // Edges are shared by the pairs of node indices.
+    std::unordered_map<int64_t, int> edgeIds;
 
-      gp_Vec V1(P0, P1);
-      //
-      if ( V1.SquareMagnitude() < 1e-8 )
-        continue; // Skip invalid facet.
+    for ( int f = 0; f < numFacets; ++f )
+    {
+      BVH_Vec3d P[3];
+      BVH_Vec3d N;
       //
-      V1.Normalize();
+      if ( this->IsCompact() )
+      {
+        // The indexed nodes are shared, so they are welded all the same.
+        m_facetsIdx.Get(f, P[0], P[1], P[2]);
+        N = this->GetPseudoNormal(f, TriFeature_Face);
+      }
+      else
+      {
+        const t_facet& facet = m_facets[f];
+        //
+        P[0] = facet.P0;
+        P[1] = facet.P1;
+        P[2] = facet.P2;
+        N    = BVH_Vec3d( facet.N.X(), facet.N.Y(), facet.N.Z() );
+      }
 
-      gp_Vec V2(P0, P2);
-      //
-      if ( V2.SquareMagnitude() < 1e-8 )
-        continue; // Skip invalid facet.
+      int vids[3];
       //
-      V2.Normalize();
+      for ( int k = 0; k < 3; ++k )
+      {
+        auto res = nodeIds.insert( { t_nodeKey(P[k]), int( m_pnVertices.size() ) } );
+        //
+        if ( res.second )
+          m_pnVertices.push_back( BVH_Vec3d(0., 0., 0.) );
+
+        vids[k]              = res.first->second;
+        m_pnVertexIds[3*f+k] = vids[k];
+
+        // Weight the face normal by the incident angle.
+        BVH_Vec3d a = P[(k + 1) % 3] - P[k];
+        BVH_Vec3d b = P[(k + 2) % 3] - P[k];
+        //
+        const double la = a.Modulus(), lb = b.Modulus();
+        //
+        if ( la > 0. && lb > 0. )
+        {
+          const double cosAngle = std::max( -1., std::min( 1., a.Dot(b)/(la*lb) ) );
+          m_pnVertices[vids[k]] += N*std::acos(cosAngle);
+        }
+      }
 
-      // Compute norm
-      facet.N = V1.Crossed(V2);
-      //
-      if ( facet.N.SquareMagnitude() < 1e-8 )
-        continue; // Skip invalid facet
-      //
-      facet.N.Normalize();
+      // Edges go in the order of TriFeature: 0-1, 1-2, 2-0.
+      for ( int k = 0; k < 3; ++k )
+      {
+        const int     v0  = std::min( vids[k], vids[(k + 1) % 3] );
+        const int     v1  = std::max( vids[k], vids[(k + 1) % 3] );
+        const int64_t key = (int64_t(v0) << 32) | int64_t(v1);
 
-      // Store facet in the internal collection
-      m_facets.push_back(facet);
-    }
+        auto res = edgeIds.insert( { key, int( m_pnEdges.size() ) } );
+        //
+        if ( res.second )
+          m_pnEdges.push_back( BVH_Vec3d(0., 0., 0.) );
 
-    return true;
+        m_pnEdgeIds[3*f+k]              = res.first->second;
+        m_pnEdges[res.first->second] += N;
+      }
+    }
   }
 
-protected:
+  //! \return true if the pseudo-normals are available.
+  bool HasPseudoNormals() const
+  {
+    return !m_pnVertexIds.empty() && m_pnVertexIds.size() == 3*size_t( this->Size() );
+  }
 
-  //! Map of faces constructed by the BVH builder.
-  TopTools_IndexedMapOfShape m_faces;
+  //! Returns the non-normalized pseudo-normal of a facet's feature. Only
+  //! the sign of the dot product with this vector is meaningful.
+  //! \param[in] index   0-based index of the facet.
+  //! \param[in] feature the feature of interest.
+  //! \return pseudo-normal vector.
+  BVH_Vec3d GetPseudoNormal(const int index, const TriFeature feature) const
+  {
+    switch ( feature )
+    {
+      case TriFeature_V0:
+      case TriFeature_V1:
+      case TriFeature_V2:
+        return m_pnVertices[ m_pnVertexIds[3*index + (feature - TriFeature_V0)] ];
+      case TriFeature_E01:
+      case TriFeature_E12:
+      case TriFeature_E20:
+        return m_pnEdges[ m_pnEdgeIds[3*index + (feature - TriFeature_E01)] ];
+      default:
+      {
+        if ( this->IsCompact() )
+        {
+          BVH_Vec3d P0, P1, P2;
+          m_facetsIdx.Get(index, P0, P1, P2);
+
+          const BVH_Vec3d E1 = P1 - P0;
+          const BVH_Vec3d E2 = P2 - P0;
+          const BVH_Vec3d N( E1.y()*E2.z() - E1.z()*E2.y(),
+                             E1.z()*E2.x() - E1.x()*E2.z(),
+                             E1.x()*E2.y() - E1.y()*E2.x() );
+          const double    len = N.Modulus();
+          //
+          return len > 0. ? N/len : N;
+        }
+
+        const gp_Vec& N = m_facets[index].N;
+        return BVH_Vec3d( N.X(), N.Y(), N.Z() );
+      }
+    }
+  }
+
+  //! \return memory occupied by the BVH nodes in bytes.
+  size_t GetNodesMemory()
+  {
+    const opencascade::handle<BVH_Tree<double, 3>>& bvh = this->BVH();
+    //
+    if ( bvh.IsNull() )
+      return 0;
+
+    return bvh->NodeInfoBuffer().capacity()*sizeof(BVH_Vec4i)
+         + bvh->MinPointBuffer().capacity()*sizeof(BVH_Vec3d)
+         + bvh->MaxPointBuffer().capacity()*sizeof(BVH_Vec3d)
+         + m_wideNodes.capacity()*sizeof(t_wideNode)
+         + m_quantNodes.capacity()*sizeof(t_quantNode);
+  }
+
+  //! Converts the structure to the compact form for very large meshes. The
+  //! binary tree is replaced with the quantized one, and the facets are
+  //! moved to the indexed single-precision storage. The double-precision
+  //! facets and nodes are released, so the structure cannot be rebuilt,
+  //! and the other facet storages and the wide tree are not available
+  //! anymore. The pseudo-normals are kept if they were built.
+  //! \return false if the tree is empty or has a leaf of more than 65535
+  //!         facets, in which case the structure is left as is.
+  bool Compact()
+  {
+    if ( this->IsCompact() )
+      return true;
+
+    const BVH_Tree<double, 3>* pBVH = this->BVH().get();
+    if ( pBVH == nullptr || pBVH->NodeInfoBuffer().empty() )
+      return false;
+
+    for ( const BVH_Vec4i& data : pBVH->NodeInfoBuffer() )
+      if ( data.x() != 0 && data.z() - data.y() + 1 > 0xFFFF )
+        return false;
+
+    this->SetWideNodes(false);
+    this->SetFacetStorage(FacetStorage_Indexed32);
+
+    m_quantNodes.reserve( pBVH->NodeInfoBuffer().size()/2 + 1 );
+    this->quantize(pBVH, 0);
+    m_quantNodes.shrink_to_fit();
+
+    // Release the double-precision data.
+    std::vector<t_facet>().swap(m_facets);
+    //
+    myBVH->NodeInfoBuffer().clear(); myBVH->NodeInfoBuffer().shrink_to_fit();
+    myBVH->MinPointBuffer().clear(); myBVH->MinPointBuffer().shrink_to_fit();
+    myBVH->MaxPointBuffer().clear(); myBVH->MaxPointBuffer().shrink_to_fit();
+
+    return true;
+  }
+
+  //! \return true if the structure is compact.
+  bool IsCompact() const { return !m_quantNodes.empty(); }
+
+  //! \return nodes of the quantized tree, the root goes first.
+  const std::vector<t_quantNode>& GetQuantNodes() const { return m_quantNodes; }
+
+  //! Collapses the binary tree into a 4-wide one used by the single-ray
+  //! and distance queries. Each wide node adopts the grandchildren of its
+  //! binary children, opening the child with the largest box first, so
+  //! the traversal is about half as deep. As the facets are not reordered,
+  //! the binary tree is kept. The wide tree is dropped once the binary one
+  //! is marked for rebuilding, while SetBuildParams() collapses it again.
+  //! \param[in] isOn whether to use the wide tree.
+  void SetWideNodes(const bool isOn)
+  {
+    m_wideNodes.clear();
+    //
+    if ( !isOn )
+      return;
+
+    const BVH_Tree<double, 3>* pBVH = this->BVH().get();
+    if ( pBVH == nullptr || pBVH->NodeInfoBuffer().empty() )
+      return;
+
+    m_wideNodes.reserve( pBVH->NodeInfoBuffer().size() / 3 + 1 );
+
+    // The root is a single child of the wide root, so that the binary root
+    // being a leaf needs no special treatment.
+    const int root[1] = { 0 };
+    this->collapseWide(pBVH, root, 1);
+  }
+
+  //! \return true if the 4-wide tree is available.
+  bool HasWideNodes() const { return !m_wideNodes.empty(); }
+
+  //! \return nodes of the 4-wide tree, the root goes first.
+  const std::vector<t_wideNode>& GetWideNodes() const { return m_wideNodes; }
+
+  //! Checks if any facet may pass through the given box. The facets are
+  //! tested by their bounding boxes, so the answer is conservative: false
+  //! means that the box is surely free of facets.
+  //! \param[in] minPt the min corner of the box.
+  //! \param[in] maxPt the max corner of the box.
+  //! \return true if some facet boxes overlap with the passed box.
+  bool HasFacetsInBox(const BVH_Vec3d& minPt, const BVH_Vec3d& maxPt)
+  {
+    if ( this->IsCompact() )
+      return this->hasFacetsInBoxQuant(minPt, maxPt);
+
+    const BVH_Tree<double, 3>* pBVH = this->BVH().get();
+    if ( pBVH == nullptr || pBVH->NodeInfoBuffer().empty() )
+      return false;
+
+    int stack[64];
+    int head = -1;
+    int node =  0; // Root node.
+
+    for ( ; ; )
+    {
+      const BVH_Vec4i& data = pBVH->NodeInfoBuffer()[node];
+
+      const bool isOverlap = !( pBVH->MinPoint(node).x() > maxPt.x() || pBVH->MaxPoint(node).x() < minPt.x()
+                             || pBVH->MinPoint(node).y() > maxPt.y() || pBVH->MaxPoint(node).y() < minPt.y()
+                             || pBVH->MinPoint(node).z() > maxPt.z() || pBVH->MaxPoint(node).z() < minPt.z() );
+
+      if ( isOverlap && data.x() == 0 ) // Inner node.
+      {
+        node          = data.y();
+        stack[++head] = data.z();
+        continue;
+      }
+
+      if ( isOverlap ) // Leaf node.
+      {
+        for ( int tidx = data.y(); tidx <= data.z(); ++tidx )
+        {
+          BVH_Vec3d V0, V1, V2;
+          this->GetVertices(tidx, V0, V1, V2);
+
+          const BVH_Vec3d triMin = V0.cwiseMin(V1).cwiseMin(V2);
+          const BVH_Vec3d triMax = V0.cwiseMax(V1).cwiseMax(V2);
+
+          if ( triMin.x() <= maxPt.x() && triMax.x() >= minPt.x()
+            && triMin.y() <= maxPt.y() && triMax.y() >= minPt.y()
+            && triMin.z() <= maxPt.z() && triMax.z() >= minPt.z() )
+            return true;
+        }
+      }
+
+      if ( head < 0 )
+        return false;
+
+      node = stack[head--];
+    }
+  }
+
+  //! \return characteristic diagonal of the full model.
+  double GetBoundingDiag() const { return m_fBoundingDiag; }
+
+  //! Returns a facet by its 0-based index. The facets are not available
+  //! in the compact structure, use GetVertices() instead.
+  //! \param[in] index index of the facet of interest.
+  //! \return requested facet.
+  const t_facet& GetFacet(const int index) { return m_facets[index]; }
+
+  //! \return AABB of the entire set of objects.
+  virtual BVH_Box<double, 3> Box() const
+  {
+    BVH_Box<double, 3> aabb;
+    const int size = this->Size();
+
+    for ( int i = 0; i < size; ++i )
+    {
+      aabb.Combine( this->Box(i) );
+    }
+    return aabb;
+  }
+
+protected:
+
+  //! Initializes the accelerating structure with the given CAD model.
+  bool init(const TopoDS_Shape& model, const t_buildParams& params)
+  {
+    if ( model.IsNull() )
+      return false;
+
+    // Prepare builder
+    this->SetBuildParams(params);
+
+    // Explode shape on faces to get face indices
+    if ( m_faces.IsEmpty() )
+      TopExp::MapShapes(model, TopAbs_FACE, m_faces);
+
+    // Each face gets a slot per triangle, so that the faces are converted
+    // in parallel right into the facet storage without intermediate
+    // copies. The slots of the skipped facets are squeezed out afterwards.
+    const int numFaces = m_faces.Extent();
+    //
+    std::vector<int> offsets(numFaces + 1, 0);
+    std::vector<int> numAdded(numFaces, 0);
+    //
+    for ( int f = 0; f < numFaces; ++f )
+    {
+      TopLoc_Location loc;
+      const Handle(Poly_Triangulation)&
+        tris = BRep_Tool::Triangulation( TopoDS::Face( m_faces(f + 1) ), loc );
+
+      offsets[f + 1] = offsets[f] + ( tris.IsNull() ? 0 : tris->NbTriangles() );
+    }
+
+    m_facets.resize( offsets[numFaces] );
+
+    OSD_Parallel::For( 0, numFaces, [&](const int f)
+    {
+      const TopoDS_Face& face = TopoDS::Face( m_faces(f + 1) );
+
+      TopLoc_Location loc;
+      const Handle(Poly_Triangulation)& tris = BRep_Tool::Triangulation(face, loc);
+      //
+      if ( tris.IsNull() )
+        return; // Do not fail, just skip as otherwise
+                // BVH will be incorrect for faulty shapes!
+
+      const gp_Trsf& trsf       = loc.Transformation();
+      const bool     isReversed = (face.Orientation() == TopAbs_REVERSED);
+
+      for ( int elemId = 1; elemId <= tris->NbTriangles(); ++elemId )
+      {
+        if ( makeFacet(tris, trsf, elemId, f + 1, isReversed, m_facets[offsets[f] + numAdded[f]]) )
+          numAdded[f]++;
+      }
+    } );
+
+    // The ranges only move towards the beginning, so they do not overlap
+    // the ones yet to be moved.
+    int numFacets = 0;
+    //
+    for ( int f = 0; f < numFaces; ++f )
+    {
+      if ( offsets[f] != numFacets )
+        std::move( m_facets.begin() + offsets[f],
+                   m_facets.begin() + offsets[f] + numAdded[f],
+                   m_facets.begin() + numFacets );
+
+      numFacets += numAdded[f];
+    }
+    //
+    m_facets.resize(numFacets);
+
+    // Calculate bounding diagonal
+    Bnd_Box aabb;
+    BRepBndLib::Add(model, aabb);
+    //
+    m_fBoundingDiag = ( aabb.CornerMax().XYZ() - aabb.CornerMin().XYZ() ).Modulus();
+
+    return true;
+  }
+
+  //! Initializes the accelerating structure with the given triangulation.
+  bool init(const Handle(Poly_Triangulation)& mesh, const t_buildParams& params)
+  {
+    // Prepare builder
+    this->SetBuildParams(params);
+
+    // Initialize with the passed facets
+    if ( !this->addTriangulation(mesh, TopLoc_Location(), -1, false) )
+      return false;
+
+    // Calculate bounding diagonal using fictive face to satisfy OpenCascade's API
+    BRep_Builder BB;
+    TopoDS_Face F;
+    BB.MakeFace(F, mesh);
+    Bnd_Box aabb;
+    BRepBndLib::Add(F, aabb);
+    //
+    m_fBoundingDiag = ( aabb.CornerMax().XYZ() - aabb.CornerMin().XYZ() ).Modulus();
+
+    return true;
+  }
+
+  //! Adds triangulation to the accelerating structure.
+  bool addTriangulation(const Handle(Poly_Triangulation)& triangulation,
+                        const TopLoc_Location&            loc,
+                        const int                         face_idx,
+                        const bool                        isReversed)
+  {
+    if ( triangulation.IsNull() )
+      return false;
+
+    const gp_Trsf& trsf = loc.Transformation();
+
+    // Internal collections of triangles and nodes
+    for ( int elemId = 1; elemId <= triangulation->NbTriangles(); ++elemId )
+    {
+      // Create a new facet
+      t_facet facet;
+      //
+      if ( makeFacet(triangulation, trsf, elemId, face_idx == -1 ? elemId : face_idx, isReversed, facet) )
+        m_facets.push_back(facet); // Store facet in the internal collection
+    }
+
+    return true;
+  }
+
+  //! Initializes a facet with a triangle of the triangulation.
+  //! \param[in]  triangulation the triangulation.
+  //! \param[in]  trsf          the transformation to apply to the nodes.
+  //! \param[in]  elemId        the 1-based index of the triangle.
+  //! \param[in]  face_idx      the index of the host face to store.
+  //! \param[in]  isReversed    whether to flip the triangle.
+  //! \param[out] facet         the facet to initialize.
+  //! \return false if the triangle is degenerated and has to be skipped.
+  static bool makeFacet(const Handle(Poly_Triangulation)& triangulation,
+                        const gp_Trsf&                    trsf,
+                        const int                         elemId,
+                        const int                         face_idx,
+                        const bool                        isReversed,
+                        t_facet&                          facet)
+  {
+    const Poly_Triangle& tri = triangulation->Triangle(elemId);
+
+    int n1, n2, n3;
+    tri.Get(n1, n2, n3);
+
+    gp_Pnt P0 = triangulation->Node(isReversed ? n3 : n1);
+    P0.Transform(trsf);
+    //
+    gp_Pnt P1 = triangulation->Node(n2);
+    P1.Transform(trsf);
+    //
+    gp_Pnt P2 = triangulation->Node(isReversed ? n1 : n3);
+    P2.Transform(trsf);
+
+    facet.FaceIndex = face_idx;
+
+    // Initialize nodes
+    facet.P0 = BVH_Vec3d( P0.X(), P0.Y(), P0.Z() );
+    facet.P1 = BVH_Vec3d( P1.X(), P1.Y(), P1.Z() );
+    facet.P2 = BVH_Vec3d( P2.X(), P2.Y(), P2.Z() );
+
+    /* Initialize normal */
+
+    gp_Vec V1(P0, P1);
+    //
+    if ( V1.SquareMagnitude() < 1e-8 )
+      return false; // Skip invalid facet.
+    //
+    V1.Normalize();
+
+    gp_Vec V2(P0, P2);
+    //
+    if ( V2.SquareMagnitude() < 1e-8 )
+      return false; // Skip invalid facet.
+    //
+    V2.Normalize();
+
+    // Compute norm
+    facet.N = V1.Crossed(V2);
+    //
+    if ( facet.N.SquareMagnitude() < 1e-8 )
+      return false; // Skip invalid facet
+    //
+    facet.N.Normalize();
+
+    return true;
+  }
+
+protected:
+
+  //! Releases the data indexed by the facet order of the current tree: the
+  //! SoA and indexed copies of facets, the wide tree and the pseudo-normals.
+  void clearDerived()
+  {
+    m_facets64.Clear();
+    m_facets32.Clear();
+    m_facetsIdx.Clear();
+    m_storage = FacetStorage_AoS;
+    m_wideNodes.clear();
+    m_pnVertexIds.clear();
+    m_pnEdgeIds.clear();
+    m_pnVertices.clear();
+    m_pnEdges.clear();
+  }
+
+  //! Checks if any facet may pass through the given box using the
+  //! quantized tree. See HasFacetsInBox().
+  bool hasFacetsInBoxQuant(const BVH_Vec3d& minPt, const BVH_Vec3d& maxPt) const
+  {
+    int stack[64];
+    int head = -1;
+    int node =  0; // Root node.
+
+    for ( ; ; )
+    {
+      const t_quantNode& quant = m_quantNodes[node];
+
+      for ( int k = 0; k < 2; ++k )
+      {
+        BVH_Vec3d childMin, childMax;
+        quant.GetChildBox(k, childMin, childMax);
+
+        if ( childMin.x() > maxPt.x() || childMax.x() < minPt.x()
+          || childMin.y() > maxPt.y() || childMax.y() < minPt.y()
+          || childMin.z() > maxPt.z() || childMax.z() < minPt.z() )
+          continue;
+
+        if ( !( quant.LeafMask & (1 << k) ) )
+        {
+          stack[++head] = int( quant.Child[k] );
+          continue;
+        }
+
+        for ( int tidx = int( quant.Child[k] ); tidx < int( quant.Child[k] + quant.Count[k] ); ++tidx )
+        {
+          BVH_Vec3d V0, V1, V2;
+          m_facetsIdx.Get(tidx, V0, V1, V2);
+
+          const BVH_Vec3d triMin = V0.cwiseMin(V1).cwiseMin(V2);
+          const BVH_Vec3d triMax = V0.cwiseMax(V1).cwiseMax(V2);
+
+          if ( triMin.x() <= maxPt.x() && triMax.x() >= minPt.x()
+            && triMin.y() <= maxPt.y() && triMax.y() >= minPt.y()
+            && triMin.z() <= maxPt.z() && triMax.z() >= minPt.z() )
+            return true;
+        }
+      }
+
+      if ( head < 0 )
+        return false;
+
+      node = stack[head--];
+    }
+  }
+
+  //! Creates a quantized node for the given binary node and, recursively,
+  //! for its inner descendants. A leaf root becomes the only child of the
+  //! quantized root.
+  //! \return index of the created node.
+  uint32_t quantize(const BVH_Tree<double, 3>* pBVH, const int node)
+  {
+    const BVH_Vec4i& data        = pBVH->NodeInfoBuffer()[node];
+    const bool       isLeafRoot  = (data.x() != 0);
+    const int        children[2] = { isLeafRoot ? node : data.y(),
+                                     isLeafRoot ? node : data.z() };
+
+    const uint32_t index = uint32_t( m_quantNodes.size() );
+    m_quantNodes.push_back( t_quantNode() );
+
+    uint32_t childIds[2];
+    uint16_t counts[2];
+    uint8_t  leafMask = 0;
+    //
+    for ( int k = 0; k < 2; ++k )
+    {
+      const BVH_Vec4i& childData = pBVH->NodeInfoBuffer()[children[k]];
+      //
+      if ( childData.x() == 0 )
+      {
+        childIds[k] = this->quantize(pBVH, children[k]);
+        counts[k]   = 0;
+      }
+      else
+      {
+        childIds[k] = uint32_t( childData.y() );
+        counts[k]   = uint16_t( (isLeafRoot && k == 1) ? 0 : childData.z() - childData.y() + 1 );
+        leafMask   |= uint8_t(1 << k);
+      }
+    }
+
+    // Fill in after the recursion as it reallocates the nodes.
+    t_quantNode& quant = m_quantNodes[index];
+    quant.LeafMask = leafMask;
+    //
+    for ( int k = 0; k < 2; ++k )
+    {
+      quant.Child[k] = childIds[k];
+      quant.Count[k] = counts[k];
+    }
+
+    const BVH_Vec3d nodeMin = pBVH->MinPoint(node);
+    const BVH_Vec3d nodeMax = pBVH->MaxPoint(node);
+    //
+    for ( int axis = 0; axis < 3; ++axis )
+    {
+      float origin = float(nodeMin[axis]);
+      //
+      if ( origin > nodeMin[axis] )
+        origin = std::nextafter( origin, -std::numeric_limits<float>::max() );
+
+      // The cell size is the power of two that puts the node on 255 cells.
+      int exp = 0;
+      std::frexp( (nodeMax[axis] - origin)/255., &exp );
+      exp = std::max( -128, std::min(127, exp) );
+
+      quant.Origin[axis] = origin;
+      quant.Exp[axis]    = int8_t(exp);
+
+      const double cell = std::ldexp(1., exp);
+      //
+      for ( int k = 0; k < 2; ++k )
+      {
+        const double childMin = pBVH->MinPoint(children[k])[axis];
+        const double childMax = pBVH->MaxPoint(children[k])[axis];
+
+        // Round outwards. The checks use the same expression as decoding.
+        int lo = int( std::max( 0., std::min( 255., std::floor( (childMin - origin)/cell ) ) ) );
+        int hi = int( std::max( 0., std::min( 255., std::ceil ( (childMax - origin)/cell ) ) ) );
+        //
+        while ( lo > 0   && origin + lo*cell > childMin ) --lo;
+        while ( hi < 255 && origin + hi*cell < childMax ) ++hi;
+
+        quant.Lo[k][axis] = uint8_t(lo);
+        quant.Hi[k][axis] = uint8_t(hi);
+      }
+    }
+
+    return index;
+  }
+
+  //! Creates a wide node for the given binary nodes after opening their
+  //! inner nodes while there are free slots. The wide children are
+  //! created recursively.
+  //! \return index of the created wide node.
+  int collapseWide(const BVH_Tree<double, 3>* pBVH,
+                   const int*                 nodes,
+                   const int                  numNodes)
+  {
+    int children[4];
+    int numChildren = numNodes;
+    //
+    std::copy(nodes, nodes + numNodes, children);
+
+    for ( ; numChildren < 4; )
+    {
+      // Open the inner child with the largest box.
+      int    best     = -1;
+      double bestArea = -1.;
+      //
+      for ( int k = 0; k < numChildren; ++k )
+      {
+        if ( pBVH->NodeInfoBuffer()[children[k]].x() != 0 )
+          continue;
+
+        const BVH_Vec3d size = pBVH->MaxPoint(children[k]) - pBVH->MinPoint(children[k]);
+        const double    area = size.x()*size.y() + size.y()*size.z() + size.z()*size.x();
+        //
+        if ( area > bestArea )
+        {
+          best     = k;
+          bestArea = area;
+        }
+      }
+
+      if ( best < 0 )
+        break;
+
+      const BVH_Vec4i& data = pBVH->NodeInfoBuffer()[children[best]];
+      //
+      children[best]          = data.y();
+      children[numChildren++] = data.z();
+    }
+
+    const int index = (int) m_wideNodes.size();
+    m_wideNodes.push_back( t_wideNode() );
+
+    int wideChildren[4];
+    //
+    for ( int k = 0; k < 4; ++k )
+    {
+      wideChildren[k] = -1;
+      //
+      if ( k < numChildren && pBVH->NodeInfoBuffer()[children[k]].x() == 0 )
+        wideChildren[k] = this->collapseWide(pBVH, &children[k], 1);
+    }
+
+    // Fill in after the recursion as it reallocates the nodes. The empty
+    // slots are masked out by the number of children.
+    t_wideNode& wide = m_wideNodes[index];
+    wide.NumChildren = numChildren;
+    //
+    for ( int k = 0; k < 4; ++k )
+    {
+      const int       node  = children[k < numChildren ? k : 0];
+      const BVH_Vec3d minPt = pBVH->MinPoint(node);
+      const BVH_Vec3d maxPt = pBVH->MaxPoint(node);
+
+      wide.MinX[k]  = minPt.x(); wide.MinY[k] = minPt.y(); wide.MinZ[k] = minPt.z();
+      wide.MaxX[k]  = maxPt.x(); wide.MaxY[k] = maxPt.y(); wide.MaxZ[k] = maxPt.z();
+      wide.Child[k] = wideChildren[k];
+      wide.First[k] = k < numChildren ? pBVH->NodeInfoBuffer()[node].y() :  0;
+      wide.Last[k]  = k < numChildren ? pBVH->NodeInfoBuffer()[node].z() : -1;
+    }
+
+    return index;
+  }
+
+protected:
+
+  //! Exact coordinates of a mesh node to weld the coincident nodes.
+  struct t_nodeKey
+  {
+    double X, Y, Z;
+
+    t_nodeKey(const BVH_Vec3d& P) : X( P.x() ), Y( P.y() ), Z( P.z() ) {}
+
+    bool operator==(const t_nodeKey& other) const
+    {
+      return X == other.X && Y == other.Y && Z == other.Z;
+    }
+
+    struct Hasher
+    {
+      size_t operator()(const t_nodeKey& key) const
+      {
+        size_t h = std::hash<double>()(key.X);
+        h ^= std::hash<double>()(key.Y) + 0x9E3779B9 + (h << 6) + (h >> 2);
+        h ^= std::hash<double>()(key.Z) + 0x9E3779B9 + (h << 6) + (h >> 2);
+        return h;
+      }
+    };
+  };
+
+protected:
+
+  //! Map of faces constructed by the BVH builder.
+  TopTools_IndexedMapOfShape m_faces;
 
   //! Array of facets.
   std::vector<t_facet> m_facets;
@@ -311,6 +1422,32 @@ protected:
   //! Characteristic size of the model.
   double m_fBoundingDiag;
 
+  //! Options of BVH construction.
+  t_buildParams m_params;
+
+  //! Facet layout used by the queries.
+  FacetStorage m_storage;
+
+  //! Double-precision SoA copy of facets.
+  FacetsSoA<double> m_facets64;
+
+  //! Single-precision SoA copy of facets.
+  FacetsSoA<float> m_facets32;
+
+  //! Nodes of the 4-wide tree (empty unless activated).
+  std::vector<t_wideNode> m_wideNodes;
+
+  //! Indexed single-precision copy of facets.
+  FacetsIndexed m_facetsIdx;
+
+  //! Nodes of the quantized tree (empty unless compact).
+  std::vector<t_quantNode> m_quantNodes;
+
+  std::vector<int>       m_pnVertexIds; //!< Three node indices per facet.
+  std::vector<int>       m_pnEdgeIds;   //!< Three edge indices per facet.
+  std::vector<BVH_Vec3d> m_pnVertices;  //!< Pseudo-normals of nodes.
+  std::vector<BVH_Vec3d> m_pnEdges;     //!< Pseudo-normals of edges.
+
 };
 
 //-----------------------------------------------------------------------------
@@ -323,25 +1460,52 @@ public:
   //! Tool class describing a ray.
   struct t_ray
   {
-    BVH_Vec3d Origin; //!< Origin point of a ray
-    BVH_Vec3d Direct; //!< Direction vector of a ray
+    BVH_Vec3d Origin;     //!< Origin point of a ray
+    BVH_Vec3d Direct;     //!< Direction vector of a ray
+    bool      IsRelative; //!< Whether the parallel test is relative to the facet size.
 
     //! Default ctor.
-    t_ray() = default;
+    t_ray() : IsRelative(false) {}
 
     //! Creates a new ray with the given origin and direction.
+    //! \param[in] O          the origin point.
+    //! \param[in] D          the unit direction vector.
+    //! \param[in] isRelative whether to reject the facets by the angle to the
+    //!                       ray instead of the non-normalized dot product,
+    //!                       which drops the hits on small facets.
     t_ray(const BVH_Vec3d& O,
-          const BVH_Vec3d& D) : Origin(O), Direct(D) {}
+          const BVH_Vec3d& D,
+          const bool       isRelative = false) : Origin(O), Direct(D), IsRelative(isRelative) {}
+  };
+
+#if defined(__AVX2__)
+  //! Packet of 4 rays having different origins and sharing the same direction.
+  //! The shared direction keeps the packet coherent in the BVH and turns the
+  //! direction-dependent terms of the ray-triangle test into scalars.
+  struct t_rayPacket4
+  {
+    __m256d   OriginX; //!< X coordinates of the ray origins.
+    __m256d   OriginY; //!< Y coordinates of the ray origins.
+    __m256d   OriginZ; //!< Z coordinates of the ray origins.
+    BVH_Vec3d Direct;  //!< Common direction vector of rays.
+  };
+#endif
+
+  //! The way to find out the sign of distance.
+  enum SignMode
+  {
+    SignMode_RayVoting = 0, //!< Parity of random rays, majority vote.
+    SignMode_PseudoNormals  //!< Angle-weighted pseudo-normal of the closest feature.
   };
 
 public:
 
   //! Ctor.
-  MeshDist(const int numRays = 3) : m_iNumRays(numRays), m_RNG(128) {}
+  MeshDist(const int numRays = 3) : m_iNumRays(numRays), m_signMode(SignMode_RayVoting), m_RNG(128) {}
 
   //! Ctor with initialization.
   MeshDist(const Handle(ModelBvh)& facets,
-           const int               numRays = 3) : m_iNumRays(numRays), m_RNG(128)
+           const int               numRays = 3) : m_iNumRays(numRays), m_signMode(SignMode_RayVoting), m_RNG(128)
   {
     this->Init(facets);
   }
@@ -356,12 +1520,40 @@ public:
     return true;
   }
 
-  //! Evaluates function for the given coordinates.
+  //! Sets the way to find out the sign of distance. The pseudo-normals
+  //! are computed here if they are not yet available.
+  //! \param[in] mode the sign mode to use.
+  void SetSignMode(const SignMode mode)
+  {
+    if ( mode == SignMode_PseudoNormals && !m_facets.IsNull() && !m_facets->HasPseudoNormals() )
+      m_facets->BuildPseudoNormals();
+
+    m_signMode = mode;
+  }
+
+  //! \return the way to find out the sign of distance.
+  SignMode GetSignMode() const { return m_signMode; }
+
+  //! \return accelerating structure of the mesh.
+  const Handle(ModelBvh)& GetFacets() const { return m_facets; }
+
+  //! Evaluates function for the given coordinates. This method is not
+  //! thread-safe as it advances the internal random number generator.
   //! \return evaluated distance.
   virtual double Eval(const double x, const double y, const double z) const
   {
-    // Project point on mesh.
-    gp_Pnt P(x, y, z);
+    return this->Eval(x, y, z, m_RNG);
+  }
+
+  //! Evaluates function for the given coordinates using the passed random
+  //! number generator to shoot rays. This method does not modify the
+  //! distance function, so it can be called concurrently, given that each
+  //! thread uses its own generator.
+  //! \return evaluated distance.
+  double Eval(const double x, const double y, const double z, BullardRNG& rng) const
+  {
+    if ( m_signMode == SignMode_PseudoNormals )
+      return this->evalPseudoNormals(x, y, z);
 
     // Get unsigned distance.
     const double
@@ -374,9 +1566,487 @@ public:
     const double ud = Sqrt(d2);
 
     // Check sign by ray casting several times with random direction.
-    bool isOutside = true;
-    int  vote      = 0;
-    int  barrier   = int( std::ceil(double(m_iNumRays) / 2.) );
+    const bool isOutside = this->isOutside(x, y, z, rng);
+
+    return (isOutside ? 1 : -1) * ud;
+  }
+
+  //! Evaluates unsigned distance for the given coordinates.
+  //! \return squared unsigned distance or REAL_MAX for an empty mesh.
+  double EvalSquaredUnsigned(const double x, const double y, const double z) const
+  {
+    return squaredDistanceToMesh( m_facets.get(), BVH_Vec3d(x, y, z) );
+  }
+
+  //! Evaluates unsigned distances for a batch of points. The points are
+  //! sorted along the Morton curve and split into blocks processed in
+  //! parallel, so that the consecutive queries of a block visit mostly
+  //! the same nodes. Each query is bounded by the distance of the previous
+  //! point plus the step between the points, which prunes the far nodes
+  //! from the start. The result is the same as of EvalSquaredUnsigned().
+  //! \param[in]  points   the points to evaluate the distance for.
+  //! \param[out] outDist2   the squared unsigned distances in the order of
+  //!                        the passed points.
+  //! \param[in]  isParallel whether to process the blocks in parallel.
+  void EvalSquaredUnsignedBatch(const std::vector<gp_XYZ>& points,
+                                std::vector<double>&       outDist2,
+                                const bool                 isParallel = true) const
+  {
+    this->evalBatch(points, false, isParallel, outDist2);
+  }
+
+  //! Evaluates signed distances for a batch of points in the same way as
+  //! EvalSquaredUnsignedBatch(). With ray voting, the rays of each point
+  //! are taken from its own random stream seeded by the point index, so
+  //! the result does not depend on the number of threads.
+  //! \param[in]  points     the points to evaluate the distance for.
+  //! \param[out] outDist    the signed distances in the order of the passed
+  //!                        points.
+  //! \param[in]  isParallel whether to process the blocks in parallel.
+  void EvalBatch(const std::vector<gp_XYZ>& points,
+                 std::vector<double>&       outDist,
+                 const bool                 isParallel = true) const
+  {
+    this->evalBatch(points, true, isParallel, outDist);
+  }
+
+  //! Sorts the points along the Z-order (Morton) curve over their bounding
+  //! box, so that the points close in the order are close in space. In the
+  //! parallel mode, the points are split into a block per thread. The
+  //! blocks are bounded, coded and sorted independently, and the sorted
+  //! blocks are then merged pairwise, a round of merges at a time.
+  //! \param[in]  points     the points to sort.
+  //! \param[out] order      the indices of the points in Morton order.
+  //! \param[in]  isParallel whether to process the blocks in parallel.
+  static void GetMortonOrder(const std::vector<gp_XYZ>& points,
+                             std::vector<int>&          order,
+                             const bool                 isParallel = false)
+  {
+    order.resize( points.size() );
+    //
+    if ( points.empty() )
+      return;
+
+    // Small sets are not worth splitting.
+    const int numPts    = int( points.size() );
+    const int numBlocks = isParallel ? Max( Min(OSD_Parallel::NbLogicalProcessors(), numPts/65536), 1 ) : 1;
+    const int blockSize = (numPts + numBlocks - 1) / numBlocks;
+
+    std::vector<gp_XYZ> blockMin(numBlocks, points[0]), blockMax(numBlocks, points[0]);
+    //
+    OSD_Parallel::For( 0, numBlocks, [&](const int block)
+    {
+      const int first = block*blockSize;
+      const int last  = Min(first + blockSize, numPts);
+
+      gp_XYZ& minPt = blockMin[block];
+      gp_XYZ& maxPt = blockMax[block];
+      //
+      for ( int i = first; i < last; ++i )
+      {
+        const gp_XYZ& P = points[i];
+
+        minPt.SetCoord( Min( minPt.X(), P.X() ), Min( minPt.Y(), P.Y() ), Min( minPt.Z(), P.Z() ) );
+        maxPt.SetCoord( Max( maxPt.X(), P.X() ), Max( maxPt.Y(), P.Y() ), Max( maxPt.Z(), P.Z() ) );
+      }
+    }, !isParallel );
+
+    gp_XYZ minPt = blockMin[0], maxPt = blockMax[0];
+    //
+    for ( int block = 1; block < numBlocks; ++block )
+    {
+      const gp_XYZ& bMin = blockMin[block];
+      const gp_XYZ& bMax = blockMax[block];
+
+      minPt.SetCoord( Min( minPt.X(), bMin.X() ), Min( minPt.Y(), bMin.Y() ), Min( minPt.Z(), bMin.Z() ) );
+      maxPt.SetCoord( Max( maxPt.X(), bMax.X() ), Max( maxPt.Y(), bMax.Y() ), Max( maxPt.Z(), bMax.Z() ) );
+    }
+
+    // 21 bits per axis fit into a 64-bit code.
+    const double maxCell = double( (1 << 21) - 1 );
+    const gp_XYZ size    = maxPt - minPt;
+    const gp_XYZ scale( size.X() > 0. ? maxCell/size.X() : 0.,
+                        size.Y() > 0. ? maxCell/size.Y() : 0.,
+                        size.Z() > 0. ? maxCell/size.Z() : 0. );
+
+    std::vector< std::pair<uint64_t, int> > codes( points.size() );
+    //
+    OSD_Parallel::For( 0, numBlocks, [&](const int block)
+    {
+      const int first = block*blockSize;
+      const int last  = Min(first + blockSize, numPts);
+
+      for ( int i = first; i < last; ++i )
+      {
+        const gp_XYZ& P = points[i];
+
+        codes[i].first  = ( expandBits21( uint64_t( (P.X() - minPt.X())*scale.X() ) ) << 2 )
+                        | ( expandBits21( uint64_t( (P.Y() - minPt.Y())*scale.Y() ) ) << 1 )
+                        |   expandBits21( uint64_t( (P.Z() - minPt.Z())*scale.Z() ) );
+        codes[i].second = i;
+      }
+
+      std::sort( codes.begin() + first, codes.begin() + last );
+    }, !isParallel );
+
+    // Merge the neighbor runs of sorted blocks, doubling the run each round.
+    for ( int run = 1; run < numBlocks; run *= 2 )
+    {
+      const int numMerges = (numBlocks + 2*run - 1) / (2*run);
+
+      OSD_Parallel::For( 0, numMerges, [&](const int m)
+      {
+        const int first  = 2*m*run*blockSize;
+        const int middle = Min(first + run*blockSize, numPts);
+        const int last   = Min(middle + run*blockSize, numPts);
+
+        std::inplace_merge( codes.begin() + first,
+                            codes.begin() + middle,
+                            codes.begin() + last );
+      }, !isParallel );
+    }
+
+    OSD_Parallel::For( 0, numBlocks, [&](const int block)
+    {
+      const int first = block*blockSize;
+      const int last  = Min(first + blockSize, numPts);
+
+      for ( int i = first; i < last; ++i )
+        order[i] = codes[i].second;
+    }, !isParallel );
+  }
+
+  //! Computes the upper bound of the squared distance at a point from the
+  //! distance at its neighbor. The bound is slightly inflated, so that the
+  //! closest facet stays strictly below it despite rounding.
+  //! \param[in] prevDist2 the squared distance at the neighbor point.
+  //! \param[in] step      the distance between the points.
+  //! \return the bound to pass as the upper distance of the next query.
+  static double distanceHint(const double prevDist2, const double step)
+  {
+    if ( prevDist2 == REAL_MAX )
+      return REAL_MAX;
+
+    const double bound = ( Sqrt(prevDist2) + step )*(1. + 1e-9);
+    return bound*bound + RealSmall();
+  }
+
+  //! Checks whether the mesh has any point within the given distance from
+  //! the passed coordinates. Contrary to the exact distance query, the
+  //! traversal stops at the first facet closer than the tolerance and
+  //! never descends into the nodes farther than that.
+  //! \param[in] tol the distance tolerance.
+  //! \return true if the point lies in the tolerance band of the mesh.
+  bool IsWithin(const double x, const double y, const double z, const double tol) const
+  {
+    return isMeshWithin( m_facets.get(), BVH_Vec3d(x, y, z), tol*tol );
+  }
+
+  //! Checks the sign of distance for the given coordinates without
+  //! computing the distance itself whenever possible.
+  //! \param[in] rng the random number generator to shoot rays with.
+  //! \return true if the point is inside the mesh.
+  bool IsInside(const double x, const double y, const double z, BullardRNG& rng) const
+  {
+    if ( m_signMode == SignMode_PseudoNormals )
+      return this->evalPseudoNormals(x, y, z) < 0;
+
+    return !this->isOutside(x, y, z, rng);
+  }
+
+  //! Same as the above but shoots rays with the shared random number
+  //! generator. Not thread-safe.
+  bool IsInside(const double x, const double y, const double z) const
+  {
+    return this->IsInside(x, y, z, m_RNG);
+  }
+
+  //! Checks by ray voting which of the points with the given indices are
+  //! inside the mesh. If AVX2 is enabled, rays are traced in packets of 4
+  //! sharing the same random direction, and all rays of the vote are cast
+  //! as there is no early exit per lane. Otherwise, and for the compact
+  //! structure, the points are processed one by one, just like in Eval().
+  //! The rays are taken from the shared random number generator, so the
+  //! method is not thread-safe.
+  //! \param[in]     points  all points.
+  //! \param[in]     indices indices of the points to check.
+  //! \param[in,out] outMask the mask where 1 is set for the inner points.
+  void IsInsideBatch(const std::vector<gp_XYZ>& points,
+                     const std::vector<int>&    indices,
+                     std::vector<uint8_t>&      outMask) const
+  {
+#if defined(__AVX2__)
+    if ( m_facets->IsCompact() )
+    {
+      for ( const int idx : indices )
+      {
+        const gp_XYZ& P = points[idx];
+        //
+        if ( !this->isOutside( P.X(), P.Y(), P.Z(), m_RNG ) )
+          outMask[idx] = 1;
+      }
+      return;
+    }
+
+    const int numIndices = (int) indices.size();
+    //
+    for ( int start = 0; start < numIndices; start += 4 )
+    {
+      const int numLanes = std::min(4, numIndices - start);
+
+      // Gather origins. The incomplete packet is padded with its first point.
+      alignas(32) double ox[4], oy[4], oz[4];
+      //
+      for ( int lane = 0; lane < 4; ++lane )
+      {
+        const gp_XYZ& P = points[ indices[start + (lane < numLanes ? lane : 0)] ];
+        //
+        ox[lane] = P.X();
+        oy[lane] = P.Y();
+        oz[lane] = P.Z();
+      }
+
+      t_rayPacket4 packet;
+      packet.OriginX = _mm256_load_pd(ox);
+      packet.OriginY = _mm256_load_pd(oy);
+      packet.OriginZ = _mm256_load_pd(oz);
+
+      // Vote with all rays. Contrary to Eval(), there is no early exit as
+      // the lanes of a packet may converge at different moments.
+      int votes[4] = {0, 0, 0, 0};
+      //
+      for ( int rayIdx = 0; rayIdx < m_iNumRays; ++rayIdx )
+      {
+        packet.Direct = BVH_Vec3d( m_RNG.RandDouble() * 2.0 - 1.0,
+                                   m_RNG.RandDouble() * 2.0 - 1.0,
+                                   m_RNG.RandDouble() * 2.0 - 1.0 );
+
+        int numBounces[4];
+        rayMeshHitCount4(m_facets.get(), packet, numBounces);
+        //
+        for ( int lane = 0; lane < 4; ++lane )
+          votes[lane] += (numBounces[lane] % 2 != 0) ? -1 : 1;
+      }
+
+      for ( int lane = 0; lane < numLanes; ++lane )
+      {
+        if ( votes[lane] <= 0 )
+          outMask[indices[start + lane]] = 1;
+      }
+    }
+#else
+    for ( const int idx : indices )
+    {
+      const gp_XYZ& P = points[idx];
+      //
+      if ( !this->isOutside( P.X(), P.Y(), P.Z(), m_RNG ) )
+        outMask[idx] = 1;
+    }
+#endif
+  }
+
+  //! Classifies the nodes of a regular grid by casting a single ray along
+  //! each grid column. The hits are sorted along the ray, and the nodes
+  //! lying between the odd and even hits are inside. Contrary to the
+  //! random ray voting, this costs O(N^2) ray casts for N^3 nodes.
+  //!
+  //! The rays are slightly shifted off the columns, so that they do not
+  //! pass through the mesh nodes and edges that often lie on grid lines
+  //! of CAD models. A ray crossing a seam would otherwise be counted twice
+  //! and flip the parity for the rest of the column.
+  //!
+  //! \param[in]     origin   the first grid node.
+  //! \param[in]     step     the grid step.
+  //! \param[in]     numNodes the number of nodes along each axis.
+  //! \param[in]     tol      the tolerance to reject the near-boundary nodes.
+  //! \param[in,out] outMask  the mask where 1 is set for the inner nodes. The
+  //!                         mask is indexed as (i*numNodes[1] + j)*numNodes[2] + k
+  //!                         for the node (i, j, k).
+  void IsInsideGrid(const gp_XYZ&         origin,
+                    const double          step,
+                    const int             numNodes[3],
+                    const double          tol,
+                    std::vector<uint8_t>& outMask) const
+  {
+    // Cast rays along the axis having the most nodes.
+    int axis = 0;
+    //
+    if ( numNodes[1] > numNodes[axis] ) axis = 1;
+    if ( numNodes[2] > numNodes[axis] ) axis = 2;
+    //
+    const int axisU = (axis + 1) % 3;
+    const int axisV = (axis + 2) % 3;
+
+    // Strides in the mask for the first two axes.
+    const size_t strides[2] = { size_t(numNodes[1])*numNodes[2], size_t(numNodes[2]) };
+
+    // Shift of rays off the columns.
+    const double jitter[2] = { 1e-4*step*0.7548776662, 1e-4*step*0.5698402910 };
+
+    const double tol2       = tol*tol;
+    const int    numColumns = numNodes[axisU]*numNodes[axisV];
+
+    OSD_Parallel::For( 0, numColumns, [&](const int col)
+    {
+      const int u = col / numNodes[axisV];
+      const int v = col % numNodes[axisV];
+
+      // The ray starts one step before the first node of the column.
+      BVH_Vec3d O( origin.X(), origin.Y(), origin.Z() );
+      BVH_Vec3d D(0., 0., 0.);
+      //
+      O[axis]  -= step;
+      O[axisU] += u*step + jitter[0];
+      O[axisV] += v*step + jitter[1];
+      D[axis]   = 1.;
+
+      // A missed hit flips the parity for the rest of the column, so the
+      // small facets are not rejected as parallel to the ray.
+      std::vector<double> hits;
+      traceRay( m_facets.get(), t_ray(O, D, true), [&hits](const double t) { hits.push_back(t); } );
+      //
+      std::sort( hits.begin(), hits.end() );
+
+      size_t numPassed = 0;
+      //
+      for ( int w = 0; w < numNodes[axis]; ++w )
+      {
+        const double t = (w + 1)*step;
+
+        while ( numPassed < hits.size() && hits[numPassed] < t )
+          ++numPassed;
+
+        if ( numPassed % 2 == 0 )
+          continue; // Outside.
+
+        // Reject the nodes that are closer than the tolerance to the hits
+        // on the column, and then to any other facet.
+        if ( t - hits[numPassed - 1] <= tol )
+          continue;
+        //
+        if ( numPassed < hits.size() && hits[numPassed] - t <= tol )
+          continue;
+
+        BVH_Vec3d P = O;
+        P[axis] = origin.Coord(axis + 1) + w*step;
+
+        if ( squaredDistanceToMesh(m_facets.get(), P, tol2) < tol2 )
+          continue;
+
+        int index[3];
+        index[axis]  = w;
+        index[axisU] = u;
+        index[axisV] = v;
+        //
+        outMask[size_t(index[0])*strides[0] + size_t(index[1])*strides[1] + index[2]] = 1;
+      }
+    } );
+  }
+
+protected:
+
+  //! Implements the batch distance queries.
+  //! \param[in]  points     the points to evaluate the distance for.
+  //! \param[in]  isSigned   whether to compute the signed distance instead
+  //!                        of the squared unsigned one.
+  //! \param[in]  isParallel whether to process the blocks in parallel.
+  //! \param[out] outDist    the distances in the order of the passed points.
+  void evalBatch(const std::vector<gp_XYZ>& points,
+                 const bool                 isSigned,
+                 const bool                 isParallel,
+                 std::vector<double>&       outDist) const
+  {
+    const int blockSize = 256;
+
+    std::vector<int> order;
+    GetMortonOrder(points, order, isParallel);
+
+    const int numPts    = int( order.size() );
+    const int numBlocks = (numPts + blockSize - 1) / blockSize;
+
+    outDist.assign(points.size(), REAL_MAX);
+
+    OSD_Parallel::For( 0, numBlocks, [&](const int block)
+    {
+      const int first = block*blockSize;
+      const int last  = Min(first + blockSize, numPts);
+
+      double prevDist2 = REAL_MAX;
+      //
+      for ( int i = first; i < last; ++i )
+      {
+        const int     idx   = order[i];
+        const gp_XYZ& P     = points[idx];
+        const double  upper = (i == first) ? REAL_MAX
+                                           : distanceHint( prevDist2, ( P - points[order[i - 1]] ).Modulus() );
+
+        if ( isSigned && m_signMode == SignMode_PseudoNormals )
+        {
+          const double d = this->evalPseudoNormals( P.X(), P.Y(), P.Z(), upper );
+
+          prevDist2    = (d == REAL_MAX) ? REAL_MAX : d*d;
+          outDist[idx] = d;
+          continue;
+        }
+
+        prevDist2 = squaredDistanceToMesh( m_facets.get(), BVH_Vec3d( P.X(), P.Y(), P.Z() ), upper );
+        //
+        if ( !isSigned )
+        {
+          outDist[idx] = prevDist2;
+          continue;
+        }
+
+        if ( prevDist2 == REAL_MAX )
+          continue;
+
+        BullardRNG rng( BullardRNG::StreamSeed( unsigned(idx) ) );
+        //
+        outDist[idx] = ( this->isOutside( P.X(), P.Y(), P.Z(), rng ) ? 1 : -1 ) * Sqrt(prevDist2);
+      }
+    }, !isParallel );
+  }
+
+  //! Evaluates signed distance using the pseudo-normal of the closest
+  //! feature. Unlike the ray voting, this is deterministic and costs a
+  //! single traversal of the tree.
+  //! \param[in] upperDist the upper bound of the squared distance, which
+  //!                      has to be greater than the actual one.
+  //! \return evaluated distance.
+  double evalPseudoNormals(const double x,
+                           const double y,
+                           const double z,
+                           const double upperDist = REAL_MAX) const
+  {
+    const BVH_Vec3d P(x, y, z);
+
+    int          facet = -1;
+    const double d2    = squaredDistanceToMesh(m_facets.get(), P, upperDist, &facet);
+    //
+    if ( facet < 0 )
+      return REAL_MAX;
+
+    BVH_Vec3d A, B, C, closest;
+    m_facets->GetVertices(facet, A, B, C);
+    //
+    const ModelBvh::TriFeature
+      feature = closestPointOnTriangle(P, A, B, C, closest);
+
+    const bool isOutside = ( P - closest ).Dot( m_facets->GetPseudoNormal(facet, feature) ) >= 0.;
+
+    return (isOutside ? 1 : -1) * Sqrt(d2);
+  }
+
+  //! Checks the sign of distance by ray casting several times with random
+  //! direction.
+  //! \return true if the majority of rays say that the point is outside.
+  bool isOutside(const double x,
+                 const double y,
+                 const double z,
+                 BullardRNG&  rng) const
+  {
+    int vote    = 0;
+    int barrier = int( std::ceil(double(m_iNumRays) / 2.) );
 
     for ( int rayIdx = 0; rayIdx < m_iNumRays; ++rayIdx )
     {
@@ -385,9 +2055,9 @@ public:
 
       // Initialize random ray.
       t_ray ray( BVH_Vec3d(x, y, z),
-                 BVH_Vec3d( m_RNG.RandDouble() * 2.0 - 1.0,
-                            m_RNG.RandDouble() * 2.0 - 1.0,
-                            m_RNG.RandDouble() * 2.0 - 1.0) );
+                 BVH_Vec3d( rng.RandDouble() * 2.0 - 1.0,
+                            rng.RandDouble() * 2.0 - 1.0,
+                            rng.RandDouble() * 2.0 - 1.0) );
       //
       const int numBounces = rayMeshHitCount(m_facets.get(), ray);
       //
@@ -401,12 +2071,27 @@ public:
       }
     }
 
-    isOutside = vote > 0;
-
-    return (isOutside ? 1 : -1) * ud;
+    return vote > 0;
   }
 
-protected:
+  //! Checks if a ray is parallel to a facet. The absolute test rejects the
+  //! facets whose area is below the tolerance for any ray direction, while
+  //! the relative one only depends on the angle between them.
+  //! \param[in] ray   the ray of interest.
+  //! \param[in] NdotD the dot product of the non-normalized facet normal and
+  //!                  the ray direction.
+  //! \param[in] N     the non-normalized facet normal.
+  //! \return true if the ray is parallel to the facet.
+  static bool isParallel(const t_ray&     ray,
+                         const double     NdotD,
+                         const BVH_Vec3d& N)
+  {
+    if ( !ray.IsRelative )
+      return Abs(NdotD) < Precision::Confusion();
+
+    // The degenerated facets are parallel to any ray.
+    return NdotD*NdotD <= Precision::SquareConfusion()*N.SquareModulus();
+  }
 
   static double intersectTriangle(const t_ray&     ray,
                                   const BVH_Vec3d& P0,
@@ -423,7 +2108,7 @@ protected:
 
     const double NdotD = N.Dot(ray.Direct);
     //
-    if ( Abs(NdotD) < Precision::Confusion() )
+    if ( isParallel(ray, NdotD, N) )
       return REAL_MAX;
 
     const double InvNdotD = 1.0 / NdotD;
@@ -435,22 +2120,198 @@ protected:
     if ( time < 0.0 )
       return REAL_MAX;
 
-    const BVH_Vec3d direct( ray.Direct.y()*E2.z() - ray.Direct.z()*E2.y(),
-                            ray.Direct.z()*E2.x() - ray.Direct.x()*E2.z(),
-                            ray.Direct.x()*E2.y() - ray.Direct.y()*E2.x() );
+    const BVH_Vec3d direct( ray.Direct.y()*E2.z() - ray.Direct.z()*E2.y(),
+                            ray.Direct.z()*E2.x() - ray.Direct.x()*E2.z(),
+                            ray.Direct.x()*E2.y() - ray.Direct.y()*E2.x() );
+
+    const double U = direct.Dot(E1);
+    const double V = direct.Dot(E0);
+
+    return ( U < 0.0 || V < 0.0 || U + V > 1.0 ) ? REAL_MAX : time;
+  }
+
+  //! Computes number of ray-mesh intersections.
+  static int rayMeshHitCount(ModelBvh* pMesh, const t_ray& ray)
+  {
+    int numBounces = 0;
+    traceRay( pMesh, ray, [&numBounces](const double) { ++numBounces; } );
+    return numBounces;
+  }
+
+  //! Intersects a ray with the facets [first, last] of SoA storage using the
+  //! Moller-Trumbore test on the precomputed edges.
+  template <typename T, typename t_onHit>
+  static void intersectLeafSoA(const t_ray&        ray,
+                               const FacetsSoA<T>& facets,
+                               const int           first,
+                               const int           last,
+                               t_onHit&            onHit)
+  {
+    for ( int tidx = first; tidx <= last; ++tidx )
+    {
+      const BVH_Vec3d E1 = facets.E1(tidx);
+      const BVH_Vec3d E2 = facets.E2(tidx);
+
+      // P = D x E2.
+      const BVH_Vec3d P( ray.Direct.y()*E2.z() - ray.Direct.z()*E2.y(),
+                         ray.Direct.z()*E2.x() - ray.Direct.x()*E2.z(),
+                         ray.Direct.x()*E2.y() - ray.Direct.y()*E2.x() );
+
+      // The determinant equals the dot product of the (non-normalized)
+      // facet normal and the ray direction as in intersectTriangle().
+      const double det = E1.Dot(P);
+      //
+      if ( ray.IsRelative )
+      {
+        const BVH_Vec3d N( E1.y()*E2.z() - E1.z()*E2.y(),
+                           E1.z()*E2.x() - E1.x()*E2.z(),
+                           E1.x()*E2.y() - E1.y()*E2.x() );
+        //
+        if ( isParallel(ray, det, N) )
+          continue;
+      }
+      else if ( Abs(det) < Precision::Confusion() )
+        continue;
+
+      const double    invDet = 1.0 / det;
+      const BVH_Vec3d S      = ray.Origin - facets.P0(tidx);
+
+      const double U = S.Dot(P)*invDet;
+      if ( U < 0.0 || U > 1.0 )
+        continue;
+
+      // Q = S x E1.
+      const BVH_Vec3d Q( S.y()*E1.z() - S.z()*E1.y(),
+                         S.z()*E1.x() - S.x()*E1.z(),
+                         S.x()*E1.y() - S.y()*E1.x() );
+
+      const double V = ray.Direct.Dot(Q)*invDet;
+      if ( V < 0.0 || U + V > 1.0 )
+        continue;
+
+      const double time = E2.Dot(Q)*invDet;
+      if ( time < 0.0 )
+        continue;
+
+      onHit(time);
+    }
+  }
+
+  //! Intersects a ray with the facets [first, last] in the active storage.
+  template <typename t_onHit>
+  static void intersectLeaf(ModelBvh*    pMesh,
+                            const t_ray& ray,
+                            const int    first,
+                            const int    last,
+                            t_onHit&     onHit)
+  {
+    switch ( pMesh->GetFacetStorage() )
+    {
+      case ModelBvh::FacetStorage_SoA64:
+        intersectLeafSoA(ray, pMesh->GetFacets64(), first, last, onHit);
+        break;
+      case ModelBvh::FacetStorage_SoA32:
+        intersectLeafSoA(ray, pMesh->GetFacets32(), first, last, onHit);
+        break;
+      case ModelBvh::FacetStorage_Indexed32:
+        for ( int tidx = first; tidx <= last; ++tidx )
+        {
+          BVH_Vec3d P0, P1, P2;
+          pMesh->GetFacetsIndexed().Get(tidx, P0, P1, P2);
+
+          const double hits = intersectTriangle(ray, P0, P1, P2);
+          //
+          if ( hits != REAL_MAX )
+          {
+            onHit(hits);
+          }
+        }
+        break;
+      default:
+        for ( int tidx = first; tidx <= last; ++tidx )
+        {
+          const ModelBvh::t_facet& facet = pMesh->GetFacet(tidx);
+
+          // Precise test.
+          const double hits = intersectTriangle(ray, facet.P0, facet.P1, facet.P2);
+          //
+          if ( hits != REAL_MAX )
+          {
+            onHit(hits);
+          }
+        }
+    }
+  }
+
+  //! Computes squared distances from a point to the facets [first, last] of
+  //! SoA storage on the precomputed edges. The callback takes the facet index
+  //! and the squared distance and returns true to stop the loop.
+  //! \return true if the loop was stopped by the callback.
+  template <typename T, typename t_onDist>
+  static bool distanceLeafSoA(const BVH_Vec3d&    P,
+                              const FacetsSoA<T>& facets,
+                              const int           first,
+                              const int           last,
+                              t_onDist&           onDist)
+  {
+    for ( int tidx = first; tidx <= last; ++tidx )
+    {
+      if ( onDist( tidx, squaredDistanceToTriangleEdges( P,
+                                                         facets.P0(tidx),
+                                                         facets.E1(tidx),
+                                                         facets.E2(tidx) ) ) )
+        return true;
+    }
+    return false;
+  }
+
+  //! Computes squared distances from a point to the facets [first, last]
+  //! in the active storage. See distanceLeafSoA() for the callback.
+  //! \return true if the loop was stopped by the callback.
+  template <typename t_onDist>
+  static bool distanceLeaf(ModelBvh*        pMesh,
+                           const BVH_Vec3d& P,
+                           const int        first,
+                           const int        last,
+                           t_onDist&        onDist)
+  {
+    switch ( pMesh->GetFacetStorage() )
+    {
+      case ModelBvh::FacetStorage_SoA64:
+        return distanceLeafSoA(P, pMesh->GetFacets64(), first, last, onDist);
+      case ModelBvh::FacetStorage_SoA32:
+        return distanceLeafSoA(P, pMesh->GetFacets32(), first, last, onDist);
+      case ModelBvh::FacetStorage_Indexed32:
+        for ( int tidx = first; tidx <= last; ++tidx )
+        {
+          BVH_Vec3d P0, P1, P2;
+          pMesh->GetFacetsIndexed().Get(tidx, P0, P1, P2);
 
-    const double U = direct.Dot(E1);
-    const double V = direct.Dot(E0);
+          if ( onDist( tidx, squaredDistanceToTriangle(P, P0, P1, P2) ) )
+            return true;
+        }
+        return false;
+      default:
+        for ( int tidx = first; tidx <= last; ++tidx )
+        {
+          const ModelBvh::t_facet& facet = pMesh->GetFacet(tidx);
 
-    return ( U < 0.0 || V < 0.0 || U + V > 1.0 ) ? REAL_MAX : time;
+          if ( onDist( tidx, squaredDistanceToTriangle(P, facet.P0, facet.P1, facet.P2) ) )
+            return true;
+        }
+        return false;
+    }
   }
 
-  //! Computes number of ray-mesh intersections.
-  static int rayMeshHitCount(ModelBvh* pMesh, const t_ray& ray)
+  //! Traces a ray through the mesh and passes the parameter of each
+  //! intersection point to the given callback in no particular order.
+  //! The 4-wide tree is used if available.
+  template <typename t_onHit>
+  static void traceRay(ModelBvh* pMesh, const t_ray& ray, t_onHit onHit)
   {
     const BVH_Tree<double, 3>* pBVH = (pMesh != nullptr) ? pMesh->BVH().get() : nullptr;
     if ( pBVH == nullptr )
-      return 0;
+      return;
 
     // Invert.
     BVH_Vec3d invDirect = ray.Direct.cwiseAbs();
@@ -463,14 +2324,26 @@ protected:
     invDirect.y() = std::copysign( invDirect.y(), ray.Direct.y() );
     invDirect.z() = std::copysign( invDirect.z(), ray.Direct.z() );
 
+    if ( pMesh->IsCompact() )
+    {
+      traceRayQuant(pMesh, ray, invDirect, onHit);
+      return;
+    }
+
+    if ( pMesh->HasWideNodes() )
+    {
+      traceRayWide(pMesh, ray, invDirect, onHit);
+      return;
+    }
+
     int head = -1; // Stack head.
     int node =  0; // Root index.
     int stack[64];
     //
-    for ( int numBounces = 0 ; ; )
+    for ( ; ; )
     {
       if ( node >= (int) pBVH->NodeInfoBuffer().size() )
-        return 0;
+        return;
 
       BVH_Vec4i data = pBVH->NodeInfoBuffer()[node];
 
@@ -514,55 +2387,237 @@ protected:
         else
         {
           if ( head < 0 )
-          {
-            return numBounces;
-          }
+            return;
 
           node = stack[head--];
         }
       }
       else // Leaf node.
       {
-        for ( int tidx = data.y(); tidx <= data.z(); ++tidx )
+        intersectLeaf(pMesh, ray, data.y(), data.z(), onHit);
+
+        if ( head < 0 )
+          return;
+
+        node = stack[head--];
+      }
+    }
+  }
+
+#if defined(__AVX2__)
+  //! Intersects a packet of 4 rays with a triangle. The math replicates
+  //! intersectTriangle() lane by lane, including its treatment of NaNs.
+  //! \return bit mask of the intersected lanes.
+  static int intersectTriangle4(const t_rayPacket4& packet,
+                                const BVH_Vec3d&    P0,
+                                const BVH_Vec3d&    P1,
+                                const BVH_Vec3d&    P2)
+  {
+    const BVH_Vec3d E0 = P1 - P0;
+    const BVH_Vec3d E1 = P0 - P2;
+
+    // Norm vector.
+    const BVH_Vec3d N( E1.y()*E0.z() - E1.z()*E0.y(),
+                       E1.z()*E0.x() - E1.x()*E0.z(),
+                       E1.x()*E0.y() - E1.y()*E0.x() );
+
+    // The direction is common for all lanes, so this check is scalar.
+    const double NdotD = N.Dot(packet.Direct);
+    //
+    if ( Abs(NdotD) < Precision::Confusion() )
+      return 0;
+
+    const __m256d InvNdotD = _mm256_set1_pd(1.0 / NdotD);
+    const __m256d E2x      = _mm256_mul_pd( _mm256_sub_pd( _mm256_set1_pd( P0.x() ), packet.OriginX ), InvNdotD );
+    const __m256d E2y      = _mm256_mul_pd( _mm256_sub_pd( _mm256_set1_pd( P0.y() ), packet.OriginY ), InvNdotD );
+    const __m256d E2z      = _mm256_mul_pd( _mm256_sub_pd( _mm256_set1_pd( P0.z() ), packet.OriginZ ), InvNdotD );
+
+    const __m256d time = dot4(N, E2x, E2y, E2z);
+
+    const __m256d Dx = _mm256_set1_pd( packet.Direct.x() );
+    const __m256d Dy = _mm256_set1_pd( packet.Direct.y() );
+    const __m256d Dz = _mm256_set1_pd( packet.Direct.z() );
+
+    const __m256d directX = _mm256_sub_pd( _mm256_mul_pd(Dy, E2z), _mm256_mul_pd(Dz, E2y) );
+    const __m256d directY = _mm256_sub_pd( _mm256_mul_pd(Dz, E2x), _mm256_mul_pd(Dx, E2z) );
+    const __m256d directZ = _mm256_sub_pd( _mm256_mul_pd(Dx, E2y), _mm256_mul_pd(Dy, E2x) );
+
+    const __m256d U = dot4(E1, directX, directY, directZ);
+    const __m256d V = dot4(E0, directX, directY, directZ);
+
+    // Unordered comparisons keep the lanes with NaNs as hits, just like
+    // the negated checks in the scalar version do.
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d one  = _mm256_set1_pd(1.0);
+    //
+    __m256d hit = _mm256_cmp_pd(time, zero, _CMP_NLT_UQ);
+    hit = _mm256_and_pd( hit, _mm256_cmp_pd(U, zero, _CMP_NLT_UQ) );
+    hit = _mm256_and_pd( hit, _mm256_cmp_pd(V, zero, _CMP_NLT_UQ) );
+    hit = _mm256_and_pd( hit, _mm256_cmp_pd(_mm256_add_pd(U, V), one, _CMP_NGT_UQ) );
+
+    return _mm256_movemask_pd(hit);
+  }
+
+  //! Computes dot products of a scalar vector with 4 vectors stored in SoA.
+  static __m256d dot4(const BVH_Vec3d& A,
+                      const __m256d    Bx,
+                      const __m256d    By,
+                      const __m256d    Bz)
+  {
+    return _mm256_add_pd( _mm256_add_pd( _mm256_mul_pd(_mm256_set1_pd( A.x() ), Bx),
+                                         _mm256_mul_pd(_mm256_set1_pd( A.y() ), By) ),
+                                         _mm256_mul_pd(_mm256_set1_pd( A.z() ), Bz) );
+  }
+
+  //! Tests a packet of 4 rays against a box.
+  //! \param[out] timeEntry the smallest entry time over the hitting lanes.
+  //! \return true if at least one lane hits the box.
+  static bool packetHitsBox(const t_rayPacket4& packet,
+                            const __m256d       invDirect[3],
+                            const BVH_Vec3d&    boxMin,
+                            const BVH_Vec3d&    boxMax,
+                            double&             timeEntry)
+  {
+    const __m256d origin[3] = { packet.OriginX, packet.OriginY, packet.OriginZ };
+
+    __m256d timeStart = _mm256_set1_pd(-REAL_MAX);
+    __m256d timeFinal = _mm256_set1_pd( REAL_MAX);
+    //
+    for ( int axis = 0; axis < 3; ++axis )
+    {
+      const __m256d time0 = _mm256_mul_pd( _mm256_sub_pd( _mm256_set1_pd(boxMin[axis]), origin[axis] ), invDirect[axis] );
+      const __m256d time1 = _mm256_mul_pd( _mm256_sub_pd( _mm256_set1_pd(boxMax[axis]), origin[axis] ), invDirect[axis] );
+
+      timeStart = _mm256_max_pd( timeStart, _mm256_min_pd(time0, time1) );
+      timeFinal = _mm256_min_pd( timeFinal, _mm256_max_pd(time0, time1) );
+    }
+
+    const __m256d hit = _mm256_and_pd( _mm256_cmp_pd(timeStart, timeFinal,           _CMP_LE_OQ),
+                                       _mm256_cmp_pd(timeFinal, _mm256_setzero_pd(), _CMP_GE_OQ) );
+    //
+    const int mask = _mm256_movemask_pd(hit);
+    //
+    if ( !mask )
+      return false;
+
+    // Find the nearest entry among the lanes that hit the box.
+    alignas(32) double times[4];
+    _mm256_store_pd( times, _mm256_blendv_pd(_mm256_set1_pd(REAL_MAX), timeStart, hit) );
+    //
+    timeEntry = std::min( std::min(times[0], times[1]), std::min(times[2], times[3]) );
+    return true;
+  }
+
+  //! Computes number of ray-mesh intersections for a packet of 4 rays.
+  //! A node is entered if any of the rays hits its box, while the exact
+  //! triangle tests keep the per-lane counters identical to the scalar
+  //! rayMeshHitCount().
+  static void rayMeshHitCount4(ModelBvh*           pMesh,
+                               const t_rayPacket4& packet,
+                               int                 numBounces[4])
+  {
+    numBounces[0] = numBounces[1] = numBounces[2] = numBounces[3] = 0;
+
+    const BVH_Tree<double, 3>* pBVH = (pMesh != nullptr) ? pMesh->BVH().get() : nullptr;
+    if ( pBVH == nullptr )
+      return;
+
+    // Invert.
+    BVH_Vec3d invDirect = packet.Direct.cwiseAbs();
+    //
+    invDirect.x() = 1.0 / std::max( std::numeric_limits<double>::epsilon(), invDirect.x() );
+    invDirect.y() = 1.0 / std::max( std::numeric_limits<double>::epsilon(), invDirect.y() );
+    invDirect.z() = 1.0 / std::max( std::numeric_limits<double>::epsilon(), invDirect.z() );
+    //
+    const __m256d invDirect4[3] =
+    {
+      _mm256_set1_pd( std::copysign( invDirect.x(), packet.Direct.x() ) ),
+      _mm256_set1_pd( std::copysign( invDirect.y(), packet.Direct.y() ) ),
+      _mm256_set1_pd( std::copysign( invDirect.z(), packet.Direct.z() ) )
+    };
+
+    int head = -1; // Stack head.
+    int node =  0; // Root index.
+    int stack[64];
+    //
+    for ( ; ; )
+    {
+      if ( node >= (int) pBVH->NodeInfoBuffer().size() )
+        return;
+
+      const BVH_Vec4i& data = pBVH->NodeInfoBuffer()[node];
+
+      if ( data.x() == 0 ) // Inner node.
+      {
+        double timeMin1 = REAL_MAX, timeMin2 = REAL_MAX;
+
+        const bool hitLft = packetHitsBox( packet, invDirect4,
+                                           pBVH->MinPoint( data.y() ),
+                                           pBVH->MaxPoint( data.y() ), timeMin1 );
+
+        const bool hitRgh = packetHitsBox( packet, invDirect4,
+                                           pBVH->MinPoint( data.z() ),
+                                           pBVH->MaxPoint( data.z() ), timeMin2 );
+
+        if ( hitLft && hitRgh )
         {
-          const ModelBvh::t_facet& facet = pMesh->GetFacet(tidx);
+          node = (timeMin1 < timeMin2) ? data.y() : data.z();
 
-          // Get next facet to test
-          const gp_XYZ p0( facet.P0.x(), facet.P0.y(), facet.P0.z() );
-          const gp_XYZ p1( facet.P1.x(), facet.P1.y(), facet.P1.z() );
-          const gp_XYZ p2( facet.P2.x(), facet.P2.y(), facet.P2.z() );
+          stack[++head] = timeMin1 < timeMin2 ? data.z() : data.y();
+        }
+        else if ( hitLft || hitRgh )
+        {
+          node = hitLft ? data.y() : data.z();
+        }
+        else
+        {
+          if ( head < 0 )
+            return;
 
-          const BVH_Vec3d P0( p0.X(), p0.Y(), p0.Z() );
-          const BVH_Vec3d P1( p1.X(), p1.Y(), p1.Z() );
-          const BVH_Vec3d P2( p2.X(), p2.Y(), p2.Z() );
+          node = stack[head--];
+        }
+      }
+      else // Leaf node.
+      {
+        for ( int tidx = data.y(); tidx <= data.z(); ++tidx )
+        {
+          BVH_Vec3d P0, P1, P2;
+          pMesh->GetVertices(tidx, P0, P1, P2);
 
           // Precise test.
-          const double hits = intersectTriangle(ray, P0, P1, P2);
+          const int mask = intersectTriangle4(packet, P0, P1, P2);
           //
-          if ( hits != REAL_MAX )
-          {
-            ++numBounces;
-          }
+          numBounces[0] += (mask >> 0) & 1;
+          numBounces[1] += (mask >> 1) & 1;
+          numBounces[2] += (mask >> 2) & 1;
+          numBounces[3] += (mask >> 3) & 1;
         }
 
         if ( head < 0 )
-        {
-          return numBounces;
-        }
+          return;
 
         node = stack[head--];
       }
     }
   }
+#endif
 
   static double squaredDistanceToTriangle(const BVH_Vec3d& P,
                                           const BVH_Vec3d& A,
                                           const BVH_Vec3d& B,
                                           const BVH_Vec3d& C)
+  {
+    return squaredDistanceToTriangleEdges(P, A, B - A, C - A);
+  }
+
+  //! Same as squaredDistanceToTriangle() on the first node and the edges
+  //! AB = B - A and AC = C - A as kept by the SoA facet storage.
+  static double squaredDistanceToTriangleEdges(const BVH_Vec3d& P,
+                                               const BVH_Vec3d& A,
+                                               const BVH_Vec3d& AB,
+                                               const BVH_Vec3d& AC)
   {
     // Special case 1.
-    const BVH_Vec3d AB = B - A;
-    const BVH_Vec3d AC = C - A;
     const BVH_Vec3d AP = P - A;
     //
     double ABdotAP = AB.Dot(AP);
@@ -574,8 +2629,8 @@ protected:
     }
 
     // Special case 2.
-    const BVH_Vec3d BC = C - B;
-    const BVH_Vec3d BP = P - B;
+    const BVH_Vec3d BC = AC - AB;
+    const BVH_Vec3d BP = AP - AB;
     //
     double BAdotBP = -AB.Dot(BP);
     double BCdotBP =  BC.Dot(BP);
@@ -586,7 +2641,7 @@ protected:
     }
 
     // Special case 3.
-    const BVH_Vec3d CP = P - C;
+    const BVH_Vec3d CP = AP - AC;
     //
     double CBdotCP = -BC.Dot(CP);
     double CAdotCP = -AC.Dot(CP);
@@ -621,7 +2676,106 @@ protected:
 
     // General.
     double norm = VA + VB + VC;
-    return (P - (A*VA + B*VB + C*VC)/norm).SquareModulus();
+    return (AP - (AB*VB + AC*VC)/norm).SquareModulus();
+  }
+
+  //! Finds the point of a triangle closest to the given point. The case
+  //! analysis follows squaredDistanceToTriangle().
+  //! \param[in]  P       the point to project.
+  //! \param[in]  A       the first node of the triangle.
+  //! \param[in]  B       the second node of the triangle.
+  //! \param[in]  C       the third node of the triangle.
+  //! \param[out] closest the closest point.
+  //! \return feature of the triangle containing the closest point.
+  static ModelBvh::TriFeature closestPointOnTriangle(const BVH_Vec3d& P,
+                                                     const BVH_Vec3d& A,
+                                                     const BVH_Vec3d& B,
+                                                     const BVH_Vec3d& C,
+                                                     BVH_Vec3d&       closest)
+  {
+    // Special case 1.
+    const BVH_Vec3d AB = B - A;
+    const BVH_Vec3d AC = C - A;
+    const BVH_Vec3d AP = P - A;
+    //
+    double ABdotAP = AB.Dot(AP);
+    double ACdotAP = AC.Dot(AP);
+    //
+    if ( ABdotAP <= 0.0 && ACdotAP <= 0.0 )
+    {
+      closest = A;
+      return ModelBvh::TriFeature_V0;
+    }
+
+    // Special case 2.
+    const BVH_Vec3d BC = C - B;
+    const BVH_Vec3d BP = P - B;
+    //
+    double BAdotBP = -AB.Dot(BP);
+    double BCdotBP =  BC.Dot(BP);
+    //
+    if ( BAdotBP <= 0.0 && BCdotBP <= 0.0 )
+    {
+      closest = B;
+      return ModelBvh::TriFeature_V1;
+    }
+
+    // Special case 3.
+    const BVH_Vec3d CP = P - C;
+    //
+    double CBdotCP = -BC.Dot(CP);
+    double CAdotCP = -AC.Dot(CP);
+    if ( CAdotCP <= 0.0 && CBdotCP <= 0.0 )
+    {
+      closest = C;
+      return ModelBvh::TriFeature_V2;
+    }
+
+    // Special case 4.
+    double ACdotBP = AC.Dot(BP);
+    double VC      = ABdotAP*ACdotBP + BAdotBP*ACdotAP;
+    //
+    if ( VC <= 0.0 && ABdotAP > 0.0 && BAdotBP > 0.0 )
+    {
+      closest = A + AB*(ABdotAP/(ABdotAP + BAdotBP));
+      return ModelBvh::TriFeature_E01;
+    }
+
+    // Special case 5.
+    double ABdotCP = AB.Dot(CP);
+    double VA      = BAdotBP*CAdotCP - ABdotCP*ACdotBP;
+    if ( VA <= 0.0 && BCdotBP > 0.0 && CBdotCP > 0.0 )
+    {
+      closest = B + BC*(BCdotBP/(BCdotBP + CBdotCP));
+      return ModelBvh::TriFeature_E12;
+    }
+
+    // Special case 6.
+    double VB = ABdotCP*ACdotAP + ABdotAP*CAdotCP;
+    if ( VB <= 0.0 && ACdotAP > 0.0 && CAdotCP > 0.0 )
+    {
+      closest = A + AC*(ACdotAP/(ACdotAP + CAdotCP));
+      return ModelBvh::TriFeature_E20;
+    }
+
+    // General.
+    double norm = VA + VB + VC;
+    closest = (A*VA + B*VB + C*VC)/norm;
+    return ModelBvh::TriFeature_Face;
+  }
+
+  //! Spreads the lower 21 bits of the value, so that there are two zero
+  //! bits between the neighbor ones. Three spread values shifted by 0, 1
+  //! and 2 bits interleave into a Morton code.
+  static uint64_t expandBits21(uint64_t v)
+  {
+    v &= 0x1FFFFFull;
+    v = (v | v << 32) & 0x1F00000000FFFFull;
+    v = (v | v << 16) & 0x1F0000FF0000FFull;
+    v = (v | v << 8)  & 0x100F00F00F00F00Full;
+    v = (v | v << 4)  & 0x10C30C30C30C30C3ull;
+    v = (v | v << 2)  & 0x1249249249249249ull;
+    return v;
   }
 
   static double squaredDistanceToBox(const BVH_Vec3d& P,
@@ -642,19 +2796,124 @@ protected:
     return nearestX*nearestX + nearestY*nearestY + nearestZ*nearestZ;
   }
 
+  //! Checks if any facet of the mesh is not farther than the given
+  //! squared distance from the point.
+  static bool isMeshWithin(ModelBvh*        pMesh,
+                           const BVH_Vec3d& P,
+                           const double     maxDist2)
+  {
+    const BVH_Tree<double, 3>* pBVH = pMesh != nullptr ? pMesh->BVH().get() : nullptr;
+    if ( pBVH == nullptr )
+      return false;
+
+    if ( pMesh->IsCompact() )
+      return isMeshWithinQuant(pMesh, P, maxDist2);
+
+    if ( pMesh->HasWideNodes() )
+      return isMeshWithinWide(pMesh, P, maxDist2);
+
+    int stack[64];
+    int head = -1;
+    int node =  0; // Root node.
+
+    auto isWithin = [maxDist2](const int, const double dist2) { return dist2 <= maxDist2; };
+
+    for ( ; ; )
+    {
+      if ( node >= (int) pBVH->NodeInfoBuffer().size() )
+        return false;
+
+      const BVH_Vec4i& data = pBVH->NodeInfoBuffer()[node];
+
+      if ( data.x() == 0 ) // Inner node.
+      {
+        const double distToLft = squaredDistanceToBox( P,
+                                                       pBVH->MinPoint( data.y() ),
+                                                       pBVH->MaxPoint( data.y() ) );
+
+        const double distToRgh = squaredDistanceToBox( P,
+                                                       pBVH->MinPoint( data.z() ),
+                                                       pBVH->MaxPoint( data.z() ) );
+
+        const bool hitLft = distToLft <= maxDist2;
+        const bool hitRgh = distToRgh <= maxDist2;
+
+        if ( hitLft & hitRgh )
+        {
+          // The nearer child is more likely to have a close facet.
+          node = (distToLft < distToRgh) ? data.y() : data.z();
+
+          stack[++head] = (distToLft < distToRgh) ? data.z() : data.y();
+        }
+        else if ( hitLft | hitRgh )
+        {
+          node = hitLft ? data.y() : data.z();
+        }
+        else
+        {
+          if ( head < 0 )
+            return false;
+
+          node = stack[head--];
+        }
+      }
+      else // Leaf node.
+      {
+        if ( distanceLeaf(pMesh, P, data.y(), data.z(), isWithin) )
+          return true;
+
+        if ( head < 0 )
+          return false;
+
+        node = stack[head--];
+      }
+    }
+  }
+
+  //! Computes squared distance to the mesh.
+  //! \param[in]  pMesh     the mesh.
+  //! \param[in]  P         the point to compute the distance for.
+  //! \param[in]  upperDist the upper bound of the squared distance.
+  //! \param[out] pFacet    the optional index of the closest facet or -1
+  //!                       if there is no facet closer than the upper bound.
+  //! \return squared distance.
   static double squaredDistanceToMesh(ModelBvh*        pMesh,
                                       const BVH_Vec3d& P,
-                                      const double     upperDist = REAL_MAX)
+                                      const double     upperDist = REAL_MAX,
+                                      int*             pFacet    = nullptr)
   {
+    if ( pFacet )
+      *pFacet = -1;
+
     const BVH_Tree<double, 3>* pBVH = pMesh != nullptr ? pMesh->BVH().get() : nullptr;
     if ( pBVH == nullptr )
       return REAL_MAX;
 
+    if ( pMesh->IsCompact() )
+      return squaredDistanceToMeshQuant(pMesh, P, upperDist, pFacet);
+
+    if ( pMesh->HasWideNodes() )
+      return squaredDistanceToMeshWide(pMesh, P, upperDist, pFacet);
+
     std::pair<int, double> stack[64];
     int head = -1;
     int node =  0; // Root node.
 
-    for ( double minDist2 = upperDist; ; )
+    double minDist2 = upperDist;
+    //
+    auto updateMin = [&minDist2, pFacet](const int tidx, const double dist2)
+    {
+      if ( dist2 < minDist2 )
+      {
+        minDist2 = dist2;
+
+        if ( pFacet )
+          *pFacet = tidx;
+      }
+      return false;
+    };
+
+    for ( ; ; )
     {
       if ( node >= (int) pBVH->NodeInfoBuffer().size() )
         return REAL_MAX;
@@ -710,28 +2969,7 @@ protected:
       }
       else // Leaf node.
       {
-        for ( int tidx = data.y(); tidx <= data.z(); ++tidx )
-        {
-          const ModelBvh::t_facet& facet = pMesh->GetFacet(tidx);
-
-          // Get next facet to test
-          const gp_XYZ v0( facet.P0.x(), facet.P0.y(), facet.P0.z() );
-          const gp_XYZ v1( facet.P1.x(), facet.P1.y(), facet.P1.z() );
-          const gp_XYZ v2( facet.P2.x(), facet.P2.y(), facet.P2.z() );
-
-          const BVH_Vec3d V0( v0.X(), v0.Y(), v0.Z() );
-          const BVH_Vec3d V1( v1.X(), v1.Y(), v1.Z() );
-          const BVH_Vec3d V2( v2.X(), v2.Y(), v2.Z() );
-
-          const double triDist2 = squaredDistanceToTriangle(P,
-                                                            V0,
-                                                            V1,
-                                                            V2);
-          if ( triDist2 < minDist2 )
-          {
-            minDist2 = triDist2;
-          }
-        }
+        distanceLeaf(pMesh, P, data.y(), data.z(), updateMin);
 
         if ( head < 0 )
         {
@@ -754,10 +2992,492 @@ protected:
     }
   }
 
+  //! Intersects a ray with all child boxes of a wide node at once.
+  //! \param[in] wide      the wide node.
+  //! \param[in] origin    the ray origin.
+  //! \param[in] invDirect the inverted ray direction.
+  //! \return bit mask of the children hit by the ray.
+  static int rayHitsWideNode(const ModelBvh::t_wideNode& wide,
+                             const BVH_Vec3d&            origin,
+                             const BVH_Vec3d&            invDirect)
+  {
+    const double* mins[3] = { wide.MinX, wide.MinY, wide.MinZ };
+    const double* maxs[3] = { wide.MaxX, wide.MaxY, wide.MaxZ };
+    const double  O[3]    = { origin.x(), origin.y(), origin.z() };
+    const double  invD[3] = { invDirect.x(), invDirect.y(), invDirect.z() };
+
+#if defined(__AVX2__)
+    __m256d timeStart = _mm256_set1_pd(-REAL_MAX);
+    __m256d timeFinal = _mm256_set1_pd( REAL_MAX);
+    //
+    for ( int axis = 0; axis < 3; ++axis )
+    {
+      const __m256d o     = _mm256_set1_pd(O[axis]);
+      const __m256d d     = _mm256_set1_pd(invD[axis]);
+      const __m256d time0 = _mm256_mul_pd( _mm256_sub_pd(_mm256_load_pd(mins[axis]), o), d );
+      const __m256d time1 = _mm256_mul_pd( _mm256_sub_pd(_mm256_load_pd(maxs[axis]), o), d );
+
+      timeStart = _mm256_max_pd( timeStart, _mm256_min_pd(time0, time1) );
+      timeFinal = _mm256_min_pd( timeFinal, _mm256_max_pd(time0, time1) );
+    }
+
+    const __m256d isHit = _mm256_and_pd( _mm256_cmp_pd(timeStart, timeFinal,           _CMP_LE_OQ),
+                                         _mm256_cmp_pd(timeFinal, _mm256_setzero_pd(), _CMP_GE_OQ) );
+
+    return _mm256_movemask_pd(isHit) & ( (1 << wide.NumChildren) - 1 );
+#else
+    int mask = 0;
+    //
+    for ( int k = 0; k < wide.NumChildren; ++k )
+    {
+      double timeStart = -REAL_MAX;
+      double timeFinal =  REAL_MAX;
+      //
+      for ( int axis = 0; axis < 3; ++axis )
+      {
+        const double time0 = (mins[axis][k] - O[axis])*invD[axis];
+        const double time1 = (maxs[axis][k] - O[axis])*invD[axis];
+
+        timeStart = std::max( timeStart, std::min(time0, time1) );
+        timeFinal = std::min( timeFinal, std::max(time0, time1) );
+      }
+
+      if ( timeStart <= timeFinal && timeFinal >= 0 )
+        mask |= (1 << k);
+    }
+    return mask;
+#endif
+  }
+
+  //! Computes squared distances from a point to all child boxes of a wide
+  //! node at once. The values for the empty slots are undefined.
+  //! \param[in]  wide  the wide node.
+  //! \param[in]  P     the point.
+  //! \param[out] dist2 the squared distances.
+  static void squaredDistanceToWideNode(const ModelBvh::t_wideNode& wide,
+                                        const BVH_Vec3d&            P,
+                                        double*                     dist2)
+  {
+    const double* mins[3] = { wide.MinX, wide.MinY, wide.MinZ };
+    const double* maxs[3] = { wide.MaxX, wide.MaxY, wide.MaxZ };
+    const double  C[3]    = { P.x(), P.y(), P.z() };
+
+#if defined(__AVX2__)
+    __m256d sum = _mm256_setzero_pd();
+    //
+    for ( int axis = 0; axis < 3; ++axis )
+    {
+      const __m256d c       = _mm256_set1_pd(C[axis]);
+      const __m256d nearest = _mm256_min_pd( _mm256_max_pd( c, _mm256_load_pd(mins[axis]) ),
+                                             _mm256_load_pd(maxs[axis]) );
+      const __m256d delta   = _mm256_sub_pd(nearest, c);
+
+      sum = _mm256_add_pd( sum, _mm256_mul_pd(delta, delta) );
+    }
+    _mm256_storeu_pd(dist2, sum);
+#else
+    for ( int k = 0; k < 4; ++k )
+    {
+      dist2[k] = 0.;
+      //
+      for ( int axis = 0; axis < 3; ++axis )
+      {
+        const double delta = std::min( std::max( C[axis], mins[axis][k] ), maxs[axis][k] ) - C[axis];
+        dist2[k] += delta*delta;
+      }
+    }
+#endif
+  }
+
+  //! Sorts the children of a wide node by the distances to their boxes.
+  //! \param[in]  dist2       the squared distances to the child boxes.
+  //! \param[in]  numChildren the number of children.
+  //! \param[out] order       the slots from the nearest child to the farthest.
+  static void sortWideChildren(const double* dist2,
+                               const int     numChildren,
+                               int*          order)
+  {
+    for ( int k = 0; k < numChildren; ++k )
+    {
+      int j = k;
+      //
+      for ( ; j > 0 && dist2[order[j - 1]] > dist2[k]; --j )
+        order[j] = order[j - 1];
+
+      order[j] = k;
+    }
+  }
+
+  //! Traces a ray through the 4-wide tree. See traceRay().
+  template <typename t_onHit>
+  static void traceRayWide(ModelBvh*        pMesh,
+                           const t_ray&     ray,
+                           const BVH_Vec3d& invDirect,
+                           t_onHit&         onHit)
+  {
+    const std::vector<ModelBvh::t_wideNode>& nodes = pMesh->GetWideNodes();
+
+    int head = -1; // Stack head.
+    int node =  0; // Root index.
+    int stack[128];
+    //
+    for ( ; ; )
+    {
+      const ModelBvh::t_wideNode& wide = nodes[node];
+      const int                   hits = rayHitsWideNode(wide, ray.Origin, invDirect);
+
+      for ( int k = 0; k < 4; ++k )
+      {
+        if ( !( hits & (1 << k) ) )
+          continue;
+
+        if ( wide.Child[k] < 0 ) // Leaf child.
+          intersectLeaf(pMesh, ray, wide.First[k], wide.Last[k], onHit);
+        else
+          stack[++head] = wide.Child[k];
+      }
+
+      if ( head < 0 )
+        return;
+
+      node = stack[head--];
+    }
+  }
+
+  //! Same as isMeshWithin() for the 4-wide tree.
+  static bool isMeshWithinWide(ModelBvh*        pMesh,
+                               const BVH_Vec3d& P,
+                               const double     maxDist2)
+  {
+    const std::vector<ModelBvh::t_wideNode>& nodes = pMesh->GetWideNodes();
+
+    int stack[128];
+    int head = -1;
+    int node =  0; // Root node.
+
+    auto isWithin = [maxDist2](const int, const double dist2) { return dist2 <= maxDist2; };
+
+    for ( ; ; )
+    {
+      const ModelBvh::t_wideNode& wide = nodes[node];
+
+      alignas(32) double dist2[4];
+      int                order[4];
+      //
+      squaredDistanceToWideNode(wide, P, dist2);
+      sortWideChildren(dist2, wide.NumChildren, order);
+
+      // Check the leaves from the nearest one and push the inner children
+      // so that the nearest one is popped first.
+      for ( int k = wide.NumChildren - 1; k >= 0; --k )
+      {
+        const int c = order[k];
+        //
+        if ( dist2[c] > maxDist2 || wide.Child[c] < 0 )
+          continue;
+
+        stack[++head] = wide.Child[c];
+      }
+      //
+      for ( int k = 0; k < wide.NumChildren; ++k )
+      {
+        const int c = order[k];
+        //
+        if ( dist2[c] > maxDist2 )
+          break;
+
+        if ( wide.Child[c] >= 0 )
+          continue;
+
+        if ( distanceLeaf(pMesh, P, wide.First[c], wide.Last[c], isWithin) )
+          return true;
+      }
+
+      if ( head < 0 )
+        return false;
+
+      node = stack[head--];
+    }
+  }
+
+  //! Same as squaredDistanceToMesh() for the 4-wide tree.
+  static double squaredDistanceToMeshWide(ModelBvh*        pMesh,
+                                          const BVH_Vec3d& P,
+                                          const double     upperDist,
+                                          int*             pFacet)
+  {
+    const std::vector<ModelBvh::t_wideNode>& nodes = pMesh->GetWideNodes();
+
+    std::pair<int, double> stack[128];
+    int head = -1;
+    int node =  0; // Root node.
+
+    double minDist2 = upperDist;
+    //
+    auto updateMin = [&minDist2, pFacet](const int tidx, const double dist2)
+    {
+      if ( dist2 < minDist2 )
+      {
+        minDist2 = dist2;
+
+        if ( pFacet )
+          *pFacet = tidx;
+      }
+      return false;
+    };
+
+    for ( ; ; )
+    {
+      const ModelBvh::t_wideNode& wide = nodes[node];
+
+      alignas(32) double dist2[4];
+      int                order[4];
+      int                inner[4];
+      int                numInner = 0;
+      //
+      squaredDistanceToWideNode(wide, P, dist2);
+      sortWideChildren(dist2, wide.NumChildren, order);
+
+      // Process the leaves from the nearest one, so that the bound gets
+      // tighter for the farther children.
+      for ( int k = 0; k < wide.NumChildren; ++k )
+      {
+        const int c = order[k];
+        //
+        if ( dist2[c] > minDist2 )
+          break;
+
+        if ( wide.Child[c] >= 0 )
+        {
+          inner[numInner++] = c;
+          continue;
+        }
+
+        distanceLeaf(pMesh, P, wide.First[c], wide.Last[c], updateMin);
+      }
+
+      // The nearest inner child goes on top of the stack.
+      for ( int k = numInner - 1; k >= 0; --k )
+        stack[++head] = std::make_pair( wide.Child[inner[k]], dist2[inner[k]] );
+
+      for ( ; ; )
+      {
+        if ( head < 0 )
+          return minDist2;
+
+        const std::pair<int, double>& entry = stack[head--];
+        //
+        if ( entry.second <= minDist2 )
+        {
+          node = entry.first;
+          break;
+        }
+      }
+    }
+  }
+
+  //! Checks if a ray hits the box.
+  static bool rayHitsBox(const BVH_Vec3d& origin,
+                         const BVH_Vec3d& invDirect,
+                         const BVH_Vec3d& boxMin,
+                         const BVH_Vec3d& boxMax)
+  {
+    const BVH_Vec3d time0 = (boxMin - origin) * invDirect;
+    const BVH_Vec3d time1 = (boxMax - origin) * invDirect;
+
+    const BVH_Vec3d timeMax = time0.cwiseMax(time1);
+    const BVH_Vec3d timeMin = time0.cwiseMin(time1);
+
+    const double timeFinal = std::min( timeMax.x(), std::min( timeMax.y(), timeMax.z() ) );
+    const double timeStart = std::max( timeMin.x(), std::max( timeMin.y(), timeMin.z() ) );
+
+    return (timeStart <= timeFinal) && (timeFinal >= 0);
+  }
+
+  //! Traces a ray through the quantized tree. See traceRay().
+  template <typename t_onHit>
+  static void traceRayQuant(ModelBvh*        pMesh,
+                            const t_ray&     ray,
+                            const BVH_Vec3d& invDirect,
+                            t_onHit&         onHit)
+  {
+    const std::vector<ModelBvh::t_quantNode>& nodes = pMesh->GetQuantNodes();
+
+    int head = -1; // Stack head.
+    int node =  0; // Root index.
+    int stack[64];
+    //
+    for ( ; ; )
+    {
+      const ModelBvh::t_quantNode& quant = nodes[node];
+
+      for ( int k = 0; k < 2; ++k )
+      {
+        BVH_Vec3d boxMin, boxMax;
+        quant.GetChildBox(k, boxMin, boxMax);
+
+        if ( !rayHitsBox(ray.Origin, invDirect, boxMin, boxMax) )
+          continue;
+
+        if ( quant.LeafMask & (1 << k) )
+          intersectLeaf(pMesh, ray, int( quant.Child[k] ), int( quant.Child[k] + quant.Count[k] ) - 1, onHit);
+        else
+          stack[++head] = int( quant.Child[k] );
+      }
+
+      if ( head < 0 )
+        return;
+
+      node = stack[head--];
+    }
+  }
+
+  //! Same as isMeshWithin() for the quantized tree.
+  static bool isMeshWithinQuant(ModelBvh*        pMesh,
+                                const BVH_Vec3d& P,
+                                const double     maxDist2)
+  {
+    const std::vector<ModelBvh::t_quantNode>& nodes = pMesh->GetQuantNodes();
+
+    int stack[64];
+    int head = -1;
+    int node =  0; // Root node.
+
+    auto isWithin = [maxDist2](const int, const double dist2) { return dist2 <= maxDist2; };
+
+    for ( ; ; )
+    {
+      const ModelBvh::t_quantNode& quant = nodes[node];
+
+      double dist2[2];
+      //
+      for ( int k = 0; k < 2; ++k )
+      {
+        BVH_Vec3d boxMin, boxMax;
+        quant.GetChildBox(k, boxMin, boxMax);
+
+        dist2[k] = squaredDistanceToBox(P, boxMin, boxMax);
+      }
+
+      // The nearer child is more likely to have a close facet, so it goes
+      // first if it is a leaf and last onto the stack otherwise.
+      const int order[2] = { dist2[1] < dist2[0] ? 1 : 0, dist2[1] < dist2[0] ? 0 : 1 };
+      //
+      for ( int i = 1; i >= 0; --i )
+      {
+        const int k = order[i];
+        //
+        if ( dist2[k] <= maxDist2 && !( quant.LeafMask & (1 << k) ) )
+          stack[++head] = int( quant.Child[k] );
+      }
+      //
+      for ( int i = 0; i < 2; ++i )
+      {
+        const int k = order[i];
+        //
+        if ( dist2[k] > maxDist2 || !( quant.LeafMask & (1 << k) ) )
+          continue;
+
+        if ( distanceLeaf( pMesh, P, int( quant.Child[k] ),
+                           int( quant.Child[k] + quant.Count[k] ) - 1, isWithin ) )
+          return true;
+      }
+
+      if ( head < 0 )
+        return false;
+
+      node = stack[head--];
+    }
+  }
+
+  //! Same as squaredDistanceToMesh() for the quantized tree.
+  static double squaredDistanceToMeshQuant(ModelBvh*        pMesh,
+                                           const BVH_Vec3d& P,
+                                           const double     upperDist,
+                                           int*             pFacet)
+  {
+    const std::vector<ModelBvh::t_quantNode>& nodes = pMesh->GetQuantNodes();
+
+    std::pair<int, double> stack[64];
+    int head = -1;
+    int node =  0; // Root node.
+
+    double minDist2 = upperDist;
+    //
+    auto updateMin = [&minDist2, pFacet](const int tidx, const double dist2)
+    {
+      if ( dist2 < minDist2 )
+      {
+        minDist2 = dist2;
+
+        if ( pFacet )
+          *pFacet = tidx;
+      }
+      return false;
+    };
+
+    for ( ; ; )
+    {
+      const ModelBvh::t_quantNode& quant = nodes[node];
+
+      double dist2[2];
+      //
+      for ( int k = 0; k < 2; ++k )
+      {
+        BVH_Vec3d boxMin, boxMax;
+        quant.GetChildBox(k, boxMin, boxMax);
+
+        dist2[k] = squaredDistanceToBox(P, boxMin, boxMax);
+      }
+
+      // Process a leaf from the nearer child, so that the bound gets tighter
+      // for the farther one.
+      const int order[2] = { dist2[1] < dist2[0] ? 1 : 0, dist2[1] < dist2[0] ? 0 : 1 };
+      int       inner[2];
+      int       numInner = 0;
+      //
+      for ( int i = 0; i < 2; ++i )
+      {
+        const int k = order[i];
+        //
+        if ( dist2[k] > minDist2 )
+          break;
+
+        if ( !( quant.LeafMask & (1 << k) ) )
+        {
+          inner[numInner++] = k;
+          continue;
+        }
+
+        distanceLeaf( pMesh, P, int( quant.Child[k] ),
+                      int( quant.Child[k] + quant.Count[k] ) - 1, updateMin );
+      }
+
+      // The nearer inner child goes on top of the stack.
+      for ( int i = numInner - 1; i >= 0; --i )
+        stack[++head] = std::make_pair( int( quant.Child[inner[i]] ), dist2[inner[i]] );
+
+      for ( ; ; )
+      {
+        if ( head < 0 )
+          return minDist2;
+
+        const std::pair<int, double>& entry = stack[head--];
+        //
+        if ( entry.second <= minDist2 )
+        {
+          node = entry.first;
+          break;
+        }
+      }
+    }
+  }
+
 protected:
 
   Handle(ModelBvh)   m_facets;   //!< BVH for shape represented with facets.
   int                m_iNumRays; //!< Number of rays to check distance sign.
+  SignMode           m_signMode; //!< The way to find out the sign of distance.
   mutable BullardRNG m_RNG;      //!< Random number generator.
 
 };
@@ -768,21 +3488,160 @@ class ClassifyPt
 {
 public:
 
-  ClassifyPt(const Handle(Poly_Triangulation)& mesh)
+  ClassifyPt(const Handle(Poly_Triangulation)& mesh,
+             const ModelBvh::t_buildParams&    params = ModelBvh::t_buildParams())
   {
     m_tris = mesh;
-    m_bvh  = new ModelBvh(mesh);
+    m_bvh  = new ModelBvh(mesh, params);
+    m_dist = new MeshDist(m_bvh);
+
+    // Build the tree right away as the lazy construction on the first
+    // query is not safe for concurrent queries.
+    m_bvh->BVH();
+  }
+
+  //! Creates the classifier for the meshed shape. The facets are taken
+  //! right from the face triangulations, which are converted in parallel.
+  //! The face triangulations are not welded, which does not matter for
+  //! the distance and ray queries.
+  ClassifyPt(const TopoDS_Shape&            shape,
+             const ModelBvh::t_buildParams& params = ModelBvh::t_buildParams())
+  {
+    m_bvh  = new ModelBvh(shape, params);
     m_dist = new MeshDist(m_bvh);
+
+    m_bvh->BVH();
+  }
+
+  //! Creates the classifier for the existing accelerating structure, e.g.,
+  //! the one restored from cache.
+  ClassifyPt(const Handle(ModelBvh)& bvh)
+  {
+    m_bvh  = bvh;
+    m_dist = new MeshDist(m_bvh);
+
+    m_bvh->BVH();
   }
 
+  //! Checks if the point is inside and farther than the tolerance from the
+  //! boundary. The points in the tolerance band are rejected by a bounded
+  //! distance query without shooting any rays.
   bool IsIn(const gp_XYZ& pt, const double tol)
   {
-    const double d = m_dist->Eval( pt.X(), pt.Y(), pt.Z() );
-    return (d < 0) && (Abs(d) > tol);
+    return this->isIn(pt, tol, nullptr);
+  }
+
+  //! Classifies the nodes of a regular grid with one ray per grid column.
+  //! See MeshDist::IsInsideGrid() for details.
+  //! \param[in]  origin   the first grid node.
+  //! \param[in]  step     the grid step.
+  //! \param[in]  numNodes the number of nodes along each axis.
+  //! \param[in]  tol      the tolerance to reject the near-boundary nodes.
+  //! \param[out] outMask  the output mask with 1 for the inner nodes. The
+  //!                      node (i, j, k) goes to (i*numNodes[1] + j)*numNodes[2] + k.
+  void IsInGrid(const gp_XYZ&         origin,
+                const double          step,
+                const int             numNodes[3],
+                const double          tol,
+                std::vector<uint8_t>& outMask) const
+  {
+    outMask.assign(size_t(numNodes[0])*numNodes[1]*numNodes[2], 0);
+    m_dist->IsInsideGrid(origin, step, numNodes, tol, outMask);
+  }
+
+  //! Sets the way to find out whether a point is inside.
+  //! \param[in] mode the sign mode of the distance function.
+  void SetSignMode(const MeshDist::SignMode mode)
+  {
+    m_dist->SetSignMode(mode);
+  }
+
+  //! \return accelerating structure of the classifier.
+  const Handle(ModelBvh)& GetBvh() const { return m_bvh; }
+
+  //! \return distance function of the classifier.
+  const Handle(MeshDist)& GetDist() const { return m_dist; }
+
+  //! Thread-safe version of IsIn() that takes rays from the passed random
+  //! number generator instead of the shared one.
+  bool IsIn(const gp_XYZ& pt, const double tol, BullardRNG& rng) const
+  {
+    return this->isIn(pt, tol, &rng);
+  }
+
+  //! Classifies a batch of points. The points are processed in Morton
+  //! order to keep the visited nodes in cache, and the rays are traced in
+  //! packets if the code is compiled with AVX2 support. The tolerance band
+  //! is checked first, so that no rays are cast for the points near the
+  //! boundary. With pseudo-normals, or without AVX2, the result is the same
+  //! as calling IsIn() for each point in Morton order. The packets draw a
+  //! single random direction for their 4 points, so with AVX2 the result
+  //! agrees with IsIn() only statistically, i.e., the points where the
+  //! ray voting is ambiguous may be classified differently. The rays come
+  //! from the shared random number generator, so the method is not
+  //! thread-safe; use IsIn() with a generator per thread instead.
+  //! \param[in]  points  the points to classify.
+  //! \param[in]  tol     the tolerance to reject the near-boundary points.
+  //! \param[out] outMask the output mask with 1 for the inner points and 0
+  //!                     for all others.
+  void IsInBatch(const std::vector<gp_XYZ>& points,
+                 const double               tol,
+                 std::vector<uint8_t>&      outMask)
+  {
+    outMask.assign(points.size(), 0);
+
+    // The pseudo-normals give the sign in the same traversal as the
+    // distance, so the batch distance query does all the work.
+    if ( m_dist->GetSignMode() == MeshDist::SignMode_PseudoNormals )
+    {
+      std::vector<double> dist;
+      m_dist->EvalBatch(points, dist, false);
+      //
+      for ( size_t i = 0; i < points.size(); ++i )
+      {
+        if ( (dist[i] < 0) && (Abs(dist[i]) > tol) )
+          outMask[i] = 1;
+      }
+      return;
+    }
+
+    std::vector<int> order;
+    MeshDist::GetMortonOrder(points, order);
+
+    // Select the points which are far enough from the boundary. The
+    // candidates stay in Morton order, so the ray packets are coherent.
+    std::vector<int> candidates;
+    candidates.reserve( points.size() );
+    //
+    for ( const int i : order )
+    {
+      if ( !m_dist->IsWithin( points[i].X(), points[i].Y(), points[i].Z(), tol ) )
+        candidates.push_back(i);
+    }
+
+    // Check the sign of the remaining points with rays.
+    m_dist->IsInsideBatch(points, candidates, outMask);
   }
 
 protected:
 
+  //! Implements IsIn() for the passed or the shared random number generator.
+  bool isIn(const gp_XYZ& pt, const double tol, BullardRNG* pRng) const
+  {
+    // The pseudo-normals give the sign together with the exact distance.
+    if ( m_dist->GetSignMode() == MeshDist::SignMode_PseudoNormals )
+    {
+      const double d = m_dist->Eval( pt.X(), pt.Y(), pt.Z() );
+      return (d < 0) && (Abs(d) > tol);
+    }
+
+    if ( m_dist->IsWithin( pt.X(), pt.Y(), pt.Z(), tol ) )
+      return false;
+
+    return pRng ? m_dist->IsInside( pt.X(), pt.Y(), pt.Z(), *pRng )
+                : m_dist->IsInside( pt.X(), pt.Y(), pt.Z() );
+  }
+
   Handle(Poly_Triangulation) m_tris;
   Handle(ModelBvh)           m_bvh;
   Handle(MeshDist)           m_dist;
@@ -0,0 +1,120 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2020-present, Quaoar Studio
+// All rights reserved.
+//-----------------------------------------------------------------------------
+
+#ifndef ClassifyPtParallel_h
+#define ClassifyPtParallel_h
+
+// Local includes
+#include "ClassifyPt.h"
+
+// OpenCascade includes
+#include <OSD_ThreadPool.hxx>
+
+// Standard includes
+#include <numeric>
+
+//-----------------------------------------------------------------------------
+
+//! Multi-threaded driver for point membership classification with a
+//! shared ClassifyPt instance. The points are sorted along the Morton
+//! curve and split into chunks that are handed out to the threads of
+//! OpenCascade's pool on demand, so that the threads finishing early pick
+//! up the remaining work. A chunk thus covers a compact region, and its
+//! queries keep hitting the same tree nodes in cache. The sort itself
+//! runs in parallel unless a single thread is requested.
+//!
+//! Each point gets its own random stream seeded by the point index. The
+//! result is therefore the same for any number of threads and for any
+//! order in which the chunks are processed.
+class ClassifyPtParallel
+{
+public:
+
+  //! Ctor.
+  //! \param[in] classifier    the classifier to share between threads.
+  //! \param[in] chunkSize     the number of points in a single work item.
+  //! \param[in] isMortonOrder whether to sort the points along the Morton
+  //!                          curve. Pass false for the points that are
+  //!                          coherent already, e.g., those of a grid.
+  ClassifyPtParallel(const ClassifyPt& classifier,
+                     const int         chunkSize     = 1024,
+                     const bool        isMortonOrder = true)
+  //
+  : m_classifier   (classifier),
+    m_iChunkSize   (Max(chunkSize, 1)),
+    m_bMortonOrder (isMortonOrder)
+  {}
+
+public:
+
+  //! Classifies the passed points.
+  //! \param[in]  points     the points to classify.
+  //! \param[in]  tol        the tolerance to reject the near-boundary points.
+  //! \param[out] outMask    the output mask with 1 for the inner points and
+  //!                        0 for all others.
+  //! \param[in]  numThreads the max number of threads to use. Pass -1 to
+  //!                        use all threads of the default pool.
+  //! \param[in]  firstIndex the index of the first point in the random
+  //!                        streams. Passing the offset of a chunk in a
+  //!                        larger set gives the same result as for the
+  //!                        whole set.
+  void Perform(const std::vector<gp_XYZ>& points,
+               const double               tol,
+               std::vector<uint8_t>&      outMask,
+               const int                  numThreads = -1,
+               const size_t               firstIndex = 0) const
+  {
+    const int numPts    = int( points.size() );
+    const int numChunks = (numPts + m_iChunkSize - 1) / m_iChunkSize;
+
+    std::vector<int> order;
+    //
+    if ( m_bMortonOrder )
+    {
+      MeshDist::GetMortonOrder(points, order, numThreads != 1);
+    }
+    else
+    {
+      order.resize( points.size() );
+      std::iota( order.begin(), order.end(), 0 );
+    }
+
+    // Each point is written by a single chunk, so no sync is needed.
+    outMask.assign(points.size(), 0);
+
+    OSD_ThreadPool::Launcher launcher(*OSD_ThreadPool::DefaultPool(), numThreads);
+    //
+    launcher.Perform( 0, numChunks, [&](const int /*threadIndex*/, const int chunk)
+    {
+      const int first = chunk*m_iChunkSize;
+      const int last  = Min(first + m_iChunkSize, numPts);
+
+      for ( int k = first; k < last; ++k )
+      {
+        const int i = order[k];
+
+        BullardRNG rng( BullardRNG::StreamSeed( unsigned(firstIndex + i) ) );
+        //
+        if ( m_classifier.IsIn(points[i], tol, rng) )
+          outMask[i] = 1;
+      }
+    } );
+  }
+
+  //! \return the max number of threads available in the default pool.
+  static int GetMaxThreads()
+  {
+    return OSD_ThreadPool::DefaultPool()->NbThreads();
+  }
+
+protected:
+
+  const ClassifyPt& m_classifier;   //!< Shared classifier.
+  int               m_iChunkSize;   //!< Number of points per work item.
+  bool              m_bMortonOrder; //!< Whether to sort the points.
+
+};
+
+#endif
@@ -0,0 +1,257 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2020-present, Quaoar Studio
+// All rights reserved.
+//-----------------------------------------------------------------------------
+
+#ifndef ClassifySolids_h
+#define ClassifySolids_h
+
+// Local includes
+#include "ClassifyPt.h"
+
+// OpenCascade includes
+#include <OSD_Parallel.hxx>
+#include <OSD_ThreadPool.hxx>
+#include <TopExp_Explorer.hxx>
+
+// Standard includes
+#include <vector>
+
+//-----------------------------------------------------------------------------
+
+//! Top-level BVH over the bounding boxes of solids. The primitives are
+//! reordered by the builder, so each box keeps the index of its solid.
+class SolidsBvh : public BVH_PrimitiveSet<double, 3>
+{
+public:
+
+  //! Ctor.
+  SolidsBvh() : BVH_PrimitiveSet<double, 3> ()
+  {
+    // A couple of solids per leaf, as each of them costs a full query.
+    myBuilder = new BVH_BinnedBuilder<double, 3, 32>(2, 32);
+  }
+
+  //! Adds the box of a solid.
+  //! \param[in] box   the box of the solid.
+  //! \param[in] solid the 0-based index of the solid.
+  void Add(const BVH_Box<double, 3>& box, const int solid)
+  {
+    m_boxes.push_back(box);
+    m_solids.push_back(solid);
+    this->MarkDirty();
+  }
+
+  //! \return index of the solid for the given primitive.
+  int GetSolid(const int index) const { return m_solids[index]; }
+
+public:
+
+  //! \return number of stored boxes.
+  virtual int Size() const override
+  {
+    return (int) m_boxes.size();
+  }
+
+  //! \return box with the given index.
+  virtual BVH_Box<double, 3> Box(const int index) const override
+  {
+    return m_boxes[index];
+  }
+
+  //! Calculates center point of a box with respect to the axis of interest.
+  virtual double Center(const int index,
+                        const int axis) const override
+  {
+    return m_boxes[index].Center(axis);
+  }
+
+  //! Swaps two elements for BVH building.
+  virtual void Swap(const int index1,
+                    const int index2) override
+  {
+    std::swap(m_boxes[index1],  m_boxes[index2]);
+    std::swap(m_solids[index1], m_solids[index2]);
+  }
+
+protected:
+
+  std::vector< BVH_Box<double, 3> > m_boxes;  //!< Boxes of solids.
+  std::vector<int>                  m_solids; //!< Indices of solids.
+
+};
+
+//-----------------------------------------------------------------------------
+
+//! Point location in an assembly of solids. Each solid gets its own
+//! ClassifyPt instance, and a top-level BVH over the solid boxes selects
+//! the candidates for a point, so the solids whose boxes do not contain
+//! the point cost no triangle work at all. The solids are indexed in the
+//! order of TopExp_Explorer over the passed shape.
+class ClassifySolids
+{
+public:
+
+  //! Ctor. The shape is expected to be meshed.
+  //! \param[in] shape  the assembly of solids.
+  //! \param[in] params the options of the per-solid BVH construction.
+  ClassifySolids(const TopoDS_Shape&            shape,
+                 const ModelBvh::t_buildParams& params = ModelBvh::t_buildParams())
+  //
+  : m_top(new SolidsBvh)
+  {
+    for ( TopExp_Explorer exp(shape, TopAbs_SOLID); exp.More(); exp.Next() )
+      m_solids.push_back( exp.Current() );
+
+    // The per-solid trees are independent, so they are built in parallel,
+    // each one in a single thread.
+    ModelBvh::t_buildParams solidParams = params;
+    solidParams.NumThreads = 1;
+
+    std::vector<Handle(ModelBvh)> bvhs( m_solids.size() );
+    //
+    OSD_Parallel::For( 0, int( m_solids.size() ), [&](const int s)
+    {
+      bvhs[s] = new ModelBvh(m_solids[s], solidParams);
+      bvhs[s]->BVH();
+    } );
+
+    for ( int s = 0; s < int( m_solids.size() ); ++s )
+    {
+      m_classifiers.emplace_back(bvhs[s]);
+
+      // The solids without facets are never located.
+      if ( bvhs[s]->Size() > 0 )
+        m_top->Add(bvhs[s]->Box(), s);
+    }
+
+    m_top->BVH();
+  }
+
+public:
+
+  //! Finds the solid containing the point. If the solids overlap, the
+  //! first one found is returned.
+  //! \param[in]     pt  the point to locate.
+  //! \param[in]     tol the tolerance to reject the near-boundary points.
+  //! \param[in,out] rng the random number generator for the rays.
+  //! \return 0-based index of the solid or -1 if the point is outside all
+  //!         solids or within the tolerance of a boundary.
+  int Locate(const gp_XYZ& pt, const double tol, BullardRNG& rng) const
+  {
+    const BVH_Tree<double, 3>* pBVH = m_top->BVH().get();
+    if ( pBVH == nullptr || pBVH->NodeInfoBuffer().empty() )
+      return -1;
+
+    // The points farther than the tolerance inside a solid are strictly
+    // inside its box, so the boxes are not inflated.
+    const BVH_Vec3d P( pt.X(), pt.Y(), pt.Z() );
+
+    int stack[64];
+    int head = -1;
+    int node =  0; // Root node.
+
+    for ( ; ; )
+    {
+      const BVH_Vec4i& data = pBVH->NodeInfoBuffer()[node];
+
+      const bool isOverlap = isInBox( P, pBVH->MinPoint(node), pBVH->MaxPoint(node) );
+
+      if ( isOverlap && data.x() == 0 ) // Inner node.
+      {
+        node          = data.y();
+        stack[++head] = data.z();
+        continue;
+      }
+
+      if ( isOverlap ) // Leaf node.
+      {
+        for ( int idx = data.y(); idx <= data.z(); ++idx )
+        {
+          const BVH_Box<double, 3>& box = m_top->Box(idx);
+          //
+          if ( !isInBox( P, box.CornerMin(), box.CornerMax() ) )
+            continue;
+
+          const int solid = m_top->GetSolid(idx);
+          //
+          if ( m_classifiers[solid].IsIn(pt, tol, rng) )
+            return solid;
+        }
+      }
+
+      if ( head < 0 )
+        return -1;
+
+      node = stack[head--];
+    }
+  }
+
+  //! Locates the passed points in parallel. Each point gets its own random
+  //! stream seeded by the point index, so the result is the same for any
+  //! number of threads.
+  //! \param[in]  points     the points to locate.
+  //! \param[in]  tol        the tolerance to reject the near-boundary points.
+  //! \param[out] outSolids  the indices of the solids containing the points,
+  //!                        -1 for the points outside all solids.
+  //! \param[in]  numThreads the max number of threads to use. Pass -1 to
+  //!                        use all threads of the default pool.
+  void LocateBatch(const std::vector<gp_XYZ>& points,
+                   const double               tol,
+                   std::vector<int>&          outSolids,
+                   const int                  numThreads = -1) const
+  {
+    const int chunkSize = 1024;
+    const int numPts    = int( points.size() );
+    const int numChunks = (numPts + chunkSize - 1) / chunkSize;
+
+    outSolids.assign(points.size(), -1);
+
+    OSD_ThreadPool::Launcher launcher(*OSD_ThreadPool::DefaultPool(), numThreads);
+    //
+    launcher.Perform( 0, numChunks, [&](const int /*threadIndex*/, const int chunk)
+    {
+      const int first = chunk*chunkSize;
+      const int last  = Min(first + chunkSize, numPts);
+
+      for ( int i = first; i < last; ++i )
+      {
+        BullardRNG rng( BullardRNG::StreamSeed( unsigned(i) ) );
+        outSolids[i] = this->Locate(points[i], tol, rng);
+      }
+    } );
+  }
+
+  //! \return number of solids.
+  int GetNumSolids() const { return int( m_solids.size() ); }
+
+  //! \return solid with the given 0-based index.
+  const TopoDS_Shape& GetSolid(const int index) const { return m_solids[index]; }
+
+  //! \return classifier of the solid with the given 0-based index.
+  const ClassifyPt& GetClassifier(const int index) const { return m_classifiers[index]; }
+
+  //! \return top-level BVH over the solid boxes.
+  const Handle(SolidsBvh)& GetTopBvh() const { return m_top; }
+
+protected:
+
+  //! \return true if the point is in the closed box.
+  static bool isInBox(const BVH_Vec3d& P,
+                      const BVH_Vec3d& minPt,
+                      const BVH_Vec3d& maxPt)
+  {
+    return P.x() >= minPt.x() && P.x() <= maxPt.x()
+        && P.y() >= minPt.y() && P.y() <= maxPt.y()
+        && P.z() >= minPt.z() && P.z() <= maxPt.z();
+  }
+
+protected:
+
+  std::vector<TopoDS_Shape> m_solids;      //!< Solids of the assembly.
+  std::vector<ClassifyPt>   m_classifiers; //!< Per-solid classifiers.
+  Handle(SolidsBvh)         m_top;         //!< Top-level BVH over solid boxes.
+
+};
+
+#endif
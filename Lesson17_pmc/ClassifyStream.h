@@ -0,0 +1,192 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2020-present, Quaoar Studio
+// All rights reserved.
+//-----------------------------------------------------------------------------
+
+#ifndef ClassifyStream_h
+#define ClassifyStream_h
+
+// Local includes
+#include "ClassifyPtParallel.h"
+
+// OpenCascade includes
+#include <OSD_Timer.hxx>
+
+// Standard includes
+#include <fstream>
+#include <iostream>
+#include <string>
+
+//-----------------------------------------------------------------------------
+
+//! Classifies the points of a file too large to be loaded at once. The
+//! points are read in chunks, and each chunk is classified in parallel
+//! before the next one is read, so the memory use is bounded by the chunk
+//! size whatever the size of the file.
+//!
+//! The input file is a raw sequence of points, each given by three
+//! little-endian doubles (x, y, z) without any header. The output is
+//! either a packed bit mask, where bit i % 8 (LSB first) of byte i / 8 is
+//! set for the inner point i, or the inner points in the input format.
+//!
+//! The random streams of rays are seeded by the global point indices, so
+//! the result does not depend on the chunk size and the number of threads.
+class ClassifyStream
+{
+public:
+
+  //! Output format.
+  enum OutputMode
+  {
+    Output_BitMask = 0, //!< One bit per input point.
+    Output_InnerPoints  //!< Inner points only, in the input format.
+  };
+
+  //! Statistics of the last run.
+  struct t_stats
+  {
+    size_t NumPoints; //!< Number of classified points.
+    size_t NumInner;  //!< Number of inner points.
+    double Seconds;   //!< Elapsed time including I/O.
+
+    //! Default ctor.
+    t_stats() : NumPoints(0), NumInner(0), Seconds(0.) {}
+
+    //! \return throughput in points per second.
+    double GetPointsPerSec() const { return Seconds > 0. ? NumPoints / Seconds : 0.; }
+  };
+
+public:
+
+  //! Ctor.
+  //! \param[in] classifier the classifier to share between threads.
+  //! \param[in] chunkSize  the number of points to read at once. It is
+  //!                       rounded up to a multiple of 8, so that each
+  //!                       chunk of the bit mask takes whole bytes.
+  ClassifyStream(const ClassifyPt& classifier,
+                 const int         chunkSize = 1 << 20)
+  //
+  : m_classifier (classifier),
+    m_iChunkSize ( ( Max(chunkSize, 1) + 7 ) & ~7 )
+  {}
+
+public:
+
+  //! Classifies the points of the input file.
+  //! \param[in] inFilename  the file of points to classify.
+  //! \param[in] outFilename the file to write the result to.
+  //! \param[in] tol         the tolerance to reject the near-boundary points.
+  //! \param[in] mode        the output format.
+  //! \param[in] numThreads  the max number of threads to use. Pass -1 to
+  //!                        use all threads of the default pool.
+  //! \return false if any of the files cannot be processed.
+  bool Perform(const std::string& inFilename,
+               const std::string& outFilename,
+               const double       tol,
+               const OutputMode   mode,
+               const int          numThreads = -1)
+  {
+    m_stats = t_stats();
+
+    std::ifstream IN(inFilename, std::ios::in | std::ios::binary);
+    //
+    if ( !IN.is_open() )
+    {
+      std::cout << "Cannot open file '" << inFilename << "' for reading." << std::endl;
+      return false;
+    }
+
+    std::ofstream OUT(outFilename, std::ios::out | std::ios::binary);
+    //
+    if ( !OUT.is_open() )
+    {
+      std::cout << "Cannot open file '" << outFilename << "' for writing." << std::endl;
+      return false;
+    }
+
+    OSD_Timer timer;
+    timer.Start();
+
+    ClassifyPtParallel   classPar(m_classifier);
+    std::vector<double>  coords( 3*size_t(m_iChunkSize) );
+    std::vector<gp_XYZ>  points;
+    std::vector<uint8_t> mask;
+    std::vector<uint8_t> bits;
+    std::vector<double>  inner;
+    //
+    points.reserve(m_iChunkSize);
+
+    for ( ; ; )
+    {
+      IN.read( reinterpret_cast<char*>( coords.data() ), coords.size()*sizeof(double) );
+
+      const size_t numBytes = size_t( IN.gcount() );
+      //
+      if ( numBytes % (3*sizeof(double)) != 0 )
+      {
+        std::cout << "File '" << inFilename << "' is truncated." << std::endl;
+        return false;
+      }
+
+      const size_t numPts = numBytes / (3*sizeof(double));
+      //
+      if ( numPts == 0 )
+        break;
+
+      points.clear();
+      for ( size_t i = 0; i < numPts; ++i )
+        points.push_back( gp_XYZ(coords[3*i], coords[3*i + 1], coords[3*i + 2]) );
+
+      classPar.Perform(points, tol, mask, numThreads, m_stats.NumPoints);
+
+      if ( mode == Output_BitMask )
+      {
+        bits.assign( (numPts + 7) / 8, 0 );
+        //
+        for ( size_t i = 0; i < numPts; ++i )
+          if ( mask[i] )
+            bits[i / 8] |= uint8_t( 1 << (i % 8) );
+
+        OUT.write( reinterpret_cast<const char*>( bits.data() ), bits.size() );
+      }
+      else
+      {
+        inner.clear();
+        //
+        for ( size_t i = 0; i < numPts; ++i )
+          if ( mask[i] )
+            inner.insert( inner.end(), &coords[3*i], &coords[3*i] + 3 );
+
+        OUT.write( reinterpret_cast<const char*>( inner.data() ), inner.size()*sizeof(double) );
+      }
+
+      m_stats.NumPoints += numPts;
+      m_stats.NumInner  += size_t( std::count( mask.begin(), mask.end(), uint8_t(1) ) );
+
+      if ( !OUT.good() )
+      {
+        std::cout << "Failed to write file '" << outFilename << "'." << std::endl;
+        return false;
+      }
+
+      if ( numPts < size_t(m_iChunkSize) )
+        break;
+    }
+
+    timer.Stop();
+    m_stats.Seconds = timer.ElapsedTime();
+    return true;
+  }
+
+  //! \return statistics of the last run.
+  const t_stats& GetStats() const { return m_stats; }
+
+protected:
+
+  const ClassifyPt& m_classifier; //!< Shared classifier.
+  int               m_iChunkSize; //!< Number of points per chunk.
+  t_stats           m_stats;      //!< Statistics of the last run.
+
+};
+
+#endif
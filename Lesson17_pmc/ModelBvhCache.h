@@ -0,0 +1,353 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2020-present, Quaoar Studio
+// All rights reserved.
+//-----------------------------------------------------------------------------
+
+#ifndef ModelBvhCache_h
+#define ModelBvhCache_h
+
+// Local includes
+#include "ClassifyPt.h"
+
+// OpenCascade includes
+#include <BRepTools.hxx>
+
+// Standard includes
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+// Memory mapping
+#if defined(_WIN32)
+  #ifndef WIN32_LEAN_AND_MEAN
+    #define WIN32_LEAN_AND_MEAN
+  #endif
+  #ifndef NOMINMAX
+    #define NOMINMAX
+  #endif
+  #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+//-----------------------------------------------------------------------------
+
+//! Read-only memory mapping of a file.
+class MappedFile
+{
+public:
+
+  //! Maps the file with the given name.
+  MappedFile(const std::string& filename) : m_pData(nullptr), m_iSize(0)
+  {
+#if defined(_WIN32)
+    m_hFile    = INVALID_HANDLE_VALUE;
+    m_hMapping = nullptr;
+
+    m_hFile = ::CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if ( m_hFile == INVALID_HANDLE_VALUE )
+      return;
+
+    LARGE_INTEGER size;
+    if ( !::GetFileSizeEx(m_hFile, &size) || size.QuadPart == 0 )
+      return;
+
+    m_hMapping = ::CreateFileMappingA(m_hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if ( m_hMapping == nullptr )
+      return;
+
+    m_pData = static_cast<const char*>( ::MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0) );
+    m_iSize = m_pData ? size_t(size.QuadPart) : 0;
+#else
+    m_iFd = ::open(filename.c_str(), O_RDONLY);
+    if ( m_iFd < 0 )
+      return;
+
+    struct stat st;
+    if ( ::fstat(m_iFd, &st) != 0 || st.st_size == 0 )
+      return;
+
+    void* pData = ::mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, m_iFd, 0);
+    if ( pData == MAP_FAILED )
+      return;
+
+    m_pData = static_cast<const char*>(pData);
+    m_iSize = size_t(st.st_size);
+#endif
+  }
+
+  //! Unmaps the file.
+  ~MappedFile()
+  {
+#if defined(_WIN32)
+    if ( m_pData )
+      ::UnmapViewOfFile(m_pData);
+    if ( m_hMapping )
+      ::CloseHandle(m_hMapping);
+    if ( m_hFile != INVALID_HANDLE_VALUE )
+      ::CloseHandle(m_hFile);
+#else
+    if ( m_pData )
+      ::munmap(const_cast<char*>(m_pData), m_iSize);
+    if ( m_iFd >= 0 )
+      ::close(m_iFd);
+#endif
+  }
+
+  //! \return mapped contents or null if the file could not be mapped.
+  const char* Data() const { return m_pData; }
+
+  //! \return size of the mapped contents in bytes.
+  size_t Size() const { return m_iSize; }
+
+private:
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+private:
+
+  const char* m_pData; //!< Mapped contents.
+  size_t      m_iSize; //!< Size of the mapped contents.
+#if defined(_WIN32)
+  HANDLE      m_hFile;    //!< File handle.
+  HANDLE      m_hMapping; //!< File mapping handle.
+#else
+  int         m_iFd;      //!< File descriptor.
+#endif
+
+};
+
+//-----------------------------------------------------------------------------
+
+//! On-disk cache of ModelBvh instances. An entry stores the facets in the
+//! order of the tree leaves and the node buffers of the tree as they lie in
+//! memory, so restoring it requires neither meshing nor BVH construction.
+//! The entries are keyed by the hash of the B-rep contents (without mesh),
+//! the linear deflection used for meshing and the options of the tree
+//! construction. The facet storage is not kept, so it should be selected
+//! again on the restored structure.
+class ModelBvhCache
+{
+public:
+
+  //! Ctor.
+  //! \param[in] dirname the existing directory to keep the cache files in.
+  ModelBvhCache(const std::string& dirname) : m_dirname(dirname) {}
+
+public:
+
+  //! Computes the cache key for a shape meshed with the given deflection.
+  //! The number of build threads does not affect the tree, so it is not
+  //! a part of the key.
+  //! \param[in] shape      the B-rep shape.
+  //! \param[in] deflection the linear deflection of meshing.
+  //! \param[in] params     the options of BVH construction.
+  //! \return 64-bit key.
+  static uint64_t ComputeKey(const TopoDS_Shape&            shape,
+                             const double                   deflection,
+                             const ModelBvh::t_buildParams& params = ModelBvh::t_buildParams())
+  {
+    std::ostringstream brep;
+    BRepTools::Write(shape, brep, false, false, TopTools_FormatVersion_CURRENT);
+
+    // FNV-1a over the B-rep text followed by the deflection.
+    uint64_t hash = 14695981039346656037ull;
+    //
+    auto add = [&hash](const char* data, const size_t size)
+    {
+      for ( size_t i = 0; i < size; ++i )
+      {
+        hash ^= uint8_t(data[i]);
+        hash *= 1099511628211ull;
+      }
+    };
+
+    // The depth is clamped the same way as on building.
+    const int32_t options[4] = { int32_t(params.Builder),
+                                 int32_t(params.LeafSize),
+                                 int32_t(params.NumBins),
+                                 int32_t( Min( Max(params.MaxDepth, 1), ModelBvh::MaxTreeDepth ) ) };
+
+    const std::string& str = brep.str();
+    add( str.data(), str.size() );
+    add( reinterpret_cast<const char*>(&deflection), sizeof(deflection) );
+    add( reinterpret_cast<const char*>(options), sizeof(options) );
+    return hash;
+  }
+
+  //! \return name of the cache file for the given key.
+  std::string GetFilename(const uint64_t key) const
+  {
+    char name[32];
+    std::snprintf( name, sizeof(name), "%016llx.bvh", (unsigned long long) key );
+    return m_dirname + "/" + name;
+  }
+
+  //! Restores the accelerating structure from cache.
+  //! \param[in] key the cache key.
+  //! \return the restored structure or null if there is no valid entry.
+  Handle(ModelBvh) Load(const uint64_t key) const
+  {
+    MappedFile file( this->GetFilename(key) );
+    //
+    if ( file.Size() < sizeof(t_header) )
+      return nullptr;
+
+    const t_header* pHeader = reinterpret_cast<const t_header*>( file.Data() );
+    //
+    if ( std::memcmp( pHeader->Signature, Signature, sizeof(Signature) ) != 0 ||
+         pHeader->Version != Version ||
+         pHeader->FacetSize != sizeof(ModelBvh::t_facet) ||
+         pHeader->Key != key ||
+         pHeader->NumFacets < 0 || pHeader->NumNodes <= 0 )
+      return nullptr;
+
+    const size_t facetsSize = size_t(pHeader->NumFacets)*sizeof(ModelBvh::t_facet);
+    const size_t nodesSize  = size_t(pHeader->NumNodes)*sizeof(BVH_Vec4i);
+    const size_t boxesSize  = size_t(pHeader->NumNodes)*sizeof(BVH_Vec3d);
+    //
+    if ( file.Size() != sizeof(t_header) + facetsSize + nodesSize + 2*boxesSize )
+      return nullptr;
+
+    // The sections follow the header without gaps.
+    const char* pFacets = file.Data() + sizeof(t_header);
+    const char* pNodes  = pFacets + facetsSize;
+    const char* pMin    = pNodes  + nodesSize;
+    const char* pMax    = pMin    + boxesSize;
+
+    // The traversal trusts the node buffer, so a corrupted or foreign file
+    // must not get through with indices out of range.
+    if ( !isValidTree( reinterpret_cast<const BVH_Vec4i*>(pNodes), pHeader->NumNodes, pHeader->NumFacets ) )
+      return nullptr;
+
+    Handle(ModelBvh) bvh = new ModelBvh;
+    //
+    bvh->Restore( reinterpret_cast<const ModelBvh::t_facet*>(pFacets), pHeader->NumFacets,
+                  reinterpret_cast<const BVH_Vec4i*>(pNodes),
+                  reinterpret_cast<const BVH_Vec3d*>(pMin),
+                  reinterpret_cast<const BVH_Vec3d*>(pMax),
+                  pHeader->NumNodes,
+                  pHeader->BoundingDiag );
+
+    return bvh;
+  }
+
+  //! Stores the accelerating structure in cache. The tree is built if it
+  //! is not ready yet.
+  //! \param[in] key the cache key.
+  //! \param[in] bvh the structure to store.
+  //! \return false if the cache file cannot be written.
+  bool Store(const uint64_t key, const Handle(ModelBvh)& bvh) const
+  {
+    const opencascade::handle<BVH_Tree<double, 3>>& tree = bvh->BVH();
+    //
+    if ( tree.IsNull() || tree->NodeInfoBuffer().empty() )
+      return false;
+
+    t_header header;
+    std::memcpy( header.Signature, Signature, sizeof(Signature) );
+    header.Version      = Version;
+    header.FacetSize    = uint32_t( sizeof(ModelBvh::t_facet) );
+    header.Key          = key;
+    header.NumFacets    = bvh->Size();
+    header.NumNodes     = int( tree->NodeInfoBuffer().size() );
+    header.BoundingDiag = bvh->GetBoundingDiag();
+
+    // Write to a temporary file first, so that a concurrent reader never
+    // sees a partial entry.
+    const std::string filename = this->GetFilename(key);
+    const std::string tmpname  = filename + ".tmp";
+    {
+      std::ofstream FILE(tmpname, std::ios::out | std::ios::binary);
+      //
+      if ( !FILE.is_open() )
+      {
+        std::cout << "Cannot open file '" << tmpname << "' for writing." << std::endl;
+        return false;
+      }
+
+      FILE.write( reinterpret_cast<const char*>(&header), sizeof(header) );
+      //
+      for ( int i = 0; i < header.NumFacets; ++i )
+        FILE.write( reinterpret_cast<const char*>( &bvh->GetFacet(i) ), sizeof(ModelBvh::t_facet) );
+      //
+      FILE.write( reinterpret_cast<const char*>( tree->NodeInfoBuffer().data() ), header.NumNodes*sizeof(BVH_Vec4i) );
+      FILE.write( reinterpret_cast<const char*>( tree->MinPointBuffer().data() ), header.NumNodes*sizeof(BVH_Vec3d) );
+      FILE.write( reinterpret_cast<const char*>( tree->MaxPointBuffer().data() ), header.NumNodes*sizeof(BVH_Vec3d) );
+      //
+      if ( !FILE.good() )
+        return false;
+    }
+
+    std::remove( filename.c_str() );
+    return std::rename( tmpname.c_str(), filename.c_str() ) == 0;
+  }
+
+protected:
+
+  //! Checks that the children of the inner nodes and the facet ranges of
+  //! the leaves are within the buffers. The children follow their parents
+  //! in the node buffer, which excludes cycles.
+  //! \param[in] nodeInfo  the node info buffer.
+  //! \param[in] numNodes  the number of nodes.
+  //! \param[in] numFacets the number of facets.
+  //! \return true if the tree is safe to traverse.
+  static bool isValidTree(const BVH_Vec4i* nodeInfo,
+                          const int        numNodes,
+                          const int        numFacets)
+  {
+    for ( int node = 0; node < numNodes; ++node )
+    {
+      // The data may be misaligned in the mapped file.
+      BVH_Vec4i data;
+      std::memcpy( &data, nodeInfo + node, sizeof(BVH_Vec4i) );
+
+      if ( data.x() == 0 ) // Inner node.
+      {
+        if ( data.y() <= node || data.y() >= numNodes ||
+             data.z() <= node || data.z() >= numNodes )
+          return false;
+      }
+      else // Leaf node.
+      {
+        if ( data.y() < 0 || data.y() > data.z() || data.z() >= numFacets )
+          return false;
+      }
+    }
+    return true;
+  }
+
+protected:
+
+  //! Header of the cache file.
+  struct t_header
+  {
+    char     Signature[8]; //!< File signature.
+    uint32_t Version;      //!< Format version.
+    uint32_t FacetSize;    //!< Size of a facet in bytes to detect layout changes.
+    uint64_t Key;          //!< Cache key.
+    int32_t  NumFacets;    //!< Number of facets.
+    int32_t  NumNodes;     //!< Number of tree nodes.
+    double   BoundingDiag; //!< Characteristic size of the model.
+  };
+
+  //! Signature of the cache files.
+  static constexpr char Signature[8] = { 'B', 'V', 'H', 'C', 'A', 'C', 'H', '1' };
+
+  //! Version of the cache file format.
+  static constexpr uint32_t Version = 1;
+
+protected:
+
+  std::string m_dirname; //!< Directory of the cache files.
+
+};
+
+#endif
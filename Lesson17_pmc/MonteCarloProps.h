@@ -0,0 +1,272 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2020-present, Quaoar Studio
+// All rights reserved.
+//-----------------------------------------------------------------------------
+
+#ifndef MonteCarloProps_h
+#define MonteCarloProps_h
+
+// Local includes
+#include "ClassifyPt.h"
+
+// OpenCascade includes
+#include <gp_Mat.hxx>
+#include <OSD_ThreadPool.hxx>
+
+// Standard includes
+#include <cmath>
+#include <vector>
+
+//-----------------------------------------------------------------------------
+
+//! Estimates volume, centroid and inertia tensor of a solid by Monte-Carlo
+//! integration over its bounding box. The box is split into a regular
+//! grid of strata, and each round draws one jittered sample per stratum,
+//! so the samples cover the box evenly. Only the strata crossed by the
+//! boundary contribute to the variance, which is estimated from the
+//! per-stratum hit rates after each round. The sampling stops once the
+//! relative standard error of the volume gets below the requested one.
+//!
+//! Each sample gets its own random stream seeded by the round and the
+//! stratum, so the result is the same for any number of threads.
+class MonteCarloProps
+{
+public:
+
+  //! Options of the estimation.
+  struct t_params
+  {
+    int    NumStrata;  //!< Number of strata along each axis.
+    double RelError;   //!< Target relative standard error of the volume.
+    int    MinRounds;  //!< Min number of rounds before the error is trusted.
+    int    MaxRounds;  //!< Max number of rounds.
+    int    NumThreads; //!< Number of threads, -1 for all threads of the pool.
+
+    //! Default ctor.
+    t_params() : NumStrata(16), RelError(1e-3), MinRounds(8), MaxRounds(10000), NumThreads(-1) {}
+  };
+
+  //! Convergence record of a single round.
+  struct t_round
+  {
+    size_t NumSamples; //!< Number of samples drawn so far.
+    double Volume;     //!< Volume estimated so far.
+    double RelError;   //!< Relative standard error of the volume.
+  };
+
+public:
+
+  //! Ctor.
+  //! \param[in] classifier the classifier of the solid.
+  //! \param[in] params     the options of the estimation.
+  MonteCarloProps(const ClassifyPt& classifier,
+                  const t_params&   params = t_params())
+  //
+  : m_classifier  (classifier),
+    m_params      (params),
+    m_fVolume     (0.),
+    m_fRelError   (REAL_MAX),
+    m_iNumSamples (0),
+    m_bIsConverged(false)
+  {}
+
+public:
+
+  //! Runs the estimation.
+  //! \return false if the mesh is empty.
+  bool Perform()
+  {
+    m_history.clear();
+    m_fVolume      = 0.;
+    m_fRelError    = REAL_MAX;
+    m_iNumSamples  = 0;
+    m_bIsConverged = false;
+
+    // Sample the bounding box of the facets.
+    const Handle(ModelBvh)& bvh = m_classifier.GetBvh();
+    //
+    if ( bvh->Size() == 0 )
+      return false;
+
+    const BVH_Box<double, 3> aabb   = bvh->Box();
+    const BVH_Vec3d&         boxMin = aabb.CornerMin();
+    const BVH_Vec3d&         boxMax = aabb.CornerMax();
+
+    const int       n          = Max(m_params.NumStrata, 1);
+    const int       numStrata  = n*n*n;
+    const BVH_Vec3d cell       = (boxMax - boxMin) / double(n);
+    const double    cellVolume = cell.x()*cell.y()*cell.z();
+
+    // The moments are taken about the box center to keep precision.
+    const BVH_Vec3d center = (boxMin + boxMax)*0.5;
+
+    // Per-stratum accumulators, each written by a single task.
+    std::vector<t_moments> strata(numStrata);
+
+    const int chunkSize = 64;
+    const int numChunks = (numStrata + chunkSize - 1) / chunkSize;
+
+    OSD_ThreadPool::Launcher launcher(*OSD_ThreadPool::DefaultPool(), m_params.NumThreads);
+
+    for ( int round = 0; round < Max(m_params.MaxRounds, 1); ++round )
+    {
+      launcher.Perform( 0, numChunks, [&](const int /*threadIndex*/, const int chunk)
+      {
+        const int first = chunk*chunkSize;
+        const int last  = Min(first + chunkSize, numStrata);
+
+        for ( int s = first; s < last; ++s )
+        {
+          BullardRNG rng( BullardRNG::StreamSeed( unsigned(round)*unsigned(numStrata) + unsigned(s) ) );
+
+          const int i = s / (n*n);
+          const int j = (s / n) % n;
+          const int k = s % n;
+
+          const gp_XYZ P( boxMin.x() + (i + rng.RandDouble())*cell.x(),
+                          boxMin.y() + (j + rng.RandDouble())*cell.y(),
+                          boxMin.z() + (k + rng.RandDouble())*cell.z() );
+
+          // No tolerance band: the points near the boundary count too.
+          if ( m_classifier.IsIn(P, 0., rng) )
+            strata[s].Add( P.X() - center.x(), P.Y() - center.y(), P.Z() - center.z() );
+        }
+      } );
+
+      // Reduce. The variance of the stratified estimator sums up the
+      // variances of the hit rates of all strata.
+      const int numRounds = round + 1;
+      //
+      t_moments total;
+      double    variance = 0.;
+      //
+      for ( const t_moments& stratum : strata )
+      {
+        total.Append(stratum);
+
+        if ( numRounds > 1 )
+        {
+          const double p = stratum.Count / numRounds;
+          variance += p*(1. - p) / (numRounds - 1);
+        }
+      }
+
+      m_iNumSamples = size_t(numRounds)*numStrata;
+      m_fVolume     = total.Count*cellVolume/numRounds;
+      m_fRelError   = m_fVolume > 0. ? cellVolume*std::sqrt(variance)/m_fVolume : REAL_MAX;
+
+      m_history.push_back( { m_iNumSamples, m_fVolume, m_fRelError } );
+
+      if ( round == Max(m_params.MaxRounds, 1) - 1 || ( numRounds >= m_params.MinRounds && m_fRelError <= m_params.RelError ) )
+      {
+        m_bIsConverged = (m_fRelError <= m_params.RelError);
+        this->computeProps(total, cellVolume/numRounds, center);
+        break;
+      }
+    }
+
+    return true;
+  }
+
+  //! \return estimated volume.
+  double GetVolume() const { return m_fVolume; }
+
+  //! \return estimated centroid.
+  const gp_XYZ& GetCentroid() const { return m_centroid; }
+
+  //! \return estimated inertia tensor about the centroid for unit density,
+  //!         in the same convention as GProp_GProps::MatrixOfInertia().
+  const gp_Mat& GetInertia() const { return m_inertia; }
+
+  //! \return relative standard error of the volume.
+  double GetRelError() const { return m_fRelError; }
+
+  //! \return total number of samples.
+  size_t GetNumSamples() const { return m_iNumSamples; }
+
+  //! \return true if the requested error has been reached.
+  bool IsConverged() const { return m_bIsConverged; }
+
+  //! \return convergence records of all rounds.
+  const std::vector<t_round>& GetHistory() const { return m_history; }
+
+protected:
+
+  //! Sums of the coordinates and their products over the inner samples.
+  struct t_moments
+  {
+    double Count;
+    double X, Y, Z;
+    double XX, YY, ZZ;
+    double XY, YZ, ZX;
+
+    t_moments() : Count(0.), X(0.), Y(0.), Z(0.), XX(0.), YY(0.), ZZ(0.), XY(0.), YZ(0.), ZX(0.) {}
+
+    void Add(const double x, const double y, const double z)
+    {
+      Count += 1.;
+      X  += x;   Y  += y;   Z  += z;
+      XX += x*x; YY += y*y; ZZ += z*z;
+      XY += x*y; YZ += y*z; ZX += z*x;
+    }
+
+    void Append(const t_moments& other)
+    {
+      Count += other.Count;
+      X  += other.X;  Y  += other.Y;  Z  += other.Z;
+      XX += other.XX; YY += other.YY; ZZ += other.ZZ;
+      XY += other.XY; YZ += other.YZ; ZX += other.ZX;
+    }
+  };
+
+  //! Converts the sums into the centroid and the inertia tensor.
+  //! \param[in] total  the sums over all inner samples.
+  //! \param[in] weight the volume represented by a single sample.
+  //! \param[in] center the origin of the sampled coordinates.
+  void computeProps(const t_moments& total,
+                    const double     weight,
+                    const BVH_Vec3d& center)
+  {
+    if ( total.Count == 0. )
+    {
+      m_centroid = gp_XYZ( center.x(), center.y(), center.z() );
+      m_inertia  = gp_Mat(0., 0., 0., 0., 0., 0., 0., 0., 0.);
+      return;
+    }
+
+    // Centroid relative to the sampling origin.
+    const double cx = total.X / total.Count;
+    const double cy = total.Y / total.Count;
+    const double cz = total.Z / total.Count;
+
+    m_centroid = gp_XYZ( center.x() + cx, center.y() + cy, center.z() + cz );
+
+    // Second moments about the centroid.
+    const double V   = total.Count*weight;
+    const double Sxx = total.XX*weight - V*cx*cx;
+    const double Syy = total.YY*weight - V*cy*cy;
+    const double Szz = total.ZZ*weight - V*cz*cz;
+    const double Sxy = total.XY*weight - V*cx*cy;
+    const double Syz = total.YZ*weight - V*cy*cz;
+    const double Szx = total.ZX*weight - V*cz*cx;
+
+    m_inertia = gp_Mat( Syy + Szz, -Sxy,       -Szx,
+                        -Sxy,       Szz + Sxx, -Syz,
+                        -Szx,      -Syz,        Sxx + Syy );
+  }
+
+protected:
+
+  const ClassifyPt&    m_classifier;   //!< Classifier of the solid.
+  t_params             m_params;       //!< Options of the estimation.
+  double               m_fVolume;      //!< Estimated volume.
+  gp_XYZ               m_centroid;     //!< Estimated centroid.
+  gp_Mat               m_inertia;      //!< Estimated inertia tensor.
+  double               m_fRelError;    //!< Relative standard error of the volume.
+  size_t               m_iNumSamples;  //!< Total number of samples.
+  bool                 m_bIsConverged; //!< Whether the target error is reached.
+  std::vector<t_round> m_history;      //!< Convergence records.
+
+};
+
+#endif
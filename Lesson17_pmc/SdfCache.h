@@ -0,0 +1,475 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2020-present, Quaoar Studio
+// All rights reserved.
+//-----------------------------------------------------------------------------
+
+#ifndef SdfCache_h
+#define SdfCache_h
+
+// Local includes
+#include "ClassifyPt.h"
+
+// Standard includes
+#include <cstring>
+#include <fstream>
+
+//-----------------------------------------------------------------------------
+
+//! Sparse narrow-band cache of the signed distance field of a mesh. The
+//! bounding box of the mesh is covered with a regular grid split into
+//! bricks of 8x8x8 cells. Only the bricks close to the surface are stored,
+//! and each of them keeps the signed distances in all its 9x9x9 nodes, so
+//! that a query never has to look into the neighbour bricks.
+//!
+//! The distance inside the stored bricks is interpolated trilinearly. The
+//! points outside the band, as well as the queries asking for accuracy
+//! finer than the grid step, fall back to the exact distance function.
+//!
+//! The cache files keep the key of the mesh (see ModelBvhCache::ComputeKey())
+//! together with its number of facets and bounding box, so that a file
+//! written for another part or deflection is rejected on reading.
+class SdfCache : public Standard_Transient
+{
+public:
+
+  //! Number of cells along each side of a brick.
+  static const int BrickCells = 8;
+
+  //! Number of nodes along each side of a brick.
+  static const int BrickNodes = BrickCells + 1;
+
+  //! Number of values stored per brick.
+  static const int BrickSize = BrickNodes*BrickNodes*BrickNodes;
+
+public:
+
+  //! Ctor.
+  //! \param[in] dist the exact distance function to cache.
+  SdfCache(const Handle(MeshDist)& dist)
+  //
+  : m_dist  (dist),
+    m_fStep (0.),
+    m_fBand (0.)
+  {
+    m_numBricks[0] = m_numBricks[1] = m_numBricks[2] = 0;
+  }
+
+public:
+
+  //! Samples the distance function in the narrow band around the mesh.
+  //! \param[in] step the grid step.
+  //! \param[in] band the half-width of the band to cache.
+  //! \return false if the distance function has no mesh.
+  bool Build(const double step,
+             const double band)
+  {
+    this->clear();
+
+    if ( m_dist.IsNull() || m_dist->GetFacets().IsNull() || step <= 0. )
+      return false;
+
+    const BVH_Box<double, 3> aabb = m_dist->GetFacets()->Box();
+    //
+    if ( !aabb.IsValid() )
+      return false;
+
+    m_fStep = step;
+    m_fBand = band;
+    m_box   = aabb;
+    //
+    this->gridLayout(aabb, step, band, m_origin, m_numBricks);
+
+    const int numAll = m_numBricks[0]*m_numBricks[1]*m_numBricks[2];
+
+    // Find the bricks having some surface within the band. The whole
+    // brick is tested with a sphere around its center.
+    const double brickSide = step*BrickCells;
+    const double halfDiag  = 0.5*brickSide*Sqrt(3.);
+    //
+    m_brickIds.assign(numAll, -1);
+    //
+    OSD_Parallel::For( 0, numAll, [&](const int b)
+    {
+      int bi, bj, bk;
+      this->brickIndices(b, bi, bj, bk);
+
+      const BVH_Vec3d C = m_origin + BVH_Vec3d( (bi + 0.5)*brickSide,
+                                                (bj + 0.5)*brickSide,
+                                                (bk + 0.5)*brickSide );
+      //
+      if ( m_dist->IsWithin( C.x(), C.y(), C.z(), halfDiag + band ) )
+        m_brickIds[b] = 0;
+    } );
+
+    int numActive = 0;
+    for ( int b = 0; b < numAll; ++b )
+      if ( m_brickIds[b] == 0 )
+        m_brickIds[b] = numActive++;
+
+    // Sample the active bricks. Each brick has its own random stream for
+    // the ray voting, so the result does not depend on the scheduling.
+    m_values.resize(size_t(numActive)*BrickSize);
+    //
+    OSD_Parallel::For( 0, numAll, [&](const int b)
+    {
+      const int id = m_brickIds[b];
+      if ( id < 0 )
+        return;
+
+      int bi, bj, bk;
+      this->brickIndices(b, bi, bj, bk);
+
+      BullardRNG rng( BullardRNG::StreamSeed( unsigned(b) ) );
+      float*     pValues = &m_values[size_t(id)*BrickSize];
+
+      for ( int a = 0; a < BrickNodes; ++a )
+        for ( int c = 0; c < BrickNodes; ++c )
+          for ( int e = 0; e < BrickNodes; ++e )
+          {
+            const BVH_Vec3d P = m_origin + BVH_Vec3d( (bi*BrickCells + a)*step,
+                                                      (bj*BrickCells + c)*step,
+                                                      (bk*BrickCells + e)*step );
+
+            pValues[(a*BrickNodes + c)*BrickNodes + e] = float( m_dist->Eval( P.x(), P.y(), P.z(), rng ) );
+          }
+    } );
+
+    return true;
+  }
+
+  //! Evaluates the signed distance. This method is not thread-safe, as
+  //! the fallback to the exact distance advances the random number
+  //! generator of the distance function.
+  //! \param[in] x        the X coordinate of the point.
+  //! \param[in] y        the Y coordinate of the point.
+  //! \param[in] z        the Z coordinate of the point.
+  //! \param[in] accuracy the required accuracy. If it is finer than the
+  //!                     grid step, the exact distance is computed.
+  //! \return signed distance.
+  double Eval(const double x,
+              const double y,
+              const double z,
+              const double accuracy = REAL_MAX) const
+  {
+    double value;
+    if ( accuracy >= m_fStep && this->interpolate(x, y, z, value) )
+      return value;
+
+    return m_dist->Eval(x, y, z);
+  }
+
+  //! Evaluates the signed distance using the passed random number generator
+  //! for the fallback to the exact distance. It can be called concurrently,
+  //! given that each thread uses its own generator.
+  //! \param[in]     x        the X coordinate of the point.
+  //! \param[in]     y        the Y coordinate of the point.
+  //! \param[in]     z        the Z coordinate of the point.
+  //! \param[in,out] rng      the random number generator.
+  //! \param[in]     accuracy the required accuracy. If it is finer than
+  //!                         the grid step, the exact distance is computed.
+  //! \return signed distance.
+  double Eval(const double x,
+              const double y,
+              const double z,
+              BullardRNG&  rng,
+              const double accuracy = REAL_MAX) const
+  {
+    double value;
+    if ( accuracy >= m_fStep && this->interpolate(x, y, z, value) )
+      return value;
+
+    return m_dist->Eval(x, y, z, rng);
+  }
+
+  //! Checks if the cache has the interpolated value for the point, i.e.,
+  //! if the point is in a stored brick and within the band.
+  bool IsCached(const double x, const double y, const double z) const
+  {
+    double value;
+    return this->interpolate(x, y, z, value);
+  }
+
+  //! \return grid step.
+  double GetStep() const { return m_fStep; }
+
+  //! \return half-width of the cached band.
+  double GetBand() const { return m_fBand; }
+
+  //! \return number of stored bricks.
+  int GetNumBricks() const { return int( m_values.size() / BrickSize ); }
+
+  //! \return memory occupied by the cache in bytes.
+  size_t GetMemoryFootprint() const
+  {
+    return m_values.capacity()*sizeof(float) + m_brickIds.capacity()*sizeof(int);
+  }
+
+public:
+
+  //! Writes the cache to a binary file.
+  //! \param[in] filename the target file.
+  //! \param[in] key      the key of the mesh, e.g., the one computed by
+  //!                     ModelBvhCache::ComputeKey().
+  //! \return false if the file cannot be written.
+  bool Write(const char*    filename,
+             const uint64_t key) const
+  {
+    std::ofstream FILE(filename, std::ios::out | std::ios::binary);
+    //
+    if ( !FILE.is_open() )
+    {
+      std::cout << "Cannot open file '" << filename << "' for writing." << std::endl;
+      return false;
+    }
+
+    const int    numActive  = this->GetNumBricks();
+    const int    numFacets  = m_dist->GetFacets()->Size();
+    const double header[11] = { m_origin.x(),          m_origin.y(),          m_origin.z(),
+                                m_fStep,               m_fBand,
+                                m_box.CornerMin().x(), m_box.CornerMin().y(), m_box.CornerMin().z(),
+                                m_box.CornerMax().x(), m_box.CornerMax().y(), m_box.CornerMax().z() };
+
+    FILE.write( Signature, sizeof(Signature) );
+    FILE.write( reinterpret_cast<const char*>(&key),        sizeof(key) );
+    FILE.write( reinterpret_cast<const char*>(&numFacets),  sizeof(numFacets) );
+    FILE.write( reinterpret_cast<const char*>(header),      sizeof(header) );
+    FILE.write( reinterpret_cast<const char*>(m_numBricks), sizeof(m_numBricks) );
+    FILE.write( reinterpret_cast<const char*>(&numActive),  sizeof(numActive) );
+
+    // Only the active bricks are stored with their indices.
+    for ( int b = 0; b < int( m_brickIds.size() ); ++b )
+    {
+      const int id = m_brickIds[b];
+      if ( id < 0 )
+        continue;
+
+      FILE.write( reinterpret_cast<const char*>(&b), sizeof(b) );
+      FILE.write( reinterpret_cast<const char*>(&m_values[size_t(id)*BrickSize]), BrickSize*sizeof(float) );
+    }
+
+    return FILE.good();
+  }
+
+  //! Reads the cache from a binary file. The file is rejected unless it
+  //! was written for the mesh of the distance function passed to the ctor,
+  //! i.e., with the same key, number of facets and bounding box.
+  //! \param[in] filename the source file.
+  //! \param[in] key      the key of the mesh.
+  //! \return false if the file cannot be read, is corrupted or belongs to
+  //!         another mesh.
+  bool Read(const char*    filename,
+            const uint64_t key)
+  {
+    this->clear();
+
+    if ( m_dist.IsNull() || m_dist->GetFacets().IsNull() )
+      return false;
+
+    std::ifstream FILE(filename, std::ios::in | std::ios::binary);
+    //
+    if ( !FILE.is_open() )
+      return false;
+
+    char     signature[sizeof(Signature)];
+    uint64_t fileKey   = 0;
+    int      numFacets = 0;
+    double   header[11];
+    int      numBricks[3];
+    int      numActive = 0;
+
+    FILE.read( signature, sizeof(signature) );
+    FILE.read( reinterpret_cast<char*>(&fileKey),   sizeof(fileKey) );
+    FILE.read( reinterpret_cast<char*>(&numFacets), sizeof(numFacets) );
+    FILE.read( reinterpret_cast<char*>(header),     sizeof(header) );
+    FILE.read( reinterpret_cast<char*>(numBricks),  sizeof(numBricks) );
+    FILE.read( reinterpret_cast<char*>(&numActive), sizeof(numActive) );
+    //
+    if ( !FILE.good() || std::memcmp( signature, Signature, sizeof(Signature) ) != 0 )
+    {
+      std::cout << "File '" << filename << "' is not an SDF cache." << std::endl;
+      return false;
+    }
+
+    // The mesh has to be the same, and the grid has to be laid out over its
+    // box as Build() would do.
+    const BVH_Box<double, 3> aabb = m_dist->GetFacets()->Box();
+    const BVH_Vec3d          boxMin(header[5], header[6], header[7]);
+    const BVH_Vec3d          boxMax(header[8], header[9], header[10]);
+    //
+    if ( fileKey != key || numFacets != m_dist->GetFacets()->Size() || !aabb.IsValid() ||
+         (boxMin - aabb.CornerMin()).Modulus() > Precision::Confusion() ||
+         (boxMax - aabb.CornerMax()).Modulus() > Precision::Confusion() )
+    {
+      std::cout << "SDF cache in '" << filename << "' belongs to another mesh." << std::endl;
+      return false;
+    }
+
+    const BVH_Vec3d origin(header[0], header[1], header[2]);
+    const double    step = header[3];
+    const double    band = header[4];
+
+    BVH_Vec3d expectedOrigin;
+    int       expectedBricks[3] = { 0, 0, 0 };
+    //
+    if ( step > 0. && band >= 0. )
+      this->gridLayout(aabb, step, band, expectedOrigin, expectedBricks);
+
+    const int64_t numAll = int64_t(numBricks[0])*numBricks[1]*numBricks[2];
+    //
+    if ( numBricks[0] != expectedBricks[0] || numBricks[1] != expectedBricks[1] || numBricks[2] != expectedBricks[2] ||
+         numBricks[0] <= 0 || numBricks[1] <= 0 || numBricks[2] <= 0 ||
+         (origin - expectedOrigin).Modulus() > Precision::Confusion() ||
+         numActive < 0 || numActive > numAll )
+    {
+      std::cout << "SDF cache in '" << filename << "' is corrupted." << std::endl;
+      return false;
+    }
+
+    m_brickIds.assign(size_t(numAll), -1);
+    m_values.resize(size_t(numActive)*BrickSize);
+    //
+    for ( int id = 0; id < numActive; ++id )
+    {
+      int b = -1;
+      FILE.read( reinterpret_cast<char*>(&b), sizeof(b) );
+      //
+      if ( !FILE.good() || b < 0 || b >= numAll || m_brickIds[b] >= 0 )
+      {
+        std::cout << "SDF cache in '" << filename << "' is corrupted." << std::endl;
+        this->clear();
+        return false;
+      }
+
+      m_brickIds[b] = id;
+      FILE.read( reinterpret_cast<char*>(&m_values[size_t(id)*BrickSize]), BrickSize*sizeof(float) );
+    }
+
+    if ( !FILE.good() )
+    {
+      this->clear();
+      return false;
+    }
+
+    m_origin = origin;
+    m_fStep  = step;
+    m_fBand  = band;
+    m_box    = aabb;
+    //
+    for ( int k = 0; k < 3; ++k )
+      m_numBricks[k] = numBricks[k];
+
+    return true;
+  }
+
+protected:
+
+  //! Interpolates the cached distance. The bricks are stored whole, so
+  //! they reach beyond the band, where the values are not served.
+  //! \return false if the point is out of the stored bricks or the band.
+  bool interpolate(const double x,
+                   const double y,
+                   const double z,
+                   double&      value) const
+  {
+    if ( m_values.empty() )
+      return false;
+
+    const double u = (x - m_origin.x()) / m_fStep;
+    const double v = (y - m_origin.y()) / m_fStep;
+    const double w = (z - m_origin.z()) / m_fStep;
+
+    // The range is checked before the conversion to integers, which is
+    // undefined for the far points. The negated form rejects NaNs as well.
+    if ( !( u >= 0. && u < double(m_numBricks[0]*BrickCells) &&
+            v >= 0. && v < double(m_numBricks[1]*BrickCells) &&
+            w >= 0. && w < double(m_numBricks[2]*BrickCells) ) )
+      return false;
+
+    const int ci = int(u), cj = int(v), ck = int(w);
+    const int bi = ci / BrickCells, bj = cj / BrickCells, bk = ck / BrickCells;
+
+    const int id = m_brickIds[(bi*m_numBricks[1] + bj)*m_numBricks[2] + bk];
+    //
+    if ( id < 0 )
+      return false;
+
+    const float* V  = &m_values[size_t(id)*BrickSize];
+    const int    a  = ci - bi*BrickCells;
+    const int    c  = cj - bj*BrickCells;
+    const int    e  = ck - bk*BrickCells;
+    const double fu = u - ci;
+    const double fv = v - cj;
+    const double fw = w - ck;
+
+    auto node = [&](const int da, const int dc, const int de) -> double
+    {
+      return V[( (a + da)*BrickNodes + (c + dc) )*BrickNodes + (e + de)];
+    };
+
+    const double v00 = node(0, 0, 0)*(1 - fw) + node(0, 0, 1)*fw;
+    const double v01 = node(0, 1, 0)*(1 - fw) + node(0, 1, 1)*fw;
+    const double v10 = node(1, 0, 0)*(1 - fw) + node(1, 0, 1)*fw;
+    const double v11 = node(1, 1, 0)*(1 - fw) + node(1, 1, 1)*fw;
+    const double v0  = v00*(1 - fv) + v01*fv;
+    const double v1  = v10*(1 - fv) + v11*fv;
+
+    value = v0*(1 - fu) + v1*fu;
+    return Abs(value) <= m_fBand;
+  }
+
+  //! Lays out the grid over the bounding box of the mesh.
+  //! \param[in]  aabb      the bounding box of the mesh.
+  //! \param[in]  step      the grid step.
+  //! \param[in]  band      the half-width of the band.
+  //! \param[out] origin    the first grid node.
+  //! \param[out] numBricks the number of bricks along each axis.
+  static void gridLayout(const BVH_Box<double, 3>& aabb,
+                         const double              step,
+                         const double              band,
+                         BVH_Vec3d&                origin,
+                         int                       numBricks[3])
+  {
+    origin = aabb.CornerMin() - BVH_Vec3d(band, band, band);
+
+    const BVH_Vec3d size = aabb.Size() + BVH_Vec3d(2*band, 2*band, 2*band);
+    //
+    numBricks[0] = int( size.x() / (step*BrickCells) ) + 1;
+    numBricks[1] = int( size.y() / (step*BrickCells) ) + 1;
+    numBricks[2] = int( size.z() / (step*BrickCells) ) + 1;
+  }
+
+  //! Converts the linear brick index to the brick indices along the axes.
+  void brickIndices(const int b, int& bi, int& bj, int& bk) const
+  {
+    bk = b % m_numBricks[2];
+    bj = (b / m_numBricks[2]) % m_numBricks[1];
+    bi = b / (m_numBricks[1]*m_numBricks[2]);
+  }
+
+  //! Cleans up the cached values.
+  void clear()
+  {
+    m_brickIds.clear();
+    m_values.clear();
+    m_numBricks[0] = m_numBricks[1] = m_numBricks[2] = 0;
+  }
+
+protected:
+
+  //! Signature of the binary cache files.
+  static constexpr char Signature[8] = { 'S', 'D', 'F', 'C', 'A', 'C', 'H', '2' };
+
+protected:
+
+  Handle(MeshDist)   m_dist;         //!< Exact distance function.
+  BVH_Box<double, 3> m_box;          //!< Bounding box of the cached mesh.
+  BVH_Vec3d          m_origin;       //!< First grid node.
+  double             m_fStep;        //!< Grid step.
+  double             m_fBand;        //!< Half-width of the cached band.
+  int                m_numBricks[3]; //!< Number of bricks along each axis.
+  std::vector<int>   m_brickIds;     //!< Indices of bricks in the value array or -1.
+  std::vector<float> m_values;       //!< Distances at the nodes of active bricks.
+
+};
+
+#endif
@@ -0,0 +1,432 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2020-present, Quaoar Studio
+// All rights reserved.
+//-----------------------------------------------------------------------------
+
+// Local includes
+#include "ClassifyBRepParallel.h"
+#include "ClassifyPt.h"
+#include "ClassifyPtParallel.h"
+#include "MeshMerge.h"
+#include "ModelBvhCache.h"
+
+// OpenCascade includes
+#include <BRepMesh_IncrementalMesh.hxx>
+#include <BRepTools.hxx>
+#include <OSD_MemInfo.hxx>
+#include <OSD_Timer.hxx>
+
+// Standard includes
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+//-----------------------------------------------------------------------------
+
+namespace
+{
+  //! Parses a comma-separated list of numbers.
+  template <typename T>
+  bool parseList(const char* str, std::vector<T>& values)
+  {
+    values.clear();
+
+    std::stringstream ss(str);
+    std::string       item;
+    //
+    while ( std::getline(ss, item, ',') )
+    {
+      std::stringstream is(item);
+      T value;
+      //
+      if ( !(is >> value) )
+        return false;
+
+      values.push_back(value);
+    }
+    return !values.empty();
+  }
+
+  //! Samples the bounding box of the shape with a regular grid. The box
+  //! is taken from the B-rep only, so that the grid does not depend on
+  //! the mesh left in the shape by the previous runs or on cache hits.
+  void sampleGrid(const TopoDS_Shape&  shape,
+                  const int            density,
+                  std::vector<gp_XYZ>& gridPts)
+  {
+    Bnd_Box aabb;
+    BRepBndLib::Add(shape, aabb, false); // Do not use triangulation.
+
+    const gp_XYZ Pmin      = aabb.CornerMin().XYZ();
+    const gp_XYZ D         = aabb.CornerMax().XYZ() - Pmin;
+    const double mind      = Min( D.X(), Min( D.Y(), D.Z() ) );
+    const double d         = mind/density;
+    const int    nslice[3] = { int( Round(D.X()/d) ) + 1,
+                               int( Round(D.Y()/d) ) + 1,
+                               int( Round(D.Z()/d) ) + 1 };
+
+    gridPts.clear();
+    for ( int i = 0; i <= nslice[0]; ++i )
+      for ( int j = 0; j <= nslice[1]; ++j )
+        for ( int k = 0; k <= nslice[2]; ++k )
+          gridPts.push_back( Pmin + gp_XYZ(d*i, d*j, d*k) );
+  }
+
+  //! Escapes the string to be put in JSON.
+  std::string jsonEscape(const char* str)
+  {
+    std::string res;
+    for ( const char* c = str; *c; ++c )
+    {
+      if ( *c == '"' || *c == '\\' )
+        res += '\\';
+
+      res += *c;
+    }
+    return res;
+  }
+
+  //! \return memory of the process in bytes for the given counter.
+  size_t processMemory(const OSD_MemInfo::Counter counter)
+  {
+    OSD_MemInfo meminfo(false);
+    meminfo.Update();
+    return meminfo.Value(counter);
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+//! Headless benchmark of point membership classification. Runs OpenCascade's
+//! solid classifier and the BVH-based classifier on the same grids and
+//! prints the results as JSON for tracking them across releases.
+int main(int argc, char** argv)
+{
+  if ( argc < 2 )
+  {
+    std::cerr << "Usage: " << argv[0] << " <model.brep>"
+              << " [--density 10,20]"
+              << " [--deflection 0.1]"
+              << " [--threads 1,4]"
+              << " [--out result.json]"
+              << " [--cache dir]" << std::endl;
+    return 1;
+  }
+
+  std::vector<int>    densities   = { 20 };
+  std::vector<double> deflections = { 0.1 };
+  std::vector<int>    threads     = { 1, ClassifyPtParallel::GetMaxThreads() };
+  const char*         outFilename = nullptr;
+  const char*         cacheDir    = nullptr;
+
+  for ( int i = 2; i < argc; ++i )
+  {
+    const std::string arg  = argv[i];
+    const bool        hasV = (i + 1 < argc);
+    bool              isOk = hasV;
+
+    if ( hasV && arg == "--density" )
+      isOk = parseList(argv[++i], densities);
+    else if ( hasV && arg == "--deflection" )
+      isOk = parseList(argv[++i], deflections);
+    else if ( hasV && arg == "--threads" )
+      isOk = parseList(argv[++i], threads);
+    else if ( hasV && arg == "--out" )
+      outFilename = argv[++i];
+    else if ( hasV && arg == "--cache" )
+      cacheDir = argv[++i];
+    else
+      isOk = false;
+
+    if ( !isOk )
+    {
+      std::cerr << "Invalid argument '" << arg << "'." << std::endl;
+      return 1;
+    }
+  }
+
+  // Read the model.
+  BRep_Builder bb;
+  TopoDS_Shape shape;
+  //
+  if ( !BRepTools::Read(shape, argv[1], bb) )
+  {
+    std::cerr << "Failed to read BREP shape from file '" << argv[1] << "'." << std::endl;
+    return 1;
+  }
+
+  std::ostringstream json;
+  json << "{\n"
+       << "  \"model\": \"" << jsonEscape(argv[1]) << "\",\n"
+#if defined(__AVX2__)
+       << "  \"simd\": \"avx2\",\n"
+#else
+       << "  \"simd\": \"scalar\",\n"
+#endif
+       << "  \"max_threads\": " << ClassifyPtParallel::GetMaxThreads() << ",\n"
+       << "  \"runs\": [";
+
+  OSD_Timer           timer;
+  std::vector<gp_XYZ> gridPts;
+  bool                isFirstRun = true;
+
+  for ( const int density : densities )
+  {
+    // The reference classification does not depend on the mesh.
+    sampleGrid(shape, density, gridPts);
+
+    // It runs on the same numbers of threads as the BVH-based one.
+    ClassifyBRepParallel classBrepPar(shape);
+    std::vector<uint8_t> brepMask;
+    std::vector<double>  secBrep( threads.size() );
+    //
+    for ( size_t t = 0; t < threads.size(); ++t )
+    {
+      timer.Reset();
+      timer.Start();
+      //
+      classBrepPar.Perform(gridPts, Precision::Confusion(), brepMask, threads[t]);
+      //
+      timer.Stop();
+
+      secBrep[t] = timer.ElapsedTime();
+    }
+
+    for ( const double deflection : deflections )
+    {
+      ModelBvh::t_buildParams buildParams;
+      buildParams.NumThreads = -1;
+
+      // Try to restore the accelerating structure from cache first.
+      Handle(ModelBvh) cachedBvh;
+      uint64_t         cacheKey = 0;
+      //
+      timer.Reset();
+      timer.Start();
+      //
+      if ( cacheDir )
+      {
+        cacheKey  = ModelBvhCache::ComputeKey(shape, deflection, buildParams);
+        cachedBvh = ModelBvhCache(cacheDir).Load(cacheKey);
+      }
+      //
+      timer.Stop();
+
+      const double secLoad    = timer.ElapsedTime();
+      const bool   isCacheHit = !cachedBvh.IsNull();
+
+      // Mesh the shape from scratch for each deflection.
+      MeshMerge merger(shape);
+      double    secMesh = 0.0;
+      //
+      if ( !isCacheHit )
+      {
+        timer.Reset();
+        timer.Start();
+        //
+        BRepTools::Clean(shape);
+        BRepMesh_IncrementalMesh meshGen(shape, deflection);
+        //
+        merger.Perform();
+        //
+        timer.Stop();
+
+        secMesh = timer.ElapsedTime();
+
+        if ( merger.GetTriangulation().IsNull() )
+        {
+          std::cerr << "No triangulation for deflection " << deflection << "." << std::endl;
+          continue;
+        }
+      }
+
+      // Build the classifier.
+      const size_t memBefore = processMemory(OSD_MemInfo::MemPrivate);
+
+      timer.Reset();
+      timer.Start();
+      //
+      ClassifyPt classMesh = isCacheHit ? ClassifyPt(cachedBvh)
+                                        : ClassifyPt(merger.GetTriangulation(), buildParams);
+      //
+      timer.Stop();
+
+      const double secBuild  = timer.ElapsedTime();
+      const size_t memAfter  = processMemory(OSD_MemInfo::MemPrivate);
+      const size_t bvhMemory = classMesh.GetBvh()->GetFacetsMemory()
+                             + classMesh.GetBvh()->GetNodesMemory();
+
+      if ( cacheDir && !isCacheHit && !ModelBvhCache(cacheDir).Store( cacheKey, classMesh.GetBvh() ) )
+        std::cerr << "Failed to store BVH in cache '" << cacheDir << "'." << std::endl;
+
+      json << (isFirstRun ? "\n" : ",\n")
+           << "    {\n"
+           << "      \"density\": "         << density                              << ",\n"
+           << "      \"deflection\": "      << deflection                           << ",\n"
+           << "      \"num_points\": "      << gridPts.size()                       << ",\n"
+           << "      \"num_triangles\": "   << classMesh.GetBvh()->Size()           << ",\n"
+           << "      \"num_free_links\": "  << (isCacheHit ? std::string("null")
+                                                  : std::to_string( merger.GetStats().NumFreeLinks )) << ",\n"
+           << "      \"cache_hit\": "       << (isCacheHit ? "true" : "false")      << ",\n"
+           << "      \"cache_load_sec\": "  << secLoad                              << ",\n"
+           << "      \"mesh_sec\": "        << secMesh                              << ",\n"
+           << "      \"build_sec\": "       << secBuild                             << ",\n"
+           << "      \"bvh_bytes\": "       << bvhMemory                            << ",\n"
+           << "      \"build_mem_bytes\": " << (memAfter > memBefore ? memAfter - memBefore : 0) << ",\n"
+           << "      \"brep\": [";
+      //
+      for ( size_t t = 0; t < threads.size(); ++t )
+      {
+        json << (t ? ",\n" : "\n")
+             << "        { \"threads\": "      << threads[t]
+             << ", \"query_sec\": "            << secBrep[t]
+             << ", \"points_per_sec\": "       << gridPts.size() / secBrep[t] << " }";
+      }
+      //
+      json << "\n      ],\n"
+           << "      \"bvh\": [";
+      isFirstRun = false;
+
+      ClassifyPtParallel   classPar(classMesh);
+      std::vector<uint8_t> mask;
+      //
+      for ( size_t t = 0; t < threads.size(); ++t )
+      {
+        timer.Reset();
+        timer.Start();
+        //
+        classPar.Perform(gridPts, Precision::Confusion(), mask, threads[t]);
+        //
+        timer.Stop();
+
+        const double secQuery  = timer.ElapsedTime();
+        size_t       numAgreed = 0;
+        size_t       numInner  = 0;
+        //
+        for ( size_t i = 0; i < gridPts.size(); ++i )
+        {
+          if ( mask[i] == brepMask[i] )
+            numAgreed++;
+          if ( mask[i] )
+            numInner++;
+        }
+
+        json << (t ? ",\n" : "\n")
+             << "        { \"threads\": "      << threads[t]
+             << ", \"query_sec\": "            << secQuery
+             << ", \"points_per_sec\": "       << gridPts.size() / secQuery
+             << ", \"speedup_vs_brep\": "      << secBrep[t] / secQuery
+             << ", \"num_inner\": "            << numInner
+             << ", \"agreement\": "            << double(numAgreed) / gridPts.size() << " }";
+      }
+
+      // Weigh the cost of the Morton sort against its cache gain on the
+      // max number of threads. The grid points are coherent already, so
+      // the unsorted run is the baseline.
+      const int        sortThreads = threads.back();
+      std::vector<int> order;
+      //
+      timer.Reset();
+      timer.Start();
+      //
+      MeshDist::GetMortonOrder(gridPts, order, false);
+      //
+      timer.Stop();
+
+      const double secSortSerial = timer.ElapsedTime();
+
+      timer.Reset();
+      timer.Start();
+      //
+      MeshDist::GetMortonOrder(gridPts, order, true);
+      //
+      timer.Stop();
+
+      const double secSortParallel = timer.ElapsedTime();
+      double       secSorted       = 0.0;
+      double       secUnsorted     = 0.0;
+      //
+      for ( const bool isSorted : { true, false } )
+      {
+        timer.Reset();
+        timer.Start();
+        //
+        ClassifyPtParallel(classMesh, 1024, isSorted).Perform(gridPts, Precision::Confusion(), mask, sortThreads);
+        //
+        timer.Stop();
+
+        (isSorted ? secSorted : secUnsorted) = timer.ElapsedTime();
+      }
+
+      json << "\n      ],\n"
+           << "      \"morton\": { \"threads\": "  << sortThreads
+           << ", \"sort_serial_sec\": "              << secSortSerial
+           << ", \"sort_parallel_sec\": "            << secSortParallel
+           << ", \"query_sorted_sec\": "             << secSorted
+           << ", \"query_unsorted_sec\": "           << secUnsorted << " },\n"
+           << "      \"storage\": [";
+
+      // Compare the facet storage layouts on the max number of threads. The
+      // resident bytes include the AoS facets kept for rebuilding the tree,
+      // while the layout bytes are those streamed by the leaf loops.
+      const Handle(ModelBvh)&      bvh             = classMesh.GetBvh();
+      const int                    storageThreads  = threads.back();
+      const ModelBvh::FacetStorage storages[3]     = { ModelBvh::FacetStorage_AoS,
+                                                       ModelBvh::FacetStorage_SoA64,
+                                                       ModelBvh::FacetStorage_SoA32 };
+      const char*                  storageNames[3] = { "aos", "soa64", "soa32" };
+      //
+      for ( int is = 0; is < 3; ++is )
+      {
+        bvh->SetFacetStorage(storages[is]);
+
+        const size_t layoutBytes = (storages[is] == ModelBvh::FacetStorage_SoA64) ? bvh->GetFacets64().GetMemoryFootprint()
+                                 : (storages[is] == ModelBvh::FacetStorage_SoA32) ? bvh->GetFacets32().GetMemoryFootprint()
+                                                                                  : bvh->GetFacetsMemory();
+
+        timer.Reset();
+        timer.Start();
+        //
+        classPar.Perform(gridPts, Precision::Confusion(), mask, storageThreads);
+        //
+        timer.Stop();
+
+        json << (is ? ",\n" : "\n")
+             << "        { \"layout\": \""          << storageNames[is]
+             << "\", \"threads\": "                << storageThreads
+             << ", \"layout_bytes_per_tri\": "     << double(layoutBytes) / bvh->Size()
+             << ", \"resident_bytes_per_tri\": "   << double( bvh->GetFacetsMemory() ) / bvh->Size()
+             << ", \"points_per_sec\": "           << gridPts.size() / timer.ElapsedTime() << " }";
+      }
+      //
+      bvh->SetFacetStorage(ModelBvh::FacetStorage_AoS);
+
+      json << "\n      ]\n"
+           << "    }";
+    }
+  }
+
+  json << "\n  ],\n"
+       << "  \"peak_mem_bytes\": " << processMemory(OSD_MemInfo::MemWorkingSetPeak) << "\n"
+       << "}\n";
+
+  if ( outFilename )
+  {
+    std::ofstream FILE(outFilename);
+    //
+    if ( !FILE.is_open() )
+    {
+      std::cerr << "Cannot open file '" << outFilename << "' for writing." << std::endl;
+      return 1;
+    }
+    FILE << json.str();
+  }
+  else
+  {
+    std::cout << json.str();
+  }
+
+  return 0;
+}
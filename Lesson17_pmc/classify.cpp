@@ -0,0 +1,122 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2020-present, Quaoar Studio
+// All rights reserved.
+//-----------------------------------------------------------------------------
+
+// Local includes
+#include "ClassifyPt.h"
+#include "ClassifyStream.h"
+
+// OpenCascade includes
+#include <BRepMesh_IncrementalMesh.hxx>
+#include <BRepTools.hxx>
+
+// Standard includes
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+//-----------------------------------------------------------------------------
+
+//! Headless classification of a point file against a B-rep model. See
+//! ClassifyStream for the file formats.
+int main(int argc, char** argv)
+{
+  if ( argc < 4 )
+  {
+    std::cerr << "Usage: " << argv[0] << " <model.brep> <points.bin> <out.bin>"
+              << " [--deflection 0.1]"
+              << " [--tol 0.01]"
+              << " [--chunk 1048576]"
+              << " [--threads 8]"
+              << " [--points]"
+              << " [--compact]" << std::endl;
+    return 1;
+  }
+
+  double deflection = 0.1;
+  double tol        = -1.;
+  int    chunkSize  = 1 << 20;
+  int    numThreads = -1;
+  bool   isPoints   = false;
+  bool   isCompact  = false;
+
+  for ( int i = 4; i < argc; ++i )
+  {
+    const std::string arg  = argv[i];
+    const bool        hasV = (i + 1 < argc);
+
+    if ( hasV && arg == "--deflection" )
+      deflection = std::atof(argv[++i]);
+    else if ( hasV && arg == "--tol" )
+      tol = std::atof(argv[++i]);
+    else if ( hasV && arg == "--chunk" )
+      chunkSize = std::atoi(argv[++i]);
+    else if ( hasV && arg == "--threads" )
+      numThreads = std::atoi(argv[++i]);
+    else if ( arg == "--points" )
+      isPoints = true;
+    else if ( arg == "--compact" )
+      isCompact = true;
+    else
+    {
+      std::cerr << "Invalid argument '" << arg << "'." << std::endl;
+      return 1;
+    }
+  }
+
+  // Read the model.
+  BRep_Builder bb;
+  TopoDS_Shape shape;
+  //
+  if ( !BRepTools::Read(shape, argv[1], bb) )
+  {
+    std::cerr << "Failed to read BREP shape from file '" << argv[1] << "'." << std::endl;
+    return 1;
+  }
+
+  // Mesh the model.
+  BRepMesh_IncrementalMesh meshGen(shape, deflection);
+
+  // The default tolerance is the one of the demo.
+  if ( tol < 0. )
+  {
+    Bnd_Box aabb;
+    BRepBndLib::Add(shape, aabb, true); // Use triangulation.
+
+    const gp_XYZ D = aabb.CornerMax().XYZ() - aabb.CornerMin().XYZ();
+    tol = Min( D.X(), Min( D.Y(), D.Z() ) ) / 50;
+  }
+
+  ModelBvh::t_buildParams buildParams;
+  buildParams.NumThreads = -1;
+
+  // The facets are taken right from the face triangulations.
+  ClassifyPt classMesh(shape, buildParams);
+  //
+  if ( classMesh.GetBvh()->Size() == 0 )
+  {
+    std::cerr << "No triangulation for deflection " << deflection << "." << std::endl;
+    return 1;
+  }
+  //
+  if ( isCompact && !classMesh.GetBvh()->Compact() )
+    std::cerr << "Failed to compact BVH, the full one is used." << std::endl;
+
+  // Classify.
+  ClassifyStream stream(classMesh, chunkSize);
+  //
+  if ( !stream.Perform( argv[2], argv[3], tol,
+                        isPoints ? ClassifyStream::Output_InnerPoints : ClassifyStream::Output_BitMask,
+                        numThreads ) )
+    return 1;
+
+  const ClassifyStream::t_stats& stats = stream.GetStats();
+
+  std::cout << "Num. classified points: " << stats.NumPoints         << std::endl;
+  std::cout << "Num. inner points:      " << stats.NumInner          << std::endl;
+  std::cout << "Tolerance:              " << tol                     << std::endl;
+  std::cout << "Seconds:                " << stats.Seconds           << std::endl;
+  std::cout << "Points/sec:             " << stats.GetPointsPerSec() << std::endl;
+  return 0;
+}
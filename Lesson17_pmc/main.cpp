@@ -4,19 +4,29 @@
 //-----------------------------------------------------------------------------
 
 // Local includes
+#include "ClassifyBRepParallel.h"
+#include "ClassifyOctree.h"
 #include "ClassifyPt.h"
+#include "ClassifyPtParallel.h"
+#include "ClassifySolids.h"
+#include "MeshMerge.h"
+#include "ModelBvhCache.h"
+#include "MonteCarloProps.h"
+#include "SdfCache.h"
 #include "Viewer.h"
 
 // OpenCascade includes
 #include <BRepBuilderAPI_MakeVertex.hxx>
 #include <BRepClass3d_SolidClassifier.hxx>
+#include <BRepGProp.hxx>
 #include <BRepMesh_IncrementalMesh.hxx>
 #include <BRepTools.hxx>
+#include <GProp_GProps.hxx>
 #include <OSD_Timer.hxx>
-#include <Poly_CoherentTriangulation.hxx>
 #include <TopExp_Explorer.hxx>
 
 // Standard includes
+#include <algorithm>
 #include <unordered_map>
 
 #define TIMER_NEW \
@@ -84,53 +94,38 @@ int main(int argc, char** argv)
    *  Prepare visualization meshes.
    * ============================== */
 
-  // Prepare data structure for all triangles with back refs.
-  Handle(Poly_CoherentTriangulation)
-    tris = new Poly_CoherentTriangulation;
-
   const double linDefl = 0.1;
   BRepMesh_IncrementalMesh meshGen(shape, linDefl);
 
-  // Add all triangulations from faces to the common collection.
-  for ( TopExp_Explorer fexp(shape, TopAbs_FACE); fexp.More(); fexp.Next() )
-  {
-    const TopoDS_Face& face = TopoDS::Face( fexp.Current() );
-
-    // Poly_MeshPurpose was introduced in OpenCascade 7.6 and remained
-    // undocumented.
-    TopLoc_Location L;
-    const Handle(Poly_Triangulation)&
-      poly = BRep_Tool::Triangulation(face, L);
-
-    // Add nodes.
-    std::unordered_map<int, int> nodesMap;
-    for ( int iNode = 1; iNode <= poly->NbNodes(); ++iNode )
-    {
-      // Make sure to apply location, e.g., see the effect in /cad/ANC101.brep
-      const int n = tris->SetNode( poly->Node(iNode).Transformed(L).XYZ() );
-
-      // Local to global node index mapping.
-      nodesMap.insert({iNode, n});
-    }
+  TIMER_NEW
+  TIMER_GO
 
-    // Add triangles.
-    for ( int iTri = 1; iTri <= poly->NbTriangles(); ++iTri )
-    {
-      const Poly_Triangle& tri = poly->Triangle(iTri);
+  // Merge all triangulations from faces into a watertight mesh.
+  MeshMerge merger(shape);
+  merger.Perform();
 
-      int iNodes[3];
-      tri.Get(iNodes[0], iNodes[1], iNodes[2]);
+  const Handle(Poly_Triangulation)& mesh = merger.GetTriangulation();
 
-      // Try disabling this and check how mesh is visualized.
-      if ( face.Orientation() == TopAbs_REVERSED )
-        std::swap(iNodes[1], iNodes[2]);
+  TIMER_FINISH
+  TIMER_COUT_RESULT_MSG("Mesh merging")
 
-      tris->AddTriangle(nodesMap[iNodes[0]], nodesMap[iNodes[1]], nodesMap[iNodes[2]]);
-    }
+  const MeshMerge::t_stats& mergeStats = merger.GetStats();
+  //
+  std::cout << "Num. faces:                                  " << mergeStats.NumFaces        << std::endl;
+  std::cout << "Num. nodes before/after welding:             " << mergeStats.NumNodesIn      << " / "
+                                                               << mergeStats.NumNodesOut     << std::endl;
+  std::cout << "Num. triangles before/after welding:         " << mergeStats.NumTrianglesIn  << " / "
+                                                               << mergeStats.NumTrianglesOut << std::endl;
+  std::cout << "Num. free links:                             " << mergeStats.NumFreeLinks    << std::endl;
+
+  if ( mesh.IsNull() )
+  {
+    std::cout << "The shape has no triangulation." << std::endl;
+    return 1;
   }
 
   // Display the triangulation to be sure it's consistent.
-  vout << tris->GetTriangulation();
+  vout << mesh;
 
   /* =========================
    *  Sample the bounding box.
@@ -171,7 +166,7 @@ int main(int argc, char** argv)
    *  PMC by OpenCascade.
    * ==================== */
 
-  TIMER_NEW
+  TIMER_RESET
   TIMER_GO
 
   int                        numInnerByBrep = 0;
@@ -195,6 +190,8 @@ int main(int argc, char** argv)
   TIMER_FINISH
   TIMER_COUT_RESULT_MSG("OpenCascade PMC")
 
+  const double secBrep = __aux_debug_Timer.ElapsedTime();
+
   /* ====================
    *  PMC by ray casting.
    * ==================== */
@@ -206,7 +203,9 @@ int main(int argc, char** argv)
   const double               tolMesh       = mind/50;
   TColStd_PackedMapOfInteger iPtsMesh;
 
-  ClassifyPt classMesh( tris->GetTriangulation() );
+  // The classifier takes the face triangulations directly, so the merged
+  // mesh is only needed for visualization.
+  ClassifyPt classMesh(shape);
 
   for ( int i = 0; i < int( gridPts.size() ); ++i )
   {
@@ -221,10 +220,435 @@ int main(int argc, char** argv)
   TIMER_FINISH
   TIMER_COUT_RESULT_MSG("BVH-based PMC")
 
-  std::cout << "Num. tested points:                          " << gridPts.size() << std::endl;
-  std::cout << "Num. inner points with OpenCascade      PMC: " << numInnerByBrep << std::endl;
-  std::cout << "Num. inner points with BVH-based        PMC: " << numInnerByBvh  << std::endl;
-  std::cout << "Tolerance for inner points in BVH-based PMC: " << tolMesh        << std::endl;
+  const double ptsPerSecBvh = gridPts.size() / __aux_debug_Timer.ElapsedTime();
+
+  /* ==========================
+   *  PMC by packet ray casting.
+   * ========================== */
+
+  TIMER_RESET
+  TIMER_GO
+
+  std::vector<uint8_t> batchMask;
+  classMesh.IsInBatch(gridPts, tolMesh, batchMask);
+
+  const int numInnerByBatch = int( std::count( batchMask.begin(), batchMask.end(), uint8_t(1) ) );
+
+  TIMER_FINISH
+  TIMER_COUT_RESULT_MSG("BVH-based PMC (batch)")
+
+  const double ptsPerSecBatch = gridPts.size() / __aux_debug_Timer.ElapsedTime();
+
+  /* =========================
+   *  PMC by grid column rays.
+   * ========================= */
+
+  TIMER_RESET
+  TIMER_GO
+
+  const int            numNodes[3] = { nslice[0] + 1, nslice[1] + 1, nslice[2] + 1 };
+  std::vector<uint8_t> gridMask;
+  //
+  classMesh.IsInGrid(Pmin, d, numNodes, tolMesh, gridMask);
+
+  const int numInnerByGrid = int( std::count( gridMask.begin(), gridMask.end(), uint8_t(1) ) );
+
+  TIMER_FINISH
+  TIMER_COUT_RESULT_MSG("BVH-based PMC (grid columns)")
+
+  const double ptsPerSecGrid = gridPts.size() / __aux_debug_Timer.ElapsedTime();
+
+  std::cout << "Num. tested points:                          " << gridPts.size()  << std::endl;
+  std::cout << "Num. inner points with OpenCascade      PMC: " << numInnerByBrep  << std::endl;
+  std::cout << "Num. inner points with BVH-based        PMC: " << numInnerByBvh   << std::endl;
+  std::cout << "Num. inner points with BVH-based batch  PMC: " << numInnerByBatch << std::endl;
+  std::cout << "Num. inner points with BVH-based grid   PMC: " << numInnerByGrid  << std::endl;
+  std::cout << "Tolerance for inner points in BVH-based PMC: " << tolMesh         << std::endl;
+#if defined(__AVX2__)
+  std::cout << "Batch PMC traversal:                         AVX2 packets" << std::endl;
+#else
+  std::cout << "Batch PMC traversal:                         scalar"       << std::endl;
+#endif
+  std::cout << "Points/sec with BVH-based       PMC:         " << ptsPerSecBvh    << std::endl;
+  std::cout << "Points/sec with BVH-based batch PMC:         " << ptsPerSecBatch  << std::endl;
+  std::cout << "Points/sec with BVH-based grid  PMC:         " << ptsPerSecGrid   << std::endl;
+
+  /* ===============================
+   *  PMC by ray casting in threads.
+   * =============================== */
+
+  ClassifyPtParallel classPar(classMesh);
+
+  std::cout << "\nParallel BVH-based PMC (OpenCascade PMC took " << secBrep << " sec.)" << std::endl;
+  std::cout << "Threads | Seconds | Points/sec | Speedup | Num. inner points" << std::endl;
+
+  const int            maxThreads = ClassifyPtParallel::GetMaxThreads();
+  double               secSerial  = 0.;
+  std::vector<uint8_t> parMask;
+  std::vector<double>  secBvhPar; // For 1, 2, 4, ... threads.
+  //
+  for ( int numThreads = 1; ; numThreads = Min(numThreads*2, maxThreads) )
+  {
+    TIMER_RESET
+    TIMER_GO
+
+    classPar.Perform(gridPts, tolMesh, parMask, numThreads);
+
+    TIMER_FINISH
+
+    const double sec = __aux_debug_Timer.ElapsedTime();
+    //
+    if ( numThreads == 1 )
+      secSerial = sec;
+
+    secBvhPar.push_back(sec);
+
+    std::cout << numThreads                                                  << " | "
+              << sec                                                         << " | "
+              << gridPts.size() / sec                                        << " | "
+              << secSerial / sec                                             << " | "
+              << std::count( parMask.begin(), parMask.end(), uint8_t(1) ) << std::endl;
+
+    if ( numThreads == maxThreads )
+      break;
+  }
+
+  /* ======================
+   *  Exact PMC in threads.
+   * ====================== */
+
+  ClassifyBRepParallel classBrepPar(shape);
+
+  std::cout << "\nParallel OpenCascade PMC" << std::endl;
+  std::cout << "Threads | Seconds | Points/sec | Speedup | BVH speedup | Num. inner points" << std::endl;
+
+  std::vector<uint8_t> brepMask;
+  //
+  for ( int numThreads = 1, run = 0; ; numThreads = Min(numThreads*2, maxThreads), ++run )
+  {
+    TIMER_RESET
+    TIMER_GO
+
+    classBrepPar.Perform(gridPts, tolBrep, brepMask, numThreads);
+
+    TIMER_FINISH
+
+    const double sec = __aux_debug_Timer.ElapsedTime();
+
+    std::cout << numThreads                                                    << " | "
+              << sec                                                           << " | "
+              << gridPts.size() / sec                                          << " | "
+              << secBrep / sec                                                 << " | "
+              << sec / secBvhPar[run]                                          << " | "
+              << std::count( brepMask.begin(), brepMask.end(), uint8_t(1) ) << std::endl;
+
+    if ( numThreads == maxThreads )
+      break;
+  }
+
+  /* ==============================
+   *  PMC by closest pseudo-normals.
+   * ============================== */
+
+  std::vector<uint8_t> pnMask;
+  //
+  classMesh.SetSignMode(MeshDist::SignMode_PseudoNormals);
+
+  TIMER_RESET
+  TIMER_GO
+
+  classPar.Perform(gridPts, tolMesh, pnMask, 1);
+
+  TIMER_FINISH
+  TIMER_COUT_RESULT_MSG("BVH-based PMC (pseudo-normals, 1 thread)")
+
+  int numAgreedPn = 0;
+  for ( size_t i = 0; i < gridPts.size(); ++i )
+    if ( pnMask[i] == parMask[i] )
+      numAgreedPn++;
+
+  std::cout << "Num. inner points with pseudo-normals:       " << std::count( pnMask.begin(), pnMask.end(), uint8_t(1) ) << std::endl;
+  std::cout << "Speedup over ray voting (1 thread):          " << secSerial / __aux_debug_Timer.ElapsedTime()             << std::endl;
+  std::cout << "Agreement with ray voting:                   " << double(numAgreedPn) / gridPts.size()                    << std::endl;
+
+  classMesh.SetSignMode(MeshDist::SignMode_RayVoting);
+
+  /* ===============================
+   *  Compare facet storage layouts.
+   * =============================== */
+
+  const ModelBvh::FacetStorage storages[3]     = { ModelBvh::FacetStorage_AoS,
+                                                   ModelBvh::FacetStorage_SoA64,
+                                                   ModelBvh::FacetStorage_SoA32 };
+  const char*                  storageNames[3] = { "AoS", "SoA64", "SoA32" };
+  const Handle(ModelBvh)&      modelBvh        = classMesh.GetBvh();
+
+  std::cout << "\nFacet storage (" << modelBvh->Size() << " facets, "
+            << maxThreads << " threads)" << std::endl;
+  std::cout << "Layout | Facet bytes/tri | Node bytes/tri | Points/sec | Num. inner points" << std::endl;
+  //
+  for ( int is = 0; is < 3; ++is )
+  {
+    modelBvh->SetFacetStorage(storages[is]);
+
+    TIMER_RESET
+    TIMER_GO
+
+    classPar.Perform(gridPts, tolMesh, parMask, maxThreads);
+
+    TIMER_FINISH
+
+    std::cout << storageNames[is]                                                  << " | "
+              << double( modelBvh->GetFacetsMemory() ) / modelBvh->Size()         << " | "
+              << double( modelBvh->GetNodesMemory() ) / modelBvh->Size()          << " | "
+              << gridPts.size() / __aux_debug_Timer.ElapsedTime()                 << " | "
+              << std::count( parMask.begin(), parMask.end(), uint8_t(1) ) << std::endl;
+  }
+  //
+  modelBvh->SetFacetStorage(ModelBvh::FacetStorage_AoS);
+
+  /* =============================
+   *  Compare binary and wide BVH.
+   * ============================= */
+
+  std::cout << "\nBVH arity (" << modelBvh->Size() << " facets, "
+            << maxThreads << " threads)" << std::endl;
+  std::cout << "Arity | Node bytes/tri | Points/sec | Num. inner points" << std::endl;
+  //
+  for ( int iw = 0; iw < 2; ++iw )
+  {
+    modelBvh->SetWideNodes(iw == 1);
+
+    TIMER_RESET
+    TIMER_GO
+
+    classPar.Perform(gridPts, tolMesh, parMask, maxThreads);
+
+    TIMER_FINISH
+
+    std::cout << (iw ? "4" : "2")                                                 << " | "
+              << double( modelBvh->GetNodesMemory() ) / modelBvh->Size()          << " | "
+              << gridPts.size() / __aux_debug_Timer.ElapsedTime()                 << " | "
+              << std::count( parMask.begin(), parMask.end(), uint8_t(1) ) << std::endl;
+  }
+  //
+  modelBvh->SetWideNodes(false);
+
+  /* ==============================
+   *  Compact BVH for large meshes.
+   * ============================== */
+
+  ClassifyPt classCompact(mesh);
+  //
+  const Handle(ModelBvh)& compactBvh  = classCompact.GetBvh();
+  const double            bytesBefore = double( compactBvh->GetFacetsMemory() + compactBvh->GetNodesMemory() ) / compactBvh->Size();
+
+  TIMER_RESET
+  TIMER_GO
+
+  const bool isCompact = compactBvh->Compact();
+
+  TIMER_FINISH
+  TIMER_COUT_RESULT_MSG("Compact BVH")
+
+  const double bytesAfter = double( compactBvh->GetFacetsMemory() + compactBvh->GetNodesMemory() ) / compactBvh->Size();
+
+  TIMER_RESET
+  TIMER_GO
+
+  ClassifyPtParallel(classCompact).Perform(gridPts, tolMesh, parMask, maxThreads);
+
+  TIMER_FINISH
+
+  std::cout << "Compact BVH is built:                        " << isCompact                                             << std::endl;
+  std::cout << "Bytes/tri before compaction:                 " << bytesBefore                                           << std::endl;
+  std::cout << "Bytes/tri after compaction:                  " << bytesAfter                                            << std::endl;
+  std::cout << "Num. inner points with compact BVH:          " << std::count( parMask.begin(), parMask.end(), uint8_t(1) ) << std::endl;
+  std::cout << "Points/sec with compact BVH:                 " << gridPts.size() / __aux_debug_Timer.ElapsedTime()      << std::endl;
+
+  /* =======================
+   *  Compare BVH builders.
+   * ======================= */
+
+  const ModelBvh::BuilderType builders[2]     = { ModelBvh::Builder_Binned, ModelBvh::Builder_Linear };
+  const char*                 builderNames[2] = { "Binned", "Linear" };
+
+  std::cout << "\nBVH construction (" << modelBvh->Size() << " facets)" << std::endl;
+  std::cout << "Builder | Threads | Build sec. | Node bytes/tri | Points/sec | Num. inner points" << std::endl;
+  //
+  for ( int ib = 0; ib < 2; ++ib )
+  {
+    for ( int numThreads = 1; ; numThreads = maxThreads )
+    {
+      ModelBvh::t_buildParams params;
+      params.Builder    = builders[ib];
+      params.NumThreads = numThreads;
+
+      // The classifier builds its tree in the ctor.
+      TIMER_RESET
+      TIMER_GO
+
+      ClassifyPt classBuilt(mesh, params);
+
+      TIMER_FINISH
+
+      const double secBuild = __aux_debug_Timer.ElapsedTime();
+
+      // Check the quality of the tree on the same queries.
+      TIMER_RESET
+      TIMER_GO
+
+      ClassifyPtParallel(classBuilt).Perform(gridPts, tolMesh, parMask, maxThreads);
+
+      TIMER_FINISH
+
+      std::cout << builderNames[ib]                                                            << " | "
+                << numThreads                                                                  << " | "
+                << secBuild                                                                    << " | "
+                << double( classBuilt.GetBvh()->GetNodesMemory() ) / classBuilt.GetBvh()->Size() << " | "
+                << gridPts.size() / __aux_debug_Timer.ElapsedTime()                            << " | "
+                << std::count( parMask.begin(), parMask.end(), uint8_t(1) ) << std::endl;
+
+      if ( numThreads == maxThreads )
+        break;
+    }
+  }
+
+  /* ========================
+   *  PMC by adaptive octree.
+   * ======================== */
+
+  TIMER_RESET
+  TIMER_GO
+
+  ClassifyOctree octree(classMesh);
+  octree.Perform(Pmin, d, numNodes, tolMesh);
+
+  std::vector<uint8_t> octMask;
+  octree.GetMask(octMask);
+
+  TIMER_FINISH
+  TIMER_COUT_RESULT_MSG("BVH-based PMC (adaptive octree)")
+
+  std::cout << "Num. inner points with octree:               " << std::count( octMask.begin(), octMask.end(), uint8_t(1) ) << std::endl;
+  std::cout << "Num. point queries with octree:              " << octree.GetNumQueries()                                  << std::endl;
+  std::cout << "Num. octree leaves:                          " << octree.GetCells().size()                                << std::endl;
+  std::cout << "Octree memory (bytes):                       " << octree.GetMemoryFootprint()                             << std::endl;
+  std::cout << "Points/sec with octree PMC:                  " << gridPts.size() / __aux_debug_Timer.ElapsedTime()        << std::endl;
+
+  /* ================================
+   *  Signed distance field caching.
+   * ================================ */
+
+  // The cache is read from the file passed as the second argument if it
+  // exists there and was written for the same mesh. Otherwise, it is built
+  // and written to that file.
+  Handle(SdfCache) sdf    = new SdfCache( classMesh.GetDist() );
+  const uint64_t   sdfKey = ModelBvhCache::ComputeKey(shape, linDefl);
+
+  TIMER_RESET
+  TIMER_GO
+
+  const bool isSdfRead = (argc > 2) && sdf->Read(argv[2], sdfKey);
+  //
+  if ( !isSdfRead )
+  {
+    sdf->Build(d/4, 2*tolMesh);
+
+    if ( argc > 2 )
+      sdf->Write(argv[2], sdfKey);
+  }
+
+  TIMER_FINISH
+  TIMER_COUT_RESULT_MSG( (isSdfRead ? "SDF cache reading" : "SDF cache building") )
+
+  // Compare the cached and the exact distances in the band.
+  TIMER_RESET
+  TIMER_GO
+
+  double maxSdfErr = 0.;
+  int    numCached = 0;
+  //
+  for ( const gp_XYZ& P : gridPts )
+  {
+    if ( !sdf->IsCached( P.X(), P.Y(), P.Z() ) )
+      continue;
+
+    const double exact = classMesh.GetDist()->Eval( P.X(), P.Y(), P.Z() );
+    maxSdfErr = Max( maxSdfErr, Abs( sdf->Eval( P.X(), P.Y(), P.Z() ) - exact ) );
+    numCached++;
+  }
+
+  TIMER_FINISH
+
+  std::cout << "Num. SDF bricks:                             " << sdf->GetNumBricks()                                      << std::endl;
+  std::cout << "SDF cache memory (bytes):                    " << sdf->GetMemoryFootprint()                                << std::endl;
+  std::cout << "Num. grid points in the cached band:         " << numCached                                                << std::endl;
+  std::cout << "Max. deviation of cached distance:           " << maxSdfErr                                                << std::endl;
+
+  /* =============================
+   *  Monte-Carlo mass properties.
+   * ============================= */
+
+  TIMER_RESET
+  TIMER_GO
+
+  GProp_GProps exactProps;
+  BRepGProp::VolumeProperties(shape, exactProps);
+
+  TIMER_FINISH
+  TIMER_COUT_RESULT_MSG("Exact volume properties")
+
+  TIMER_RESET
+  TIMER_GO
+
+  MonteCarloProps mcProps(classMesh);
+  mcProps.Perform();
+
+  TIMER_FINISH
+  TIMER_COUT_RESULT_MSG("Monte-Carlo volume properties")
+
+  const gp_XYZ mcDc   = mcProps.GetCentroid() - exactProps.CentreOfMass().XYZ();
+  double       mcDinr = 0.;
+  //
+  for ( int r = 1; r <= 3; ++r )
+    for ( int c = 1; c <= 3; ++c )
+      mcDinr = Max( mcDinr, Abs( mcProps.GetInertia().Value(r, c) - exactProps.MatrixOfInertia().Value(r, c) ) );
+
+  std::cout << "Exact volume:                                " << exactProps.Mass()                                       << std::endl;
+  std::cout << "Monte-Carlo volume:                          " << mcProps.GetVolume()                                     << std::endl;
+  std::cout << "Monte-Carlo relative error (1 sigma):        " << mcProps.GetRelError()                                   << std::endl;
+  std::cout << "Monte-Carlo num. samples:                    " << mcProps.GetNumSamples()                                 << std::endl;
+  std::cout << "Monte-Carlo num. rounds:                     " << mcProps.GetHistory().size()                             << std::endl;
+  std::cout << "Deviation of Monte-Carlo centroid:           " << mcDc.Modulus()                                          << std::endl;
+  std::cout << "Max. deviation of Monte-Carlo inertia:       " << mcDinr                                                  << std::endl;
+
+  /* ==========================
+   *  Point location in solids.
+   * ========================== */
+
+  // Each solid of the model gets its own classifier under a top-level BVH,
+  // so the result tells which solid contains a point.
+  TIMER_RESET
+  TIMER_GO
+
+  ClassifySolids classSolids(shape);
+
+  TIMER_FINISH
+  TIMER_COUT_RESULT_MSG("Per-solid BVH construction")
+
+  TIMER_RESET
+  TIMER_GO
+
+  std::vector<int> ptSolids;
+  classSolids.LocateBatch(gridPts, tolMesh, ptSolids);
+
+  TIMER_FINISH
+  TIMER_COUT_RESULT_MSG("BVH-based point location in solids")
+
+  std::cout << "Num. solids:                                 " << classSolids.GetNumSolids()                              << std::endl;
+  std::cout << "Num. points located in solids:               " << ptSolids.size() - std::count( ptSolids.begin(), ptSolids.end(), -1 ) << std::endl;
+  std::cout << "Points/sec with point location:              " << gridPts.size() / __aux_debug_Timer.ElapsedTime()        << std::endl;
 
   /*TColStd_PackedMapOfInteger diff;
   diff.Difference(iPtsBrep, iPtsMesh);
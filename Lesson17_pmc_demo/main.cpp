@@ -5,6 +5,7 @@
 
 // Local includes
 #include "ClassifyPt.h"
+#include "MeshMerge.h"
 #include "Viewer.h"
 
 #define TIMER_NEW \
@@ -116,46 +117,30 @@ int main(int argc, char** argv)
   TIMER_FINISH
   TIMER_COUT_RESULT_MSG("PMC by OpenCascade")
 
-  Handle(Poly_CoherentTriangulation)
-    cohTris = new Poly_CoherentTriangulation;
-
   BRepMesh_IncrementalMesh meshGen(shape, 0.1);
 
-  for ( TopExp_Explorer exp(shape, TopAbs_FACE); exp.More(); exp.Next() )
-  {
-    const TopoDS_Face& face = TopoDS::Face( exp.Current() );
-
-    TopLoc_Location loc;
-    Handle(Poly_Triangulation) faceTris = BRep_Tool::Triangulation(face, loc);
-
-    // Local node ID -> Global node ID
-    std::unordered_map<int, int> nodesMap;
-    for ( int iNode = 1; iNode <= faceTris->NbNodes(); ++iNode )
-    {
-      gp_Pnt P = faceTris->Node(iNode).Transformed(loc);
-      const int cohNodeIndex = cohTris->SetNode( P.XYZ() );
-
-      nodesMap.insert({iNode, cohNodeIndex});
-    }
+  TIMER_RESET
+  TIMER_GO
 
-    for ( int iTri = 1; iTri <= faceTris->NbTriangles(); ++iTri )
-    {
-      const Poly_Triangle& tri = faceTris->Triangle(iTri);
+  // Weld the face triangulations into a watertight mesh.
+  MeshMerge merger(shape);
+  merger.Perform();
 
-      int iNodes[3];
-      tri.Get(iNodes[0], iNodes[1], iNodes[2]);
+  Handle(Poly_Triangulation) tris = merger.GetTriangulation();
 
-      if ( face.Orientation() == TopAbs_REVERSED )
-        std::swap(iNodes[1], iNodes[2]); // 1, 2, 3 -> 1, 3, 2
+  TIMER_FINISH
+  TIMER_COUT_RESULT_MSG("Mesh merging")
 
-      int iCohNodes[3] = { nodesMap[iNodes[0]], nodesMap[iNodes[1]], nodesMap[iNodes[2]] };
+  std::cout << "Nodes before/after welding: " << merger.GetStats().NumNodesIn  << " / "
+                                              << merger.GetStats().NumNodesOut << std::endl;
+  std::cout << "Free links: " << merger.GetStats().NumFreeLinks << std::endl;
 
-      cohTris->AddTriangle(iCohNodes[0], iCohNodes[1], iCohNodes[2]);
-    }
+  if ( tris.IsNull() )
+  {
+    std::cout << "The shape has no triangulation" << std::endl;
+    return 1;
   }
 
-  Handle(Poly_Triangulation) tris = cohTris->GetTriangulation();
-
   //vout << tris;
 
   TIMER_RESET
@@ -0,0 +1,477 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2020-present, Quaoar Studio
+// All rights reserved.
+//-----------------------------------------------------------------------------
+
+#ifndef MeshMerge_h
+#define MeshMerge_h
+
+// OpenCascade includes
+#include <BRep_Tool.hxx>
+#include <OSD_Parallel.hxx>
+#include <Poly_CoherentTriangulation.hxx>
+#include <Poly_PolygonOnTriangulation.hxx>
+#include <Poly_Triangulation.hxx>
+#include <Precision.hxx>
+#include <TopExp.hxx>
+#include <TopExp_Explorer.hxx>
+#include <TopoDS.hxx>
+#include <TopTools_IndexedMapOfShape.hxx>
+
+// Standard includes
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+//-----------------------------------------------------------------------------
+
+//! Merges the triangulations of all faces of a shape into a single mesh.
+//! The nodes on the face boundaries are repeated in the triangulations of
+//! all adjacent faces, so they are welded here to make the result
+//! watertight. The nodes of an edge polygon are welded within the tolerance
+//! of that edge, and its end nodes within the tolerances of the vertices,
+//! as the adjacent faces of real B-reps may be meshed that far apart. Only
+//! the nodes of the edge polygons go through the spatial hash, while the
+//! inner nodes of faces are copied as they are.
+//!
+//! The face triangulations are extracted in parallel. The welding itself
+//! is sequential, so the node numbering does not depend on the scheduling.
+class MeshMerge
+{
+public:
+
+  //! Merge statistics.
+  struct t_stats
+  {
+    int NumFaces;        //!< Number of faces with triangulation.
+    int NumNodesIn;      //!< Number of nodes in all face triangulations.
+    int NumNodesOut;     //!< Number of nodes after welding.
+    int NumTrianglesIn;  //!< Number of triangles in all face triangulations.
+    int NumTrianglesOut; //!< Number of triangles without the degenerated ones.
+    int NumFreeLinks;    //!< Number of links owned by a single triangle.
+
+    //! Default ctor.
+    t_stats() : NumFaces(0), NumNodesIn(0), NumNodesOut(0),
+                NumTrianglesIn(0), NumTrianglesOut(0), NumFreeLinks(0) {}
+  };
+
+public:
+
+  //! Ctor.
+  //! \param[in] shape      the meshed shape.
+  //! \param[in] tol        the min welding tolerance. The nodes on edges are
+  //!                       welded within the edge and vertex tolerances if
+  //!                       these are larger.
+  //! \param[in] isOriented whether to flip the triangles of reversed faces.
+  MeshMerge(const TopoDS_Shape& shape,
+            const double        tol        = Precision::Confusion(),
+            const bool          isOriented = true)
+  //
+  : m_shape      (shape),
+    m_fTol       (tol),
+    m_bIsOriented(isOriented)
+  {}
+
+public:
+
+  //! Merges the face triangulations.
+  //! \return false if there is no triangulation to merge.
+  bool Perform()
+  {
+    m_result.Nullify();
+    m_stats = t_stats();
+
+    TopTools_IndexedMapOfShape faces;
+    TopExp::MapShapes(m_shape, TopAbs_FACE, faces);
+
+    // Extract the face triangulations in parallel.
+    std::vector<t_faceMesh> faceMeshes( faces.Extent() );
+    //
+    OSD_Parallel::For( 0, faces.Extent(), [&](const int f)
+    {
+      this->extractFace( TopoDS::Face( faces(f + 1) ), faceMeshes[f] );
+    } );
+
+    // Weld the boundary nodes. The base cells are as large as the median
+    // tolerance, so that a few sloppy tolerances do not crowd all nodes
+    // into a few cells. The nodes of larger tolerances go to the coarser
+    // levels of the hash.
+    std::vector<double> boundaryTols;
+    //
+    for ( const t_faceMesh& fm : faceMeshes )
+      for ( size_t i = 0; i < fm.Nodes.size(); ++i )
+        if ( fm.IsBoundary[i] )
+          boundaryTols.push_back( fm.Tolerances[i] );
+
+    double cellSize = Max(m_fTol, Precision::Confusion());
+    //
+    if ( !boundaryTols.empty() )
+    {
+      auto median = boundaryTols.begin() + boundaryTols.size()/2;
+      std::nth_element( boundaryTols.begin(), median, boundaryTols.end() );
+      cellSize = Max(cellSize, *median);
+    }
+
+    t_weldGrid                      grid(cellSize);
+    std::vector<gp_XYZ>             nodes;
+    std::vector<double>             nodeTols;
+    std::vector< std::vector<int> > globalIds( faceMeshes.size() );
+    //
+    for ( size_t f = 0; f < faceMeshes.size(); ++f )
+    {
+      const t_faceMesh& fm = faceMeshes[f];
+      //
+      if ( fm.Triangles.empty() )
+        continue;
+
+      m_stats.NumFaces++;
+      m_stats.NumNodesIn     += int( fm.Nodes.size() );
+      m_stats.NumTrianglesIn += int( fm.Triangles.size() );
+
+      globalIds[f].resize( fm.Nodes.size() );
+      //
+      for ( size_t i = 0; i < fm.Nodes.size(); ++i )
+      {
+        const gp_XYZ& P = fm.Nodes[i];
+
+        if ( !fm.IsBoundary[i] )
+        {
+          globalIds[f][i] = int( nodes.size() );
+          nodes.push_back(P);
+          nodeTols.push_back(0.);
+          continue;
+        }
+
+        const double tol    = fm.Tolerances[i];
+        int          weldId = grid.Find(P, tol, nodes, nodeTols);
+        //
+        if ( weldId < 0 )
+        {
+          weldId = int( nodes.size() );
+          nodes.push_back(P);
+          nodeTols.push_back(tol);
+          grid.Add(P, tol, weldId);
+        }
+
+        globalIds[f][i] = weldId;
+      }
+    }
+
+    if ( nodes.empty() )
+      return false;
+
+    // Remap the triangles and skip the ones collapsed by welding.
+    std::vector<Poly_Triangle> triangles;
+    triangles.reserve(m_stats.NumTrianglesIn);
+    //
+    for ( size_t f = 0; f < faceMeshes.size(); ++f )
+    {
+      for ( const Poly_Triangle& tri : faceMeshes[f].Triangles )
+      {
+        int n0, n1, n2;
+        tri.Get(n0, n1, n2);
+
+        n0 = globalIds[f][n0];
+        n1 = globalIds[f][n1];
+        n2 = globalIds[f][n2];
+        //
+        if ( n0 == n1 || n1 == n2 || n2 == n0 )
+          continue;
+
+        triangles.push_back( Poly_Triangle(n0 + 1, n1 + 1, n2 + 1) );
+      }
+    }
+
+    m_stats.NumNodesOut     = int( nodes.size() );
+    m_stats.NumTrianglesOut = int( triangles.size() );
+    m_stats.NumFreeLinks    = countFreeLinks(triangles);
+
+    // Compose the result.
+    m_result = new Poly_Triangulation(m_stats.NumNodesOut, m_stats.NumTrianglesOut, false);
+    //
+    for ( int i = 0; i < m_stats.NumNodesOut; ++i )
+      m_result->SetNode( i + 1, gp_Pnt(nodes[i]) );
+    //
+    for ( int i = 0; i < m_stats.NumTrianglesOut; ++i )
+      m_result->SetTriangle(i + 1, triangles[i]);
+
+    return true;
+  }
+
+  //! \return merged triangulation.
+  const Handle(Poly_Triangulation)& GetTriangulation() const { return m_result; }
+
+  //! \return merged triangulation with back references.
+  Handle(Poly_CoherentTriangulation) GetCoherentTriangulation() const
+  {
+    if ( m_result.IsNull() )
+      return nullptr;
+
+    return new Poly_CoherentTriangulation(m_result);
+  }
+
+  //! \return statistics of the last merge.
+  const t_stats& GetStats() const { return m_stats; }
+
+protected:
+
+  //! Triangulation of a single face in the global coordinates.
+  struct t_faceMesh
+  {
+    std::vector<gp_XYZ>        Nodes;      //!< Transformed nodes.
+    std::vector<uint8_t>       IsBoundary; //!< Flags of the nodes on edges.
+    std::vector<double>        Tolerances; //!< Welding tolerances of the nodes on edges.
+    std::vector<Poly_Triangle> Triangles;  //!< Triangles with 0-based nodes.
+  };
+
+  //! Cell of the spatial hash.
+  struct t_cellKey
+  {
+    int64_t I, J, K;
+
+    t_cellKey(const int64_t i, const int64_t j, const int64_t k) : I(i), J(j), K(k) {}
+
+    bool operator==(const t_cellKey& other) const
+    {
+      return I == other.I && J == other.J && K == other.K;
+    }
+
+    struct Hasher
+    {
+      size_t operator()(const t_cellKey& key) const
+      {
+        return size_t( key.I*73856093 ^ key.J*19349663 ^ key.K*83492791 );
+      }
+    };
+  };
+
+  //! Multi-level spatial hash of the welded nodes. The cells of each next
+  //! level are twice as large, and a node goes to the first level whose
+  //! cells are not smaller than its tolerance. A node within the welding
+  //! distance of a stored one is therefore in a few neighbour cells of its
+  //! level, unless the tolerance of the query node is larger than these
+  //! cells. For such rare nodes, the occupied cells of the finer levels are
+  //! scanned if there are fewer of them than the cells to look into.
+  struct t_weldGrid
+  {
+    typedef std::unordered_map<t_cellKey, std::vector<int>, t_cellKey::Hasher> t_cells;
+
+    double               BaseSize; //!< Cell size of the finest level.
+    std::vector<t_cells> Levels;   //!< Cells of all levels.
+
+    t_weldGrid(const double baseSize) : BaseSize(baseSize) {}
+
+    //! \return cell size of the given level.
+    double CellSize(const int level) const { return std::ldexp(BaseSize, level); }
+
+    //! \return cell of the point at the given level.
+    t_cellKey Key(const gp_XYZ& P, const int level) const
+    {
+      const double size = this->CellSize(level);
+
+      return t_cellKey( int64_t( std::floor( P.X() / size ) ),
+                        int64_t( std::floor( P.Y() / size ) ),
+                        int64_t( std::floor( P.Z() / size ) ) );
+    }
+
+    //! Adds the node with the given tolerance.
+    void Add(const gp_XYZ& P, const double tol, const int id)
+    {
+      int level = 0;
+      //
+      while ( this->CellSize(level) < tol )
+        level++;
+
+      if ( int( Levels.size() ) <= level )
+        Levels.resize(level + 1);
+
+      Levels[level][this->Key(P, level)].push_back(id);
+    }
+
+    //! Finds the stored node to weld the point with.
+    //! \return index of the node or -1 if there is none.
+    int Find(const gp_XYZ&              P,
+             const double               tol,
+             const std::vector<gp_XYZ>& nodes,
+             const std::vector<double>& nodeTols) const
+    {
+      auto findIn = [&](const std::vector<int>& ids) -> int
+      {
+        for ( const int id : ids )
+        {
+          const double weldTol = Max(tol, nodeTols[id]);
+          //
+          if ( (nodes[id] - P).SquareModulus() <= weldTol*weldTol )
+            return id;
+        }
+        return -1;
+      };
+
+      for ( int level = 0; level < int( Levels.size() ); ++level )
+      {
+        const t_cells& cells = Levels[level];
+        //
+        if ( cells.empty() )
+          continue;
+
+        // The stored nodes are within their cell size of the point, so
+        // only the tolerance of the point may widen the search.
+        const int64_t r       = std::max( int64_t(1), int64_t( std::ceil( tol / this->CellSize(level) ) ) );
+        const double  numNear = std::pow(2.*r + 1., 3);
+        //
+        if ( numNear > double( cells.size() ) )
+        {
+          for ( const auto& cell : cells )
+          {
+            const int id = findIn(cell.second);
+            if ( id >= 0 )
+              return id;
+          }
+          continue;
+        }
+
+        const t_cellKey key = this->Key(P, level);
+        //
+        for ( int64_t di = -r; di <= r; ++di )
+          for ( int64_t dj = -r; dj <= r; ++dj )
+            for ( int64_t dk = -r; dk <= r; ++dk )
+            {
+              auto it = cells.find( t_cellKey(key.I + di, key.J + dj, key.K + dk) );
+              //
+              if ( it == cells.end() )
+                continue;
+
+              const int id = findIn(it->second);
+              if ( id >= 0 )
+                return id;
+            }
+      }
+      return -1;
+    }
+  };
+
+  //! Extracts the triangulation of the face.
+  void extractFace(const TopoDS_Face& face, t_faceMesh& fm) const
+  {
+    TopLoc_Location L;
+    const Handle(Poly_Triangulation)&
+      poly = BRep_Tool::Triangulation(face, L);
+    //
+    if ( poly.IsNull() )
+      return;
+
+    fm.Nodes.resize( poly->NbNodes() );
+    //
+    for ( int iNode = 1; iNode <= poly->NbNodes(); ++iNode )
+    {
+      // Make sure to apply location, e.g., see the effect in /cad/ANC101.brep
+      fm.Nodes[iNode - 1] = poly->Node(iNode).Transformed(L).XYZ();
+    }
+
+    // Mark the nodes of the edge polygons. If some edge has no polygon,
+    // all nodes are welded within the max tolerance of the face boundary
+    // to be on the safe side.
+    fm.IsBoundary.assign(fm.Nodes.size(), 0);
+    fm.Tolerances.assign(fm.Nodes.size(), m_fTol);
+    //
+    double faceTol     = m_fTol;
+    bool   hasPolygons = true;
+    //
+    for ( TopExp_Explorer eexp(face, TopAbs_EDGE); eexp.More(); eexp.Next() )
+    {
+      const TopoDS_Edge& edge = TopoDS::Edge( eexp.Current() );
+
+      TopoDS_Vertex V1, V2;
+      TopExp::Vertices(edge, V1, V2);
+
+      const double edgeTol   = Max( m_fTol, BRep_Tool::Tolerance(edge) );
+      const double vertexTol = Max( edgeTol, Max( V1.IsNull() ? 0. : BRep_Tool::Tolerance(V1),
+                                                  V2.IsNull() ? 0. : BRep_Tool::Tolerance(V2) ) );
+      //
+      faceTol = Max(faceTol, vertexTol);
+
+      const Handle(Poly_PolygonOnTriangulation)&
+        polygon = BRep_Tool::PolygonOnTriangulation(edge, poly, L);
+      //
+      if ( polygon.IsNull() )
+      {
+        hasPolygons = false;
+        continue;
+      }
+
+      const int numPolyNodes = polygon->NbNodes();
+      //
+      for ( int k = 1; k <= numPolyNodes; ++k )
+      {
+        const int    n   = polygon->Node(k) - 1;
+        const double tol = (k == 1 || k == numPolyNodes) ? vertexTol : edgeTol;
+
+        fm.IsBoundary[n] = 1;
+        fm.Tolerances[n] = Max(fm.Tolerances[n], tol);
+      }
+    }
+    //
+    if ( !hasPolygons )
+    {
+      fm.IsBoundary.assign(fm.Nodes.size(), 1);
+      fm.Tolerances.assign(fm.Nodes.size(), faceTol);
+    }
+
+    // Add triangles.
+    const bool isReversed = m_bIsOriented && (face.Orientation() == TopAbs_REVERSED);
+    //
+    fm.Triangles.reserve( poly->NbTriangles() );
+    //
+    for ( int iTri = 1; iTri <= poly->NbTriangles(); ++iTri )
+    {
+      int iNodes[3];
+      poly->Triangle(iTri).Get(iNodes[0], iNodes[1], iNodes[2]);
+
+      if ( isReversed )
+        std::swap(iNodes[1], iNodes[2]);
+
+      fm.Triangles.push_back( Poly_Triangle(iNodes[0] - 1, iNodes[1] - 1, iNodes[2] - 1) );
+    }
+  }
+
+  //! Counts the links which are not shared by two triangles.
+  static int countFreeLinks(const std::vector<Poly_Triangle>& triangles)
+  {
+    std::unordered_map<int64_t, int> links;
+    links.reserve(triangles.size()*2);
+    //
+    for ( const Poly_Triangle& tri : triangles )
+    {
+      int n[3];
+      tri.Get(n[0], n[1], n[2]);
+
+      for ( int k = 0; k < 3; ++k )
+      {
+        const int64_t a = Min( n[k], n[(k + 1) % 3] );
+        const int64_t b = Max( n[k], n[(k + 1) % 3] );
+
+        links[(a << 32) | b]++;
+      }
+    }
+
+    int numFree = 0;
+    for ( const auto& link : links )
+      if ( link.second == 1 )
+        numFree++;
+
+    return numFree;
+  }
+
+protected:
+
+  TopoDS_Shape               m_shape;       //!< Meshed shape.
+  double                     m_fTol;        //!< Welding tolerance.
+  bool                       m_bIsOriented; //!< Whether to respect face orientation.
+  Handle(Poly_Triangulation) m_result;      //!< Merged triangulation.
+  t_stats                    m_stats;       //!< Merge statistics.
+
+};
+
+#endif
@@ -4,6 +4,7 @@
 //-----------------------------------------------------------------------------
 
 // Local includes
+#include "MeshMerge.h"
 #include "Viewer.h"
 
 // OpenCascade includes
@@ -95,46 +96,26 @@ int main(int argc, char** argv)
    *  Prepare visualization meshes.
    * ============================== */
 
-  // Prepare data structure for all triangles with back refs.
-  Handle(Poly_CoherentTriangulation)
-    tris = new Poly_CoherentTriangulation;
-
   BRepMesh_IncrementalMesh meshGen(shape, 1.0);
 
-  // Add all triangulations from faces to the common collection.
-  for ( TopExp_Explorer fexp(shape, TopAbs_FACE); fexp.More(); fexp.Next() )
-  {
-    const TopoDS_Face& face = TopoDS::Face( fexp.Current() );
+  // Merge all triangulations from faces. The nodes on the shared edges are
+  // welded, so that the links of adjacent faces are connected. The triangles
+  // of reversed faces are not flipped, as slicing ignores the orientation.
+  MeshMerge merger(shape, Precision::Confusion(), false);
+  merger.Perform();
 
-    // Poly_MeshPurpose was introduced in OpenCascade 7.6 and remained
-    // undocumented.
-    TopLoc_Location L;
-    const Handle(Poly_Triangulation)&
-      poly = BRep_Tool::Triangulation(face, L);
-
-    // Add nodes.
-    std::unordered_map<int, int> nodesMap;
-    for ( int iNode = 1; iNode <= poly->NbNodes(); ++iNode )
-    {
-      // Make sure to apply location, e.g., see the effect in /cad/ANC101.brep
-      const int n = tris->SetNode( poly->Node(iNode).Transformed(L).XYZ() );
-
-      // Local to global node index mapping.
-      nodesMap.insert({iNode, n});
-    }
-
-    // Add triangles.
-    for ( int iTri = 1; iTri <= poly->NbTriangles(); ++iTri )
-    {
-      const Poly_Triangle& tri = poly->Triangle(iTri);
-
-      int iNodes[3];
-      tri.Get(iNodes[0], iNodes[1], iNodes[2]);
-
-      tris->AddTriangle(nodesMap[iNodes[0]], nodesMap[iNodes[1]], nodesMap[iNodes[2]]);
-    }
+  // Prepare data structure for all triangles with back refs.
+  Handle(Poly_CoherentTriangulation) tris = merger.GetCoherentTriangulation();
+  //
+  if ( tris.IsNull() )
+  {
+    std::cout << "The shape has no triangulation." << std::endl;
+    return 1;
   }
 
+  std::cout << "Num. nodes before/after welding: " << merger.GetStats().NumNodesIn  << " / "
+                                                   << merger.GetStats().NumNodesOut << std::endl;
+
   // Display the triangulation to be sure it's consistent.
   //vout << tris->GetTriangulation();
 
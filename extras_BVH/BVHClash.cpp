@@ -0,0 +1,582 @@
+//-----------------------------------------------------------------------------
+// Created on: 16 October 2026
+//-----------------------------------------------------------------------------
+// Copyright (c) 2016-present, Quaoar, https://analysissitus.org
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of the copyright holder(s) nor the
+//      names of all contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//-----------------------------------------------------------------------------
+
+// Own include
+#include "BVHClash.h"
+
+// BVH includes
+#include "BVHProfiler.h"
+#include "BVHQuery.h"
+
+// OCCT includes
+#include <OSD_Parallel.hxx>
+
+// Standard includes
+#include <algorithm>
+#include <cmath>
+
+//-----------------------------------------------------------------------------
+
+namespace
+{
+  //! \return squared distance between the boxes, zero for the overlapping ones.
+  double boxDistance2(const BVH_Vec3d& minPt1,
+                      const BVH_Vec3d& maxPt1,
+                      const BVH_Vec3d& minPt2,
+                      const BVH_Vec3d& maxPt2)
+  {
+    // The gap along each axis, negative values for overlaps.
+    const BVH_Vec3d gap = ( minPt1 - maxPt2 ).cwiseMax( minPt2 - maxPt1 ).cwiseMax( BVH_Vec3d(0., 0., 0.) );
+    return gap.SquareModulus();
+  }
+
+  //! Finds the closest points of two segments.
+  //! \param[in]  P1, Q1 the ends of the first segment.
+  //! \param[in]  P2, Q2 the ends of the second segment.
+  //! \param[out] C1     the closest point of the first segment.
+  //! \param[out] C2     the closest point of the second segment.
+  //! \return squared distance between the segments.
+  double segmentDistance2(const BVH_Vec3d& P1,
+                          const BVH_Vec3d& Q1,
+                          const BVH_Vec3d& P2,
+                          const BVH_Vec3d& Q2,
+                          BVH_Vec3d&       C1,
+                          BVH_Vec3d&       C2)
+  {
+    const BVH_Vec3d D1 = Q1 - P1;
+    const BVH_Vec3d D2 = Q2 - P2;
+    const BVH_Vec3d R  = P1 - P2;
+    const double    a  = D1.Dot(D1);
+    const double    e  = D2.Dot(D2);
+    const double    f  = D2.Dot(R);
+
+    double s = 0., t = 0.;
+    //
+    if ( a == 0. && e == 0. ) // Both segments are points.
+    {
+      s = t = 0.;
+    }
+    else if ( a == 0. ) // The first segment is a point.
+    {
+      t = Min( Max(f/e, 0.), 1. );
+    }
+    else
+    {
+      const double c = D1.Dot(R);
+      //
+      if ( e == 0. ) // The second segment is a point.
+      {
+        s = Min( Max(-c/a, 0.), 1. );
+      }
+      else
+      {
+        const double b     = D1.Dot(D2);
+        const double denom = a*e - b*b;
+
+        // The parallel segments take any point of the first one.
+        s = (denom != 0.) ? Min( Max( (b*f - c*e)/denom, 0. ), 1. ) : 0.;
+        t = (b*s + f)/e;
+
+        if ( t < 0. )
+        {
+          t = 0.;
+          s = Min( Max(-c/a, 0.), 1. );
+        }
+        else if ( t > 1. )
+        {
+          t = 1.;
+          s = Min( Max( (b - c)/a, 0. ), 1. );
+        }
+      }
+    }
+
+    C1 = P1 + D1*s;
+    C2 = P2 + D2*t;
+    return (C1 - C2).SquareModulus();
+  }
+
+  //! Finds the closest points of two triangles. Disjoint triangles have
+  //! the closest points at a node and a face or at two edges. Otherwise,
+  //! an edge of one triangle crosses the other one, or the triangles are
+  //! coplanar and touch at their edges or nodes.
+  //! \param[in]  A  the nodes of the first triangle.
+  //! \param[in]  B  the nodes of the second triangle.
+  //! \param[out] PA the closest point of the first triangle.
+  //! \param[out] PB the closest point of the second triangle.
+  //! \return squared distance between the triangles.
+  double triangleDistance2(const BVH_Vec3d* A,
+                           const BVH_Vec3d* B,
+                           BVH_Vec3d&       PA,
+                           BVH_Vec3d&       PB)
+  {
+    double t, v, w;
+
+    // Edges crossing the other triangle.
+    for ( int k = 0; k < 3; ++k )
+    {
+      const BVH_Vec3d DA = A[(k + 1) % 3] - A[k];
+      //
+      if ( BVHQuery::RayTriangle(A[k], DA, B[0], B[1], B[2], t, v, w) && t <= 1. )
+      {
+        PA = PB = A[k] + DA*t;
+        return 0.;
+      }
+
+      const BVH_Vec3d DB = B[(k + 1) % 3] - B[k];
+      //
+      if ( BVHQuery::RayTriangle(B[k], DB, A[0], A[1], A[2], t, v, w) && t <= 1. )
+      {
+        PA = PB = B[k] + DB*t;
+        return 0.;
+      }
+    }
+
+    double best = RealLast();
+    //
+    auto update = [&](const BVH_Vec3d& CA, const BVH_Vec3d& CB)
+    {
+      const double dist2 = (CA - CB).SquareModulus();
+      //
+      if ( dist2 < best )
+      {
+        best = dist2;
+        PA   = CA;
+        PB   = CB;
+      }
+    };
+
+    // Nodes against faces.
+    double u;
+    //
+    for ( int k = 0; k < 3; ++k )
+    {
+      update( A[k], BVHQuery::ClosestPointOnTriangle(A[k], B[0], B[1], B[2], u, v, w) );
+      update( BVHQuery::ClosestPointOnTriangle(B[k], A[0], A[1], A[2], u, v, w), B[k] );
+    }
+
+    // Edges against edges.
+    for ( int i = 0; i < 3; ++i )
+    {
+      for ( int j = 0; j < 3; ++j )
+      {
+        BVH_Vec3d CA, CB;
+        segmentDistance2(A[i], A[(i + 1) % 3], B[j], B[(j + 1) % 3], CA, CB);
+        update(CA, CB);
+      }
+    }
+
+    return best;
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+BVHClash::BVHClash(const Handle(BVHFacets)& facets1,
+                   const Handle(BVHFacets)& facets2,
+                   const gp_Trsf&           trsf)
+: m_facets1     (facets1),
+  m_facets2     (facets2),
+  m_trsf        (trsf),
+  m_iRevision2  (-1)
+{}
+
+//-----------------------------------------------------------------------------
+
+void BVHClash::SetTransformation(const gp_Trsf& trsf)
+{
+  m_trsf       = trsf;
+  m_iRevision2 = -1;
+}
+
+//-----------------------------------------------------------------------------
+
+int BVHClash::FindContacts(std::vector<t_pair>& pairs,
+                           const double         tol,
+                           const bool           isParallel)
+{
+  pairs.clear();
+
+  if ( !this->prepare() || tol < 0. )
+    return 0;
+
+  t_search search(Mode_Contacts, tol*tol);
+  //
+  for ( const t_task& task : this->perform(search, isParallel) )
+    pairs.insert( pairs.end(), task.Pairs.begin(), task.Pairs.end() );
+
+  // The order of the subtree pairs depends on the tree shapes only, but
+  // the facet order is more convenient for the caller.
+  std::sort( pairs.begin(), pairs.end(), [](const t_pair& p1, const t_pair& p2)
+  {
+    return (p1.Facet1 != p2.Facet1) ? (p1.Facet1 < p2.Facet1) : (p1.Facet2 < p2.Facet2);
+  } );
+
+  return int( pairs.size() );
+}
+
+//-----------------------------------------------------------------------------
+
+bool BVHClash::IsCloserThan(const double threshold,
+                            t_pair*      pPair,
+                            const bool   isParallel)
+{
+  if ( !this->prepare() || threshold < 0. )
+    return false;
+
+  t_search search(Mode_Any, threshold*threshold);
+  //
+  for ( const t_task& task : this->perform(search, isParallel) )
+  {
+    if ( task.Pairs.empty() )
+      continue;
+
+    if ( pPair )
+      *pPair = task.Pairs.front();
+
+    return true;
+  }
+
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+
+bool BVHClash::MinDistance(t_pair&    closest,
+                           const bool isParallel)
+{
+  closest = t_pair();
+
+  if ( !this->prepare() )
+    return false;
+
+  // The distance from any node of the second set to the first set bounds
+  // the min distance from above, so the search starts pruning right away.
+  BVHQuery        query(m_facets1);
+  BVHQuery::t_hit hit;
+  //
+  query.ClosestPoint( gp_XYZ( m_nodes2[0].x(), m_nodes2[0].y(), m_nodes2[0].z() ), hit );
+
+  const BVHFacets::t_facet& facet1 = m_facets1->GetFacet(hit.FacetIndex);
+  const BVH_Vec3d           A[3]   = { facet1.P0, facet1.P1, facet1.P2 };
+
+  BVH_Vec3d    PA, PB;
+  const double seedDist2 = triangleDistance2(A, &m_nodes2[0], PA, PB);
+
+  closest.Facet1   = hit.FacetIndex;
+  closest.Facet2   = 0;
+  closest.Distance = std::sqrt(seedDist2);
+  closest.P1       = gp_XYZ( PA.x(), PA.y(), PA.z() );
+  closest.P2       = gp_XYZ( PB.x(), PB.y(), PB.z() );
+
+  t_search search(Mode_MinDist, seedDist2);
+  //
+  for ( const t_task& task : this->perform(search, isParallel) )
+  {
+    if ( task.Best.Facet1 >= 0 && task.Best.Distance < closest.Distance )
+      closest = task.Best;
+  }
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+bool BVHClash::prepare()
+{
+  if ( m_facets1.IsNull() || m_facets2.IsNull() )
+    return false;
+
+  m_facets1->BVH();
+  m_facets2->BVH();
+
+  if ( m_facets1->Size() == 0 || m_facets2->Size() == 0 )
+    return false;
+
+  // The tree of the second set may have been rebuilt or refitted since.
+  if ( m_iRevision2 == m_facets2->GetRevision() )
+    return true;
+
+  // Transform the nodes of the second set.
+  const int numFacets2 = m_facets2->Size();
+  //
+  m_nodes2.resize(3*numFacets2);
+  //
+  OSD_Parallel::For( 0, numFacets2, [&](const int f)
+  {
+    const BVHFacets::t_facet& facet = m_facets2->GetFacet(f);
+
+    const BVH_Vec3d* nodes[3] = { &facet.P0, &facet.P1, &facet.P2 };
+    //
+    for ( int k = 0; k < 3; ++k )
+    {
+      gp_XYZ P( nodes[k]->x(), nodes[k]->y(), nodes[k]->z() );
+      m_trsf.Transforms(P);
+
+      m_nodes2[3*f + k] = BVH_Vec3d( P.X(), P.Y(), P.Z() );
+    }
+  } );
+
+  // Refit the boxes of the second tree to the transformed nodes. The
+  // children follow their parents in the breadth-first order, so the
+  // reversed order visits them first.
+  const BVH_Tree<double, 3>* pBVH2    = m_facets2->BVH().get();
+  const int                  numNodes = int( pBVH2->NodeInfoBuffer().size() );
+
+  std::vector<int> order(1, 0);
+  order.reserve(numNodes);
+  //
+  for ( size_t k = 0; k < order.size(); ++k )
+  {
+    const BVH_Vec4i& data = pBVH2->NodeInfoBuffer()[order[k]];
+    //
+    if ( data.x() == 0 ) // Inner node.
+    {
+      order.push_back( data.y() );
+      order.push_back( data.z() );
+    }
+  }
+
+  m_minPts2.resize(numNodes);
+  m_maxPts2.resize(numNodes);
+  //
+  for ( auto it = order.crbegin(); it != order.crend(); ++it )
+  {
+    const int        node = *it;
+    const BVH_Vec4i& data = pBVH2->NodeInfoBuffer()[node];
+
+    if ( data.x() == 0 ) // Inner node.
+    {
+      m_minPts2[node] = m_minPts2[data.y()].cwiseMin( m_minPts2[data.z()] );
+      m_maxPts2[node] = m_maxPts2[data.y()].cwiseMax( m_maxPts2[data.z()] );
+    }
+    else // Leaf node.
+    {
+      m_minPts2[node] = m_maxPts2[node] = m_nodes2[3*data.y()];
+      //
+      for ( int k = 3*data.y(); k < 3*(data.z() + 1); ++k )
+      {
+        m_minPts2[node] = m_minPts2[node].cwiseMin(m_nodes2[k]);
+        m_maxPts2[node] = m_maxPts2[node].cwiseMax(m_nodes2[k]);
+      }
+    }
+  }
+
+  m_iRevision2 = m_facets2->GetRevision();
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+std::vector<BVHClash::t_task> BVHClash::perform(t_search&  search,
+                                                const bool isParallel)
+{
+  const BVH_Tree<double, 3>* pBVH1 = m_facets1->BVH().get();
+  const BVH_Tree<double, 3>* pBVH2 = m_facets2->BVH().get();
+
+  // Expand the top levels of the traversal into independent subtree pairs.
+  const int minNumTasks = 256;
+
+  std::vector< std::pair<int, int> > tasks(1, std::make_pair(0, 0)), next;
+  //
+  for ( bool isExpanded = true; isExpanded && int( tasks.size() ) < minNumTasks; )
+  {
+    isExpanded = false;
+    next.clear();
+
+    for ( const std::pair<int, int>& task : tasks )
+    {
+      if ( this->nodeDistance2(task.first, task.second) > search.Bound2 )
+        continue;
+
+      const BVH_Vec4i& data1 = pBVH1->NodeInfoBuffer()[task.first];
+      const BVH_Vec4i& data2 = pBVH2->NodeInfoBuffer()[task.second];
+
+      if ( data1.x() != 0 && data2.x() != 0 ) // Both leaves.
+      {
+        next.push_back(task);
+      }
+      else if ( this->isSplitFirst(task.first, task.second) )
+      {
+        next.push_back( std::make_pair( data1.y(), task.second ) );
+        next.push_back( std::make_pair( data1.z(), task.second ) );
+        isExpanded = true;
+      }
+      else
+      {
+        next.push_back( std::make_pair( task.first, data2.y() ) );
+        next.push_back( std::make_pair( task.first, data2.z() ) );
+        isExpanded = true;
+      }
+    }
+
+    tasks.swap(next);
+  }
+
+  std::vector<t_task> results( tasks.size() );
+  //
+  OSD_Parallel::For( 0, int( tasks.size() ), [&](const int i)
+  {
+    this->traverse(tasks[i].first, tasks[i].second, search, results[i]);
+  }, !isParallel );
+
+  return results;
+}
+
+//-----------------------------------------------------------------------------
+
+void BVHClash::traverse(const int node1,
+                        const int node2,
+                        t_search& search,
+                        t_task&   task) const
+{
+  const BVH_Tree<double, 3>* pBVH1 = m_facets1->BVH().get();
+  const BVH_Tree<double, 3>* pBVH2 = m_facets2->BVH().get();
+
+  std::vector< std::pair<int, int> > stack(1, std::make_pair(node1, node2));
+
+  while ( !stack.empty() && !search.IsStopped )
+  {
+    const std::pair<int, int> entry = stack.back();
+    stack.pop_back();
+
+    if ( this->nodeDistance2(entry.first, entry.second) > search.Bound2 )
+      continue;
+
+    const BVH_Vec4i& data1 = pBVH1->NodeInfoBuffer()[entry.first];
+    const BVH_Vec4i& data2 = pBVH2->NodeInfoBuffer()[entry.second];
+
+    if ( data1.x() == 0 || data2.x() == 0 ) // At least one inner node.
+    {
+      std::pair<int, int> child1, child2;
+      //
+      if ( this->isSplitFirst(entry.first, entry.second) )
+      {
+        child1 = std::make_pair( data1.y(), entry.second );
+        child2 = std::make_pair( data1.z(), entry.second );
+      }
+      else
+      {
+        child1 = std::make_pair( entry.first, data2.y() );
+        child2 = std::make_pair( entry.first, data2.z() );
+      }
+
+      // The farther pair goes first to be popped last.
+      if ( this->nodeDistance2(child1.first, child1.second) < this->nodeDistance2(child2.first, child2.second) )
+        std::swap(child1, child2);
+
+      stack.push_back(child1);
+      stack.push_back(child2);
+      continue;
+    }
+
+    // Both leaves.
+    for ( int f1 = data1.y(); f1 <= data1.z(); ++f1 )
+    {
+      const BVHFacets::t_facet& facet1 = m_facets1->GetFacet(f1);
+      const BVH_Vec3d           A[3]   = { facet1.P0, facet1.P1, facet1.P2 };
+      const BVH_Vec3d           minA   = A[0].cwiseMin(A[1]).cwiseMin(A[2]);
+      const BVH_Vec3d           maxA   = A[0].cwiseMax(A[1]).cwiseMax(A[2]);
+
+      for ( int f2 = data2.y(); f2 <= data2.z(); ++f2 )
+      {
+        const BVH_Vec3d* B    = &m_nodes2[3*f2];
+        const BVH_Vec3d  minB = B[0].cwiseMin(B[1]).cwiseMin(B[2]);
+        const BVH_Vec3d  maxB = B[0].cwiseMax(B[1]).cwiseMax(B[2]);
+
+        const double bound2 = search.Bound2;
+        //
+        if ( boxDistance2(minA, maxA, minB, maxB) > bound2 )
+          continue;
+
+        BVH_Vec3d    PA, PB;
+        const double dist2 = triangleDistance2(A, B, PA, PB);
+        //
+        if ( dist2 > bound2 )
+          continue;
+
+        t_pair pair;
+        pair.Facet1   = f1;
+        pair.Facet2   = f2;
+        pair.Distance = std::sqrt(dist2);
+        pair.P1       = gp_XYZ( PA.x(), PA.y(), PA.z() );
+        pair.P2       = gp_XYZ( PB.x(), PB.y(), PB.z() );
+
+        if ( search.SearchMode == Mode_MinDist )
+        {
+          if ( pair.Distance < task.Best.Distance )
+            task.Best = pair;
+
+          // Shrink the bound shared by all threads.
+          double current = search.Bound2;
+          while ( dist2 < current && !search.Bound2.compare_exchange_weak(current, dist2) ) {}
+        }
+        else
+        {
+          task.Pairs.push_back(pair);
+
+          if ( search.SearchMode == Mode_Any )
+          {
+            search.IsStopped = true;
+            return;
+          }
+        }
+      }
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+double BVHClash::nodeDistance2(const int node1,
+                               const int node2) const
+{
+  const BVH_Tree<double, 3>* pBVH1 = m_facets1->BVH().get();
+
+  return boxDistance2( pBVH1->MinPoint(node1), pBVH1->MaxPoint(node1),
+                       m_minPts2[node2],       m_maxPts2[node2] );
+}
+
+//-----------------------------------------------------------------------------
+
+bool BVHClash::isSplitFirst(const int node1,
+                            const int node2) const
+{
+  const BVH_Tree<double, 3>* pBVH1 = m_facets1->BVH().get();
+  const BVH_Tree<double, 3>* pBVH2 = m_facets2->BVH().get();
+
+  if ( pBVH1->NodeInfoBuffer()[node1].x() != 0 ) // Leaf node.
+    return false;
+
+  if ( pBVH2->NodeInfoBuffer()[node2].x() != 0 ) // Leaf node.
+    return true;
+
+  // Splitting the larger box shrinks the pair faster.
+  return BVHProfiler::BoxArea( pBVH1->MinPoint(node1), pBVH1->MaxPoint(node1) ) >= BVHProfiler::BoxArea( m_minPts2[node2], m_maxPts2[node2] );
+}
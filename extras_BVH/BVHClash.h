@@ -0,0 +1,227 @@
+//-----------------------------------------------------------------------------
+// Created on: 16 October 2026
+//-----------------------------------------------------------------------------
+// Copyright (c) 2016-present, Quaoar, https://analysissitus.org
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of the copyright holder(s) nor the
+//      names of all contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//-----------------------------------------------------------------------------
+
+#ifndef BVHClash_h
+#define BVHClash_h
+
+// BVH includes
+#include "BVHFacets.h"
+
+// OCCT includes
+#include <gp_Trsf.hxx>
+#include <gp_XYZ.hxx>
+
+// Standard includes
+#include <atomic>
+#include <vector>
+
+//-----------------------------------------------------------------------------
+
+//! Proximity and clash detection between two sets of facets by
+//! simultaneous traversal of their trees. A pair of nodes is pruned once
+//! the distance between their boxes exceeds the current bound, otherwise
+//! the node with the larger box is split. The pairs of leaves test their
+//! facets exactly.
+//!
+//! The second set can be placed relative to the first one. Its facets and
+//! node boxes are transformed once per placement, so the traversal runs in
+//! the coordinates of the first set with tight boxes.
+//!
+//! The top levels of the traversal are expanded into a list of subtree
+//! pairs, which are then processed in parallel. The early-exit modes stop
+//! all threads once a pair within the threshold is found, and the min
+//! distance search shares the best distance found so far between threads.
+class BVHClash
+{
+public:
+
+  //! Pair of facets found by a query.
+  struct t_pair
+  {
+    int    Facet1;   //!< 0-based index of the facet in the first set.
+    int    Facet2;   //!< 0-based index of the facet in the second set.
+    double Distance; //!< Distance between the facets.
+    gp_XYZ P1;       //!< Closest point of the first facet.
+    gp_XYZ P2;       //!< Closest point of the second facet in the first set's coordinates.
+
+    //! Default ctor.
+    t_pair() : Facet1(-1), Facet2(-1), Distance(RealLast()) {}
+  };
+
+public:
+
+  //! Ctor.
+  //! \param[in] facets1 the first set of facets.
+  //! \param[in] facets2 the second set of facets.
+  //! \param[in] trsf    the transformation from the second set's coordinates
+  //!                    to the first set's ones.
+  BVHClash(const Handle(BVHFacets)& facets1,
+           const Handle(BVHFacets)& facets2,
+           const gp_Trsf&           trsf = gp_Trsf());
+
+public:
+
+  //! Sets the placement of the second set.
+  //! \param[in] trsf the transformation from the second set's coordinates
+  //!                 to the first set's ones.
+  void
+    SetTransformation(const gp_Trsf& trsf);
+
+  //! \return transformation from the second set's coordinates to the first
+  //!         set's ones.
+  const gp_Trsf& GetTransformation() const
+  {
+    return m_trsf;
+  }
+
+public:
+
+  //! Finds all pairs of facets closer than the tolerance. With zero
+  //! tolerance, these are the intersecting pairs.
+  //! \param[out] pairs      the found pairs sorted by facet indices.
+  //! \param[in]  tol        the contact tolerance.
+  //! \param[in]  isParallel whether to process the subtree pairs in parallel.
+  //! \return number of found pairs.
+  int
+    FindContacts(std::vector<t_pair>& pairs,
+                 const double         tol        = 0.0,
+                 const bool           isParallel = true);
+
+  //! Checks if any pair of facets is within the threshold distance. The
+  //! search stops at the first such pair.
+  //! \param[in]  threshold  the distance threshold, zero for intersection.
+  //! \param[out] pPair      the optional found pair.
+  //! \param[in]  isParallel whether to process the subtree pairs in parallel.
+  //! \return true if such a pair exists.
+  bool
+    IsCloserThan(const double threshold,
+                 t_pair*      pPair      = nullptr,
+                 const bool   isParallel = true);
+
+  //! Checks if the sets intersect or touch within the tolerance.
+  //! \param[in] tol        the contact tolerance.
+  //! \param[in] isParallel whether to process the subtree pairs in parallel.
+  //! \return true in case of contact.
+  bool HasContact(const double tol        = 0.0,
+                  const bool   isParallel = true)
+  {
+    return this->IsCloserThan(tol, nullptr, isParallel);
+  }
+
+  //! Finds the min distance between the sets.
+  //! \param[out] closest    the closest pair of facets.
+  //! \param[in]  isParallel whether to process the subtree pairs in parallel.
+  //! \return false if any of the sets is empty.
+  bool
+    MinDistance(t_pair&    closest,
+                const bool isParallel = true);
+
+protected:
+
+  //! Search mode.
+  enum Mode
+  {
+    Mode_Contacts = 0, //!< Collect all pairs within the bound.
+    Mode_Any,          //!< Stop at the first pair within the bound.
+    Mode_MinDist       //!< Shrink the bound to the closest pair.
+  };
+
+  //! State shared by the threads of a search.
+  struct t_search
+  {
+    Mode                SearchMode; //!< Search mode.
+    std::atomic<double> Bound2;     //!< Squared distance to prune by.
+    std::atomic<bool>   IsStopped;  //!< Whether the early exit is taken.
+
+    t_search(const Mode mode, const double bound2) : SearchMode(mode), Bound2(bound2), IsStopped(false) {}
+  };
+
+  //! Results of a single subtree pair.
+  struct t_task
+  {
+    std::vector<t_pair> Pairs; //!< Found pairs.
+    t_pair              Best;  //!< Closest found pair.
+  };
+
+protected:
+
+  //! Builds both trees and transforms the second set. The transformed data
+  //! is reused until the placement or the revision of the second set
+  //! changes, e.g., by a refit or a rebuild of its tree.
+  //! \return false if any of the sets is empty.
+  bool
+    prepare();
+
+  //! Runs the search from the roots.
+  //! \param[in,out] search     the search state.
+  //! \param[in]     isParallel whether to process the subtree pairs in parallel.
+  //! \return results of all subtree pairs.
+  std::vector<t_task>
+    perform(t_search&  search,
+            const bool isParallel);
+
+  //! Traverses the pair of subtrees.
+  //! \param[in]     node1  the node of the first tree.
+  //! \param[in]     node2  the node of the second tree.
+  //! \param[in,out] search the search state.
+  //! \param[out]    task   the results.
+  void
+    traverse(const int node1,
+             const int node2,
+             t_search& search,
+             t_task&   task) const;
+
+  //! \return squared distance between the boxes of the nodes.
+  double
+    nodeDistance2(const int node1,
+                  const int node2) const;
+
+  //! Decides which node of the pair to split.
+  //! \return true to split the first node, false for the second one.
+  bool
+    isSplitFirst(const int node1,
+                 const int node2) const;
+
+protected:
+
+  Handle(BVHFacets) m_facets1;     //!< First set of facets.
+  Handle(BVHFacets) m_facets2;     //!< Second set of facets.
+  gp_Trsf           m_trsf;        //!< Placement of the second set.
+  int               m_iRevision2;  //!< Revision of the transformed second set, -1 if none.
+
+  //! Nodes of the second set's facets in the first set's coordinates.
+  std::vector<BVH_Vec3d> m_nodes2;
+
+  //! Node boxes of the second tree in the first set's coordinates.
+  std::vector<BVH_Vec3d> m_minPts2, m_maxPts2;
+
+};
+
+#endif
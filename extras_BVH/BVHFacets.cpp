@@ -33,6 +33,7 @@
 
 // BVH includes
 #include "BVHIterator.h"
+#include "BVHProfiler.h"
 
 // Viewer includes
 #include "Viewer.h"
@@ -45,13 +46,16 @@
 #include <BRepBndLib.hxx>
 #include <BVH_BinnedBuilder.hxx>
 #include <BVH_LinearBuilder.hxx>
+#include <OSD_Parallel.hxx>
 #include <TopExp.hxx>
 #include <TopExp_Explorer.hxx>
 #include <TopoDS.hxx>
 #include <TopoDS_Compound.hxx>
+#include <gp.hxx>
 
 // Standard includes
 #include <map>
+#include <vector>
 
 #define DRAW_DEBUG
 #if defined DRAW_DEBUG
@@ -59,29 +63,96 @@
 #endif
 
 
+//-----------------------------------------------------------------------------
+
+namespace
+{
+  //! Triangulation of a face with its placement.
+  struct t_faceMesh
+  {
+    Handle(Poly_Triangulation) Tris;       //!< Face triangulation.
+    gp_Trsf                    Trsf;       //!< Face location.
+    bool                       IsReversed; //!< Face orientation.
+  };
+
+  //! Reloads the nodes of a facet from its host triangle, keeping the
+  //! node order of BVHFacets::addTriangulation().
+  void loadNodes(const t_faceMesh&   mesh,
+                 BVHFacets::t_facet& facet)
+  {
+    int n1, n2, n3;
+    mesh.Tris->Triangle(facet.TriIndex).Get(n1, n2, n3);
+
+    const gp_Pnt P0 = mesh.Tris->Node(mesh.IsReversed ? n3 : n1).Transformed(mesh.Trsf);
+    const gp_Pnt P1 = mesh.Tris->Node(n2)                          .Transformed(mesh.Trsf);
+    const gp_Pnt P2 = mesh.Tris->Node(mesh.IsReversed ? n1 : n3).Transformed(mesh.Trsf);
+
+    facet.P0 = BVH_Vec3d( P0.X(), P0.Y(), P0.Z() );
+    facet.P1 = BVH_Vec3d( P1.X(), P1.Y(), P1.Z() );
+    facet.P2 = BVH_Vec3d( P2.X(), P2.Y(), P2.Z() );
+  }
+
+  //! Recomputes the cached normal of a facet by its nodes. A facet can
+  //! degenerate in the course of deformation, but it cannot be dropped
+  //! without changing the tree, so it keeps its previous normal.
+  void updateNormal(BVHFacets::t_facet& facet)
+  {
+    const gp_Vec V1( facet.P1.x() - facet.P0.x(), facet.P1.y() - facet.P0.y(), facet.P1.z() - facet.P0.z() );
+    const gp_Vec V2( facet.P2.x() - facet.P0.x(), facet.P2.y() - facet.P0.y(), facet.P2.z() - facet.P0.z() );
+    const gp_Vec N = V1.Crossed(V2);
+    //
+    if ( N.Magnitude() <= gp::Resolution() )
+      return;
+
+    facet.N = N.Normalized();
+  }
+}
+
 //-----------------------------------------------------------------------------
 
 BVHFacets::BVHFacets(const TopoDS_Shape&  model,
                      const BVHBuilderType builderType,
                      Viewer*              pViewer)
+: BVHFacets( model, BVHBuildParams(builderType), pViewer )
+{}
+
+//-----------------------------------------------------------------------------
+
+BVHFacets::BVHFacets(const Handle(Poly_Triangulation)& mesh,
+                     const BVHBuilderType              builderType,
+                     Viewer*                           pViewer)
+: BVHFacets( mesh, BVHBuildParams(builderType), pViewer )
+{}
+
+//-----------------------------------------------------------------------------
+
+BVHFacets::BVHFacets(const TopoDS_Shape&   model,
+                     const BVHBuildParams& params,
+                     Viewer*               pViewer)
 : BVH_PrimitiveSet<double, 3> (),
   m_fBoundingDiag             (0.0),
+  m_fBuildSAH                 (-1.0),
+  m_fSAHGrowth                (1.0),
+  m_iRevision                 (0),
   m_pViewer                   (pViewer)
 {
-  this->init(model, builderType);
+  this->init(model, params);
   this->MarkDirty();
 }
 
 //-----------------------------------------------------------------------------
 
 BVHFacets::BVHFacets(const Handle(Poly_Triangulation)& mesh,
-                     const BVHBuilderType              builderType,
+                     const BVHBuildParams&             params,
                      Viewer*                           pViewer)
 : BVH_PrimitiveSet<double, 3> (),
   m_fBoundingDiag             (0.0),
+  m_fBuildSAH                 (-1.0),
+  m_fSAHGrowth                (1.0),
+  m_iRevision                 (0),
   m_pViewer                   (pViewer)
 {
-  this->init(mesh, builderType);
+  this->init(mesh, params);
   this->MarkDirty();
 }
 
@@ -100,6 +171,42 @@ void BVHFacets::SetViewer(Viewer* pViewer)
 
 //-----------------------------------------------------------------------------
 
+void BVHFacets::SetBuildParams(const BVHBuildParams& params)
+{
+  const int numThreads = (params.NumThreads < 0) ? OSD_Parallel::NbLogicalProcessors()
+                                                 : Max(params.NumThreads, 1);
+  const int maxDepth   = Min( Max(params.MaxDepth, 1), BVHBuildParams::MaxTreeDepth );
+
+  if ( params.Builder == BVHBuilder_Linear )
+  {
+    // The linear builder parallelizes the radix sort of Morton codes and
+    // the bottom-up update of node boxes.
+    myBuilder = new BVH_LinearBuilder<double, 3>(params.LeafSize, maxDepth);
+    myBuilder->SetParallel(numThreads > 1);
+  }
+  else
+  {
+    // The number of bins is a template argument, so only a few values
+    // are instantiated. The binned builder processes the subtrees in a
+    // queue shared by the given number of threads.
+    switch ( params.NumBins )
+    {
+      case 4:  myBuilder = new BVH_BinnedBuilder<double, 3, 4> (params.LeafSize, maxDepth, false, numThreads); break;
+      case 8:  myBuilder = new BVH_BinnedBuilder<double, 3, 8> (params.LeafSize, maxDepth, false, numThreads); break;
+      case 16: myBuilder = new BVH_BinnedBuilder<double, 3, 16>(params.LeafSize, maxDepth, false, numThreads); break;
+      case 48: myBuilder = new BVH_BinnedBuilder<double, 3, 48>(params.LeafSize, maxDepth, false, numThreads); break;
+      case 64: myBuilder = new BVH_BinnedBuilder<double, 3, 64>(params.LeafSize, maxDepth, false, numThreads); break;
+      default: myBuilder = new BVH_BinnedBuilder<double, 3, 32>(params.LeafSize, maxDepth, false, numThreads);
+    }
+  }
+
+  m_params          = params;
+  m_params.MaxDepth = maxDepth;
+  this->MarkDirty();
+}
+
+//-----------------------------------------------------------------------------
+
 int BVHFacets::Size() const
 {
   return (int) m_facets.size();
@@ -164,17 +271,275 @@ double BVHFacets::GetBoundingDiag() const
 
 //-----------------------------------------------------------------------------
 
-bool BVHFacets::init(const TopoDS_Shape&  model,
-                     const BVHBuilderType builderType)
+BVHRefitResult BVHFacets::Refit(const gp_Trsf& trsf)
+{
+  this->prepareRefit();
+
+  // The normals are recomputed by nodes rather than transformed, so that
+  // they stay consistent with the node order for mirroring as well.
+  OSD_Parallel::For( 0, this->Size(), [&](const int i)
+  {
+    t_facet& facet = m_facets[i];
+
+    for ( BVH_Vec3d* P : {&facet.P0, &facet.P1, &facet.P2} )
+    {
+      const gp_Pnt pnt = gp_Pnt( P->x(), P->y(), P->z() ).Transformed(trsf);
+      *P = BVH_Vec3d( pnt.X(), pnt.Y(), pnt.Z() );
+    }
+
+    updateNormal(facet);
+  }, m_params.NumThreads == 1 );
+
+  m_fBoundingDiag *= Abs( trsf.ScaleFactor() );
+
+  return this->refitTree();
+}
+
+//-----------------------------------------------------------------------------
+
+BVHRefitResult BVHFacets::Refit(const TopoDS_Shape& model)
+{
+  if ( model.IsNull() || m_faces.IsEmpty() )
+    return BVHRefit_Failed;
+
+  TopTools_IndexedMapOfShape faces;
+  TopExp::MapShapes(model, TopAbs_FACE, faces);
+  //
+  if ( faces.Extent() != m_faces.Extent() )
+    return BVHRefit_Failed;
+
+  std::vector<t_faceMesh> meshes( faces.Extent() );
+  //
+  for ( int fidx = 1; fidx <= faces.Extent(); ++fidx )
+  {
+    const TopoDS_Face& face = TopoDS::Face( faces(fidx) );
+
+    TopLoc_Location loc;
+    t_faceMesh&     mesh = meshes[fidx - 1];
+    //
+    mesh.Tris       = BRep_Tool::Triangulation(face, loc);
+    mesh.Trsf       = loc.Transformation();
+    mesh.IsReversed = (face.Orientation() == TopAbs_REVERSED);
+  }
+
+  // Check all facets before touching any of them.
+  for ( const t_facet& facet : m_facets )
+  {
+    const t_faceMesh& mesh = meshes[facet.FaceIndex - 1];
+    //
+    if ( mesh.Tris.IsNull() || facet.TriIndex > mesh.Tris->NbTriangles() )
+      return BVHRefit_Failed;
+  }
+
+  this->prepareRefit();
+
+  OSD_Parallel::For( 0, this->Size(), [&](const int i)
+  {
+    t_facet& facet = m_facets[i];
+
+    loadNodes(meshes[facet.FaceIndex - 1], facet);
+    updateNormal(facet);
+  }, m_params.NumThreads == 1 );
+
+  m_faces = faces;
+
+  // Calculate bounding diagonal
+  Bnd_Box aabb;
+  BRepBndLib::Add(model, aabb);
+  //
+  m_fBoundingDiag = ( aabb.CornerMax().XYZ() - aabb.CornerMin().XYZ() ).Modulus();
+
+  return this->refitTree();
+}
+
+//-----------------------------------------------------------------------------
+
+BVHRefitResult BVHFacets::Refit(const Handle(Poly_Triangulation)& mesh)
+{
+  if ( mesh.IsNull() || !m_faces.IsEmpty() )
+    return BVHRefit_Failed;
+
+  t_faceMesh faceMesh;
+  faceMesh.Tris       = mesh;
+  faceMesh.IsReversed = false;
+
+  // Check all facets before touching any of them.
+  for ( const t_facet& facet : m_facets )
+  {
+    if ( facet.TriIndex > mesh->NbTriangles() )
+      return BVHRefit_Failed;
+  }
+
+  this->prepareRefit();
+
+  OSD_Parallel::For( 0, this->Size(), [&](const int i)
+  {
+    loadNodes(faceMesh, m_facets[i]);
+    updateNormal(m_facets[i]);
+  }, m_params.NumThreads == 1 );
+
+  // Calculate bounding diagonal using fictive face to satisfy OpenCascade's API
+  BRep_Builder BB;
+  TopoDS_Face F;
+  BB.MakeFace(F, mesh);
+  Bnd_Box aabb;
+  BRepBndLib::Add(F, aabb);
+  //
+  m_fBoundingDiag = ( aabb.CornerMax().XYZ() - aabb.CornerMin().XYZ() ).Modulus();
+
+  return this->refitTree();
+}
+
+//-----------------------------------------------------------------------------
+
+double BVHFacets::ComputeSAH() const
+{
+  return BVHProfiler::ComputeSAH( myBVH.get() );
+}
+
+//-----------------------------------------------------------------------------
+
+double BVHFacets::GetSAHGrowth() const
+{
+  return m_fSAHGrowth;
+}
+
+//-----------------------------------------------------------------------------
+
+int BVHFacets::GetRevision() const
+{
+  return m_iRevision;
+}
+
+//-----------------------------------------------------------------------------
+
+void BVHFacets::Update()
+{
+  BVH_PrimitiveSet<double, 3>::Update();
+
+  m_fBuildSAH  = -1.0;
+  m_fSAHGrowth =  1.0;
+  m_iRevision++;
+}
+
+//-----------------------------------------------------------------------------
+
+void BVHFacets::prepareRefit()
+{
+  // The facets are about to move.
+  m_iRevision++;
+
+  // The cost is measured lazily, so that the trees which are never refitted
+  // do not pay for it.
+  if ( !myIsDirty && m_fBuildSAH < 0. )
+    m_fBuildSAH = this->ComputeSAH();
+}
+
+//-----------------------------------------------------------------------------
+
+BVHRefitResult BVHFacets::refitTree()
+{
+  // There is no tree to refit yet.
+  if ( myIsDirty || myBVH.IsNull() )
+  {
+    this->BVH();
+    return BVHRefit_Rebuilt;
+  }
+
+  BVH_Tree<double, 3>* bvh = myBVH.get();
+  //
+  if ( bvh->NodeInfoBuffer().empty() )
+    return BVHRefit_Updated;
+
+  // Group the nodes by depth. The nodes of the same depth are independent,
+  // while each one depends on its children only, so the levels are updated
+  // from the deepest one up, each in parallel.
+  std::vector< std::vector<int> > levels(1, std::vector<int>(1, 0));
+  //
+  while ( !levels.back().empty() )
+  {
+    std::vector<int> next;
+    //
+    for ( const int node : levels.back() )
+    {
+      const BVH_Vec4i& data = bvh->NodeInfoBuffer()[node];
+      //
+      if ( data.x() == 0 ) // Inner node.
+      {
+        next.push_back( data.y() );
+        next.push_back( data.z() );
+      }
+    }
+
+    levels.push_back(next);
+  }
+
+  auto refitNode = [&](const int node)
+  {
+    const BVH_Vec4i& data = bvh->NodeInfoBuffer()[node];
+
+    BVH_Vec3d minPt, maxPt;
+    //
+    if ( data.x() == 0 ) // Inner node.
+    {
+      minPt = bvh->MinPoint( data.y() ).cwiseMin( bvh->MinPoint( data.z() ) );
+      maxPt = bvh->MaxPoint( data.y() ).cwiseMax( bvh->MaxPoint( data.z() ) );
+    }
+    else // Leaf node.
+    {
+      minPt = m_facets[data.y()].P0;
+      maxPt = m_facets[data.y()].P0;
+      //
+      for ( int idx = data.y(); idx <= data.z(); ++idx )
+      {
+        const t_facet& facet = m_facets[idx];
+
+        minPt = minPt.cwiseMin(facet.P0).cwiseMin(facet.P1).cwiseMin(facet.P2);
+        maxPt = maxPt.cwiseMax(facet.P0).cwiseMax(facet.P1).cwiseMax(facet.P2);
+      }
+    }
+
+    bvh->MinPoint(node) = minPt;
+    bvh->MaxPoint(node) = maxPt;
+  };
+
+  const int minParallelLevel = 256;
+  //
+  for ( int d = int( levels.size() ) - 2; d >= 0; --d )
+  {
+    const std::vector<int>& level = levels[d];
+
+    // The top levels are too small to be worth dispatching.
+    OSD_Parallel::For( 0, int( level.size() ), [&](const int k)
+    {
+      refitNode(level[k]);
+    }, m_params.NumThreads == 1 || int( level.size() ) < minParallelLevel );
+  }
+
+  // Refitting keeps the topology, so the tree quality degrades as the
+  // facets move away from their initial positions.
+  m_fSAHGrowth = (m_fBuildSAH > 0.) ? this->ComputeSAH()/m_fBuildSAH : 1.0;
+  //
+  if ( m_fSAHGrowth > m_params.MaxSAHGrowth )
+  {
+    this->MarkDirty();
+    this->BVH();
+    return BVHRefit_Rebuilt;
+  }
+
+  return BVHRefit_Updated;
+}
+
+//-----------------------------------------------------------------------------
+
+bool BVHFacets::init(const TopoDS_Shape&   model,
+                     const BVHBuildParams& params)
 {
   if ( model.IsNull() )
     return false;
 
   // Prepare builder
-  if ( builderType == BVHBuilder_Binned )
-    myBuilder = new BVH_BinnedBuilder<double, 3, 32>(5, 32);
-  else if ( builderType == BVHBuilder_Linear )
-    myBuilder = new BVH_LinearBuilder<double, 3>(5, 32);
+  this->SetBuildParams(params);
 
   // Explode shape on faces to get face indices
   if ( m_faces.IsEmpty() )
@@ -202,13 +567,10 @@ bool BVHFacets::init(const TopoDS_Shape&  model,
 //-----------------------------------------------------------------------------
 
 bool BVHFacets::init(const Handle(Poly_Triangulation)& mesh,
-                     const BVHBuilderType              builderType)
+                     const BVHBuildParams&             params)
 {
   // Prepare builder
-  if ( builderType == BVHBuilder_Binned )
-    myBuilder = new BVH_BinnedBuilder<double, 3, 32>(5, 32);
-  else if ( builderType == BVHBuilder_Linear )
-    myBuilder = new BVH_LinearBuilder<double, 3>(5, 32);
+  this->SetBuildParams(params);
 
   // Initialize with the passed facets
   if ( !this->addTriangulation(mesh, TopLoc_Location(), -1, false) )
@@ -269,6 +631,7 @@ bool BVHFacets::addTriangulation(const Handle(Poly_Triangulation)& triangulation
 
     // Create a new facet
     t_facet facet(face_idx == -1 ? elemId : face_idx);
+    facet.TriIndex = elemId;
 
     // Initialize nodes
     facet.P0 = BVH_Vec3d( P0.X(), P0.Y(), P0.Z() );
@@ -282,9 +645,12 @@ bool BVHFacets::addTriangulation(const Handle(Poly_Triangulation)& triangulation
     if ( V1.SquareMagnitude() < 1e-8 )
     {
 #if defined DRAW_DEBUG
-      (*m_pViewer) << P0;
-      (*m_pViewer) << P1;
-      (*m_pViewer) << P2;
+      if ( m_pViewer )
+      {
+        (*m_pViewer) << P0;
+        (*m_pViewer) << P1;
+        (*m_pViewer) << P2;
+      }
 #endif
 
       std::cerr << "V1.SquareMagnitude() < epsilon." << std::endl;
@@ -299,9 +665,12 @@ bool BVHFacets::addTriangulation(const Handle(Poly_Triangulation)& triangulation
     if ( V2.SquareMagnitude() < 1e-8 )
     {
 #if defined DRAW_DEBUG
-      (*m_pViewer) << P0;
-      (*m_pViewer) << P1;
-      (*m_pViewer) << P2;
+      if ( m_pViewer )
+      {
+        (*m_pViewer) << P0;
+        (*m_pViewer) << P1;
+        (*m_pViewer) << P2;
+      }
 #endif
 
       std::cerr << "V2.SquareMagnitude() < epsilon." << std::endl;
@@ -317,9 +686,12 @@ bool BVHFacets::addTriangulation(const Handle(Poly_Triangulation)& triangulation
     if ( facet.N.SquareMagnitude() < 1e-8 )
     {
 #if defined DRAW_DEBUG
-      (*m_pViewer) << P0;
-      (*m_pViewer) << P1;
-      (*m_pViewer) << P2;
+      if ( m_pViewer )
+      {
+        (*m_pViewer) << P0;
+        (*m_pViewer) << P1;
+        (*m_pViewer) << P2;
+      }
 #endif
 
       std::cerr << "facet.N.SquareMagnitude() < epsilon." << std::endl;
@@ -38,6 +38,7 @@
 #include <Poly_Triangulation.hxx>
 #include <TopoDS_Face.hxx>
 #include <TopTools_IndexedMapOfShape.hxx>
+#include <gp_Trsf.hxx>
 
 // STL includes
 #include <vector>
@@ -53,6 +54,33 @@ enum BVHBuilderType
   BVHBuilder_Linear
 };
 
+//! Options of BVH construction.
+struct BVHBuildParams
+{
+  BVHBuilderType Builder;      //!< Construction algorithm.
+  int            LeafSize;     //!< Max number of facets in a leaf.
+  int            NumBins;      //!< Number of bins (4, 8, 16, 32, 48 or 64) for the binned builder.
+  int            MaxDepth;     //!< Max depth of the tree, at most MaxTreeDepth.
+  int            NumThreads;   //!< Number of threads to build with, -1 for all cores. Refit is serial for 1.
+  double         MaxSAHGrowth; //!< Growth of the SAH cost due to refits that triggers a rebuild.
+
+  //! Max depth of the tree. The traversals keep fixed-size stacks of 64
+  //! nodes, which deeper trees would overrun.
+  static const int MaxTreeDepth = 32;
+
+  //! Default ctor.
+  explicit BVHBuildParams(const BVHBuilderType builder = BVHBuilder_Binned)
+  : Builder(builder), LeafSize(5), NumBins(32), MaxDepth(32), NumThreads(1), MaxSAHGrowth(1.5) {}
+};
+
+//! Outcome of BVH refit.
+enum BVHRefitResult
+{
+  BVHRefit_Failed = 0, //!< The passed geometry does not match the facets.
+  BVHRefit_Updated,    //!< The node boxes are updated in place.
+  BVHRefit_Rebuilt     //!< The tree is built from scratch.
+};
+
 //-----------------------------------------------------------------------------
 
 //! BVH-based accelerating structure representing CAD model's
@@ -74,12 +102,13 @@ public:
   //! Structure representing a single facet.
   struct t_facet
   {
-    t_facet()               : FaceIndex(-1) {}
-    t_facet(const int fidx) : FaceIndex(fidx) {}
+    t_facet()               : FaceIndex(-1),   TriIndex(-1) {}
+    t_facet(const int fidx) : FaceIndex(fidx), TriIndex(-1) {}
 
     BVH_Vec3d P0, P1, P2; //!< Triangle nodes.
     gp_Vec    N;          //!< Cached normal calculated by nodes.
     int       FaceIndex;  //!< Index of the host face.
+    int       TriIndex;   //!< Index of the triangle in the host triangulation.
   };
 
 public:
@@ -100,6 +129,22 @@ public:
             const BVHBuilderType              builderType = BVHBuilder_Binned,
             Viewer*                           pViewer     = nullptr);
 
+  //! Creates the accelerating structure with immediate initialization.
+  //! \param[in] model   the CAD model to create the accelerating structure for.
+  //! \param[in] params  the options of BVH construction.
+  //! \param[in] pViewer the viewer instance for visual debugging.
+  BVHFacets(const TopoDS_Shape&   model,
+            const BVHBuildParams& params,
+            Viewer*               pViewer = nullptr);
+
+  //! Creates the accelerating structure with immediate initialization.
+  //! \param[in] mesh    the triangulation to create the accelerating structure for.
+  //! \param[in] params  the options of BVH construction.
+  //! \param[in] pViewer the viewer instance for visual debugging.
+  BVHFacets(const Handle(Poly_Triangulation)& mesh,
+            const BVHBuildParams&             params,
+            Viewer*                           pViewer = nullptr);
+
   //! Dtor.
   virtual
     ~BVHFacets();
@@ -108,6 +153,18 @@ public:
 
   void SetViewer(Viewer* pViewer);
 
+  //! Sets the options of BVH construction. The tree is rebuilt on the
+  //! next access. The max depth is clamped to BVHBuildParams::MaxTreeDepth.
+  //! \param[in] params the build options.
+  void
+    SetBuildParams(const BVHBuildParams& params);
+
+  //! \return options of BVH construction.
+  const BVHBuildParams& GetBuildParams() const
+  {
+    return m_params;
+  }
+
 public:
 
   //! \return number of stored facets.
@@ -184,23 +241,81 @@ public:
     return aabb;
   }
 
+public:
+
+  //! Transforms the facets and refits the tree to them. The tree is rebuilt
+  //! instead if its SAH cost grows too much, see BVHBuildParams::MaxSAHGrowth.
+  //! \param[in] trsf the transformation to apply to the current facets.
+  //! \return refit result.
+  BVHRefitResult
+    Refit(const gp_Trsf& trsf);
+
+  //! Reloads the facets from the moved or deformed CAD model and refits the
+  //! tree to them. The model should have the same faces as the initial one,
+  //! and their triangulations should keep the triangles, while the mesh
+  //! nodes are free to move.
+  //! \param[in] model the updated CAD model.
+  //! \return refit result.
+  BVHRefitResult
+    Refit(const TopoDS_Shape& model);
+
+  //! Reloads the facets from the deformed triangulation and refits the tree
+  //! to them. The triangulation should keep the triangles of the initial
+  //! one, while its nodes are free to move.
+  //! \param[in] mesh the updated triangulation.
+  //! \return refit result.
+  BVHRefitResult
+    Refit(const Handle(Poly_Triangulation)& mesh);
+
+  //! Computes the SAH cost of the current tree without rebuilding it with
+  //! unit traversal and intersection costs, see BVHProfiler::ComputeSAH().
+  //! \return SAH cost or zero if the tree is not built.
+  double
+    ComputeSAH() const;
+
+  //! \return SAH cost of the tree relative to the one right after its build.
+  double
+    GetSAHGrowth() const;
+
+  //! \return counter of changes of the facets and the tree. It grows with
+  //!         every build and refit, so that the data derived from the
+  //!         facets elsewhere can be checked for staleness.
+  int
+    GetRevision() const;
+
+protected:
+
+  //! Builds the tree and resets the SAH cost measured on the previous one.
+  virtual void
+    Update() override;
+
+  //! Measures the SAH cost of the freshly built tree before its first refit.
+  void
+    prepareRefit();
+
+  //! Updates the node boxes bottom-up for the current facets and checks
+  //! the SAH cost of the updated tree.
+  //! \return refit result.
+  BVHRefitResult
+    refitTree();
+
 protected:
 
   //! Initializes the accelerating structure with the given CAD model.
-  //! \param[in] model       the CAD model to prepare the accelerating structure for.
-  //! \param[in] builderType the type of the builder to use.
+  //! \param[in] model  the CAD model to prepare the accelerating structure for.
+  //! \param[in] params the options of BVH construction.
   //! \return true in case of success, false -- otherwise.
   bool
-    init(const TopoDS_Shape&  model,
-         const BVHBuilderType builderType);
+    init(const TopoDS_Shape&   model,
+         const BVHBuildParams& params);
 
   //! Initializes the accelerating structure with the given triangulation.
-  //! \param[in] model       the triangulation to prepare the accelerating structure for.
-  //! \param[in] builderType the type of the builder to use.
+  //! \param[in] model  the triangulation to prepare the accelerating structure for.
+  //! \param[in] params the options of BVH construction.
   //! \return true in case of success, false -- otherwise.
   bool
     init(const Handle(Poly_Triangulation)& mesh,
-         const BVHBuilderType              builderType);
+         const BVHBuildParams&             params);
 
   //! Adds face to the accelerating structure.
   //! \param[in] face     face to add.
@@ -233,6 +348,18 @@ protected:
   //! Characteristic size of the model.
   double m_fBoundingDiag;
 
+  //! Options of BVH construction.
+  BVHBuildParams m_params;
+
+  //! SAH cost of the tree right after its build, negative if not measured yet.
+  double m_fBuildSAH;
+
+  //! SAH cost growth due to refits.
+  double m_fSAHGrowth;
+
+  //! Counter of builds and refits.
+  int m_iRevision;
+
   //! Viewer for visual diagnostics.
   Viewer* m_pViewer;
 
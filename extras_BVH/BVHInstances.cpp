@@ -0,0 +1,462 @@
+//-----------------------------------------------------------------------------
+// Created on: 16 October 2026
+//-----------------------------------------------------------------------------
+// Copyright (c) 2016-present, Quaoar, https://analysissitus.org
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of the copyright holder(s) nor the
+//      names of all contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//-----------------------------------------------------------------------------
+
+// Own include
+#include "BVHInstances.h"
+
+// OCCT includes
+#include <BVH_BinnedBuilder.hxx>
+#include <OSD_Parallel.hxx>
+#include <TopExp_Explorer.hxx>
+#include <gp_Vec.hxx>
+
+// Standard includes
+#include <cmath>
+#include <map>
+
+//-----------------------------------------------------------------------------
+
+BVHInstanceSet::BVHInstanceSet()
+: BVH_PrimitiveSet<double, 3> ()
+{
+  // A couple of instances per leaf, as each of them costs a full query.
+  myBuilder = new BVH_BinnedBuilder<double, 3, 32>(2, 32);
+}
+
+//-----------------------------------------------------------------------------
+
+void BVHInstanceSet::Add(const BVH_Box<double, 3>& box,
+                         const int                 instance)
+{
+  m_boxes.push_back(box);
+  m_instances.push_back(instance);
+  this->MarkDirty();
+}
+
+//-----------------------------------------------------------------------------
+
+int BVHInstanceSet::Size() const
+{
+  return (int) m_boxes.size();
+}
+
+//-----------------------------------------------------------------------------
+
+BVH_Box<double, 3> BVHInstanceSet::Box(const int index) const
+{
+  return m_boxes[index];
+}
+
+//-----------------------------------------------------------------------------
+
+double BVHInstanceSet::Center(const int index,
+                              const int axis) const
+{
+  return m_boxes[index].Center(axis);
+}
+
+//-----------------------------------------------------------------------------
+
+void BVHInstanceSet::Swap(const int index1,
+                          const int index2)
+{
+  std::swap(m_boxes[index1],     m_boxes[index2]);
+  std::swap(m_instances[index1], m_instances[index2]);
+}
+
+//-----------------------------------------------------------------------------
+
+BVHInstances::BVHInstances()
+: m_top      (new BVHInstanceSet),
+  m_bIsBuilt (false)
+{}
+
+//-----------------------------------------------------------------------------
+
+BVHInstances::BVHInstances(const TopoDS_Shape&   model,
+                           const BVHBuildParams& params)
+: BVHInstances()
+{
+  if ( model.IsNull() )
+    return;
+
+  std::vector<TopoDS_Shape> solids;
+  //
+  for ( TopExp_Explorer exp(model, TopAbs_SOLID); exp.More(); exp.Next() )
+    solids.push_back( exp.Current() );
+  //
+  if ( solids.empty() )
+    solids.push_back(model);
+
+  // The instances of a part share the TShape and differ in locations only.
+  std::map<std::pair<const TopoDS_TShape*, int>, int> partIds;
+  std::vector<TopoDS_Shape>                           partShapes;
+  std::vector<int>                                    solidParts;
+  //
+  for ( const TopoDS_Shape& solid : solids )
+  {
+    const std::pair<const TopoDS_TShape*, int> key( solid.TShape().get(), int( solid.Orientation() ) );
+
+    auto it = partIds.find(key);
+    //
+    if ( it == partIds.end() )
+    {
+      it = partIds.insert( std::make_pair( key, int( partShapes.size() ) ) ).first;
+      partShapes.push_back( solid.Located( TopLoc_Location() ) );
+    }
+
+    solidParts.push_back(it->second);
+  }
+
+  // The parts are independent, so they are collected in parallel, each
+  // one in a single thread.
+  BVHBuildParams partParams = params;
+  partParams.NumThreads = 1;
+
+  std::vector<Handle(BVHFacets)> parts( partShapes.size() );
+  //
+  OSD_Parallel::For( 0, int( partShapes.size() ), [&](const int p)
+  {
+    parts[p] = new BVHFacets(partShapes[p], partParams);
+  } );
+
+  for ( const Handle(BVHFacets)& part : parts )
+    this->AddPart(part);
+
+  for ( size_t s = 0; s < solids.size(); ++s )
+    this->AddInstance( solidParts[s], solids[s].Location().Transformation() );
+
+  this->Build();
+}
+
+//-----------------------------------------------------------------------------
+
+int BVHInstances::AddPart(const Handle(BVHFacets)& part)
+{
+  m_parts.push_back(part);
+  m_queries.push_back( BVHQuery(part) );
+  m_bIsBuilt = false;
+
+  return int( m_parts.size() ) - 1;
+}
+
+//-----------------------------------------------------------------------------
+
+int BVHInstances::AddInstance(const int      part,
+                              const gp_Trsf& trsf)
+{
+  if ( part < 0 || part >= int( m_parts.size() ) )
+    return -1;
+
+  t_instance instance;
+  instance.Part    = part;
+  instance.Trsf    = trsf;
+  instance.InvTrsf = trsf.Inverted();
+  instance.Scale   = Abs( trsf.ScaleFactor() );
+
+  m_instances.push_back(instance);
+  m_bIsBuilt = false;
+
+  return int( m_instances.size() ) - 1;
+}
+
+//-----------------------------------------------------------------------------
+
+void BVHInstances::Build()
+{
+  // The part trees are independent, so they are built in parallel.
+  OSD_Parallel::For( 0, int( m_parts.size() ), [&](const int p)
+  {
+    m_parts[p]->BVH();
+  } );
+
+  m_top = new BVHInstanceSet;
+  //
+  for ( int i = 0; i < int( m_instances.size() ); ++i )
+  {
+    const t_instance&        instance = m_instances[i];
+    const Handle(BVHFacets)& part     = m_parts[instance.Part];
+    //
+    if ( part->Size() == 0 )
+      continue;
+
+    // The world box bounds the transformed corners of the part's box.
+    const BVH_Box<double, 3> partBox = part->Box();
+    BVH_Box<double, 3>       worldBox;
+    //
+    for ( int corner = 0; corner < 8; ++corner )
+    {
+      gp_XYZ P( (corner & 1) ? partBox.CornerMax().x() : partBox.CornerMin().x(),
+                (corner & 2) ? partBox.CornerMax().y() : partBox.CornerMin().y(),
+                (corner & 4) ? partBox.CornerMax().z() : partBox.CornerMin().z() );
+      //
+      instance.Trsf.Transforms(P);
+
+      worldBox.Add( BVH_Vec3d( P.X(), P.Y(), P.Z() ) );
+    }
+
+    m_top->Add(worldBox, i);
+  }
+
+  m_top->BVH();
+  m_bIsBuilt = true;
+
+  // The parts are built by now, so their revisions are final.
+  m_revisions.resize( m_parts.size() );
+  //
+  for ( size_t p = 0; p < m_parts.size(); ++p )
+    m_revisions[p] = m_parts[p]->GetRevision();
+}
+
+//-----------------------------------------------------------------------------
+
+bool BVHInstances::isUpToDate() const
+{
+  if ( !m_bIsBuilt )
+    return false;
+
+  // A refit or rebuild of a part changes its box.
+  for ( size_t p = 0; p < m_parts.size(); ++p )
+    if ( m_revisions[p] != m_parts[p]->GetRevision() )
+      return false;
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+bool BVHInstances::ClosestPoint(const gp_XYZ& P,
+                                t_hit&        hit,
+                                const double  maxDist)
+{
+  hit = t_hit();
+
+  if ( !this->isUpToDate() )
+    this->Build();
+
+  const BVH_Tree<double, 3>* pBVH = m_top->BVH().get();
+  //
+  if ( pBVH == nullptr || pBVH->NodeInfoBuffer().empty() || maxDist < 0. )
+    return false;
+
+  const BVH_Vec3d PP( P.X(), P.Y(), P.Z() );
+
+  double bestDist  = maxDist;
+  double bestDist2 = (maxDist < std::sqrt(RealLast())) ? maxDist*maxDist : RealLast();
+
+  std::pair<int, double> stack[64];
+  int head = -1;
+
+  stack[++head] = std::make_pair( 0, BVHQuery::SquaredDistanceToBox( PP, pBVH->MinPoint(0), pBVH->MaxPoint(0) ) );
+
+  while ( head >= 0 )
+  {
+    const std::pair<int, double> entry = stack[head--];
+    //
+    if ( entry.second > bestDist2 )
+      continue;
+
+    const BVH_Vec4i& data = pBVH->NodeInfoBuffer()[entry.first];
+
+    if ( data.x() == 0 ) // Inner node.
+    {
+      const double distToLft = BVHQuery::SquaredDistanceToBox( PP, pBVH->MinPoint( data.y() ), pBVH->MaxPoint( data.y() ) );
+      const double distToRgh = BVHQuery::SquaredDistanceToBox( PP, pBVH->MinPoint( data.z() ), pBVH->MaxPoint( data.z() ) );
+
+      // The farther child goes first to be popped last.
+      const bool isLftNearer = distToLft < distToRgh;
+      //
+      const std::pair<int, double> nearer  = isLftNearer ? std::make_pair( data.y(), distToLft ) : std::make_pair( data.z(), distToRgh );
+      const std::pair<int, double> farther = isLftNearer ? std::make_pair( data.z(), distToRgh ) : std::make_pair( data.y(), distToLft );
+
+      if ( farther.second <= bestDist2 )
+        stack[++head] = farther;
+      //
+      if ( nearer.second <= bestDist2 )
+        stack[++head] = nearer;
+    }
+    else // Leaf node.
+    {
+      for ( int idx = data.y(); idx <= data.z(); ++idx )
+      {
+        const BVH_Box<double, 3>& box = m_top->Box(idx);
+        //
+        if ( BVHQuery::SquaredDistanceToBox( PP, box.CornerMin(), box.CornerMax() ) > bestDist2 )
+          continue;
+
+        const int         instanceIdx = m_top->GetInstance(idx);
+        const t_instance& instance    = m_instances[instanceIdx];
+
+        // The distances in the part's coordinates are scaled.
+        gp_XYZ localP = P;
+        instance.InvTrsf.Transforms(localP);
+
+        BVHQuery::t_hit localHit;
+        //
+        if ( !m_queries[instance.Part].ClosestPoint(localP, localHit, bestDist/instance.Scale) )
+          continue;
+
+        bestDist  = localHit.Distance*instance.Scale;
+        bestDist2 = bestDist*bestDist;
+
+        hit.Hit          = localHit;
+        hit.Hit.Distance = bestDist;
+        hit.Instance     = instanceIdx;
+        //
+        instance.Trsf.Transforms(hit.Hit.Point);
+      }
+    }
+  }
+
+  return hit.Instance >= 0;
+}
+
+//-----------------------------------------------------------------------------
+
+bool BVHInstances::Raycast(const gp_XYZ& origin,
+                           const gp_XYZ& dir,
+                           t_hit&        hit,
+                           const double  maxParam)
+{
+  hit = t_hit();
+
+  if ( !this->isUpToDate() )
+    this->Build();
+
+  const BVH_Tree<double, 3>* pBVH = m_top->BVH().get();
+  //
+  if ( pBVH == nullptr || pBVH->NodeInfoBuffer().empty() || dir.SquareModulus() == 0. )
+    return false;
+
+  const BVH_Vec3d O( origin.X(), origin.Y(), origin.Z() );
+  const BVH_Vec3d invD( 1./dir.X(), 1./dir.Y(), 1./dir.Z() );
+
+  double bestParam = maxParam;
+
+  std::pair<int, double> stack[64];
+  int head = -1;
+
+  const double rootParam = BVHQuery::RayEnterBox( O, invD, pBVH->MinPoint(0), pBVH->MaxPoint(0), bestParam );
+  //
+  if ( rootParam != RealLast() )
+    stack[++head] = std::make_pair(0, rootParam);
+
+  while ( head >= 0 )
+  {
+    const std::pair<int, double> entry = stack[head--];
+    //
+    if ( entry.second > bestParam )
+      continue;
+
+    const BVH_Vec4i& data = pBVH->NodeInfoBuffer()[entry.first];
+
+    if ( data.x() == 0 ) // Inner node.
+    {
+      const double paramLft = BVHQuery::RayEnterBox( O, invD, pBVH->MinPoint( data.y() ), pBVH->MaxPoint( data.y() ), bestParam );
+      const double paramRgh = BVHQuery::RayEnterBox( O, invD, pBVH->MinPoint( data.z() ), pBVH->MaxPoint( data.z() ), bestParam );
+
+      // The farther child goes first to be popped last.
+      const bool isLftNearer = paramLft < paramRgh;
+      //
+      const std::pair<int, double> nearer  = isLftNearer ? std::make_pair( data.y(), paramLft ) : std::make_pair( data.z(), paramRgh );
+      const std::pair<int, double> farther = isLftNearer ? std::make_pair( data.z(), paramRgh ) : std::make_pair( data.y(), paramLft );
+
+      if ( farther.second != RealLast() )
+        stack[++head] = farther;
+      //
+      if ( nearer.second != RealLast() )
+        stack[++head] = nearer;
+    }
+    else // Leaf node.
+    {
+      for ( int idx = data.y(); idx <= data.z(); ++idx )
+      {
+        const BVH_Box<double, 3>& box = m_top->Box(idx);
+        //
+        if ( BVHQuery::RayEnterBox( O, invD, box.CornerMin(), box.CornerMax(), bestParam ) == RealLast() )
+          continue;
+
+        const int         instanceIdx = m_top->GetInstance(idx);
+        const t_instance& instance    = m_instances[instanceIdx];
+
+        // The direction is transformed without normalization, so the ray
+        // parameter is the same in the part's coordinates.
+        gp_XYZ localO = origin;
+        instance.InvTrsf.Transforms(localO);
+        //
+        const gp_XYZ localD = gp_Vec(dir).Transformed(instance.InvTrsf).XYZ();
+
+        BVHQuery::t_hit localHit;
+        //
+        if ( !m_queries[instance.Part].Raycast(localO, localD, localHit, bestParam) )
+          continue;
+
+        bestParam = localHit.Distance;
+
+        hit.Hit       = localHit;
+        hit.Hit.Point = origin + dir*bestParam;
+        hit.Instance  = instanceIdx;
+      }
+    }
+  }
+
+  return hit.Instance >= 0;
+}
+
+//-----------------------------------------------------------------------------
+
+void BVHInstances::ClosestPointBatch(const std::vector<gp_XYZ>& points,
+                                     std::vector<t_hit>&        hits,
+                                     const double               maxDist,
+                                     const bool                 isParallel)
+{
+  hits.assign( points.size(), t_hit() );
+
+  // Build the trees before the threads share them.
+  if ( !this->isUpToDate() )
+    this->Build();
+
+  OSD_Parallel::For( 0, int( points.size() ), [&](const int i)
+  {
+    this->ClosestPoint(points[i], hits[i], maxDist);
+  }, !isParallel );
+}
+
+//-----------------------------------------------------------------------------
+
+int BVHInstances::GetNumFacets() const
+{
+  int numFacets = 0;
+  //
+  for ( const Handle(BVHFacets)& part : m_parts )
+    numFacets += part->Size();
+
+  return numFacets;
+}
@@ -0,0 +1,256 @@
+//-----------------------------------------------------------------------------
+// Created on: 16 October 2026
+//-----------------------------------------------------------------------------
+// Copyright (c) 2016-present, Quaoar, https://analysissitus.org
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of the copyright holder(s) nor the
+//      names of all contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//-----------------------------------------------------------------------------
+
+#ifndef BVHInstances_h
+#define BVHInstances_h
+
+// BVH includes
+#include "BVHFacets.h"
+#include "BVHQuery.h"
+
+// OCCT includes
+#include <TopoDS_Shape.hxx>
+
+// Standard includes
+#include <vector>
+
+//-----------------------------------------------------------------------------
+
+//! Top-level BVH over the world boxes of part instances. The primitives are
+//! reordered by the builder, so each box keeps the index of its instance.
+class BVHInstanceSet : public BVH_PrimitiveSet<double, 3>
+{
+public:
+
+  //! Ctor.
+  BVHInstanceSet();
+
+public:
+
+  //! Adds the box of an instance.
+  //! \param[in] box      the world box of the instance.
+  //! \param[in] instance the 0-based index of the instance.
+  void
+    Add(const BVH_Box<double, 3>& box,
+        const int                 instance);
+
+  //! \return index of the instance for the given primitive.
+  int GetInstance(const int index) const
+  {
+    return m_instances[index];
+  }
+
+public:
+
+  //! \return number of stored boxes.
+  virtual int
+    Size() const override;
+
+  //! \return box with the given index.
+  virtual BVH_Box<double, 3>
+    Box(const int index) const override;
+
+  //! Calculates center point of a box with respect to the axis of interest.
+  virtual double
+    Center(const int index,
+           const int axis) const override;
+
+  //! Swaps two elements for BVH building.
+  virtual void
+    Swap(const int index1,
+         const int index2) override;
+
+protected:
+
+  std::vector< BVH_Box<double, 3> > m_boxes;     //!< World boxes of instances.
+  std::vector<int>                  m_instances; //!< Indices of instances.
+
+};
+
+//-----------------------------------------------------------------------------
+
+//! Two-level acceleration structure for assemblies with repeated parts.
+//! Each unique part gets its own BVHFacets in the part's coordinates
+//! (bottom level), and the instances refer to the parts with their
+//! placements. The top-level BVH over the world boxes of the instances
+//! selects the candidates for a query, which is then transformed into the
+//! coordinates of each candidate and passed to its part. The memory thus
+//! scales with the unique geometry rather than with the number of
+//! instances.
+//!
+//! The parts of a shape are its solids sharing the same TShape and
+//! orientation. A shape without solids makes a single part.
+class BVHInstances
+{
+public:
+
+  //! Placed part.
+  struct t_instance
+  {
+    int     Part;    //!< 0-based index of the part.
+    gp_Trsf Trsf;    //!< Part-to-world transformation.
+    gp_Trsf InvTrsf; //!< World-to-part transformation.
+    double  Scale;   //!< Absolute scale factor of the transformation.
+  };
+
+  //! Facet found by a query in an instance.
+  struct t_hit
+  {
+    BVHQuery::t_hit Hit;      //!< Found facet with the point in world coordinates.
+    int             Instance; //!< 0-based index of the instance or -1.
+
+    //! Default ctor.
+    t_hit() : Instance(-1) {}
+  };
+
+public:
+
+  //! Ctor for the empty structure to fill with AddPart() and AddInstance().
+  BVHInstances();
+
+  //! Creates the structure for the meshed CAD model.
+  //! \param[in] model  the assembly to create the structure for.
+  //! \param[in] params the options of the per-part BVH construction.
+  BVHInstances(const TopoDS_Shape&   model,
+               const BVHBuildParams& params = BVHBuildParams());
+
+public:
+
+  //! Adds a part. Its facets should be in the part's coordinates.
+  //! \param[in] part the facets of the part.
+  //! \return 0-based index of the part.
+  int
+    AddPart(const Handle(BVHFacets)& part);
+
+  //! Adds an instance of the part.
+  //! \param[in] part the 0-based index of the part.
+  //! \param[in] trsf the part-to-world transformation.
+  //! \return 0-based index of the instance.
+  int
+    AddInstance(const int      part,
+                const gp_Trsf& trsf);
+
+  //! Builds the part trees in parallel and the top-level tree over the
+  //! instances. Called by the queries if the structure has changed, which
+  //! includes refits and rebuilds of the parts.
+  void
+    Build();
+
+public:
+
+  //! Finds the closest point of the assembly.
+  //! \param[in]  P       the query point.
+  //! \param[out] hit     the closest point with its instance and facet.
+  //! \param[in]  maxDist the max distance to search within.
+  //! \return false if there is no facet within the max distance.
+  bool
+    ClosestPoint(const gp_XYZ& P,
+                 t_hit&        hit,
+                 const double  maxDist = RealLast());
+
+  //! Finds the nearest intersection of the ray with the assembly.
+  //! \param[in]  origin   the origin of the ray.
+  //! \param[in]  dir      the direction of the ray.
+  //! \param[out] hit      the intersection point with its instance and facet,
+  //!                      the distance field holds the ray parameter.
+  //! \param[in]  maxParam the max parameter along the ray.
+  //! \return false if the ray misses all instances.
+  bool
+    Raycast(const gp_XYZ& origin,
+            const gp_XYZ& dir,
+            t_hit&        hit,
+            const double  maxParam = RealLast());
+
+  //! Finds the closest points of the assembly for the batch of points.
+  //! \param[in]  points     the query points.
+  //! \param[out] hits       the closest points in the order of the query ones.
+  //! \param[in]  maxDist    the max distance to search within.
+  //! \param[in]  isParallel whether to process the points in parallel.
+  void
+    ClosestPointBatch(const std::vector<gp_XYZ>& points,
+                      std::vector<t_hit>&        hits,
+                      const double               maxDist    = RealLast(),
+                      const bool                 isParallel = true);
+
+public:
+
+  //! \return number of unique parts.
+  int GetNumParts() const
+  {
+    return int( m_parts.size() );
+  }
+
+  //! \return part with the given 0-based index.
+  const Handle(BVHFacets)& GetPart(const int index) const
+  {
+    return m_parts[index];
+  }
+
+  //! \return number of instances.
+  int GetNumInstances() const
+  {
+    return int( m_instances.size() );
+  }
+
+  //! \return instance with the given 0-based index.
+  const t_instance& GetInstance(const int index) const
+  {
+    return m_instances[index];
+  }
+
+  //! \return number of stored facets, i.e., of the unique parts.
+  int
+    GetNumFacets() const;
+
+  //! \return top-level BVH over the instances.
+  const Handle(BVHInstanceSet)& GetTopBvh() const
+  {
+    return m_top;
+  }
+
+protected:
+
+  //! \return true if the top-level tree is built for the current instances
+  //!         and the current revisions of the parts.
+  bool
+    isUpToDate() const;
+
+protected:
+
+  std::vector<Handle(BVHFacets)> m_parts;     //!< Unique parts.
+  std::vector<BVHQuery>          m_queries;   //!< Queries of the parts.
+  std::vector<t_instance>        m_instances; //!< Placed parts.
+  Handle(BVHInstanceSet)         m_top;       //!< Top-level BVH over instances.
+  bool                           m_bIsBuilt;  //!< Whether the trees are built for the current parts and instances.
+  std::vector<int>               m_revisions; //!< Revisions of the parts the top-level tree is built for.
+
+};
+
+#endif
@@ -0,0 +1,218 @@
+//-----------------------------------------------------------------------------
+// Created on: 16 October 2026
+//-----------------------------------------------------------------------------
+// Copyright (c) 2016-present, Quaoar, https://analysissitus.org
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of the copyright holder(s) nor the
+//      names of all contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//-----------------------------------------------------------------------------
+
+// Own include
+#include "BVHProfiler.h"
+
+// BVH includes
+#include "BVHIterator.h"
+
+// Standard includes
+#include <string>
+
+//-----------------------------------------------------------------------------
+
+namespace
+{
+  //! \return volume of the box or zero for an empty one.
+  double boxVolume(const BVH_Vec3d& minPt, const BVH_Vec3d& maxPt)
+  {
+    const BVH_Vec3d d = maxPt - minPt;
+    //
+    if ( d.x() <= 0. || d.y() <= 0. || d.z() <= 0. )
+      return 0.;
+
+    return d.x()*d.y()*d.z();
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+BVHProfiler::BVHProfiler(const Handle(BVHFacets)& facets,
+                         const double             traverseCost,
+                         const double             intersectCost)
+: m_facets         (facets),
+  m_fTraverseCost  (traverseCost),
+  m_fIntersectCost (intersectCost)
+{}
+
+//-----------------------------------------------------------------------------
+
+bool BVHProfiler::Perform()
+{
+  m_stats = t_stats();
+
+  if ( m_facets.IsNull() )
+    return false;
+
+  const opencascade::handle<BVH_Tree<double, 3>>& bvh = m_facets->BVH();
+  //
+  if ( bvh.IsNull() || bvh->NodeInfoBuffer().empty() )
+    return false;
+
+  const int numNodes = int( bvh->NodeInfoBuffer().size() );
+
+  // The depths are propagated from parents to children, as the iterator
+  // visits a parent before its children.
+  std::vector<int> depths(numNodes, 0);
+
+  const double rootVol = boxVolume( bvh->MinPoint(0), bvh->MaxPoint(0) );
+
+  double sumLeafDepth = 0.;
+
+  for ( BVHIterator it(bvh); it.More(); it.Next() )
+  {
+    const BVH_Vec4i& data  = it.Current();
+    const int        node  = it.CurrentIndex();
+    const int        depth = depths[node];
+
+    m_stats.NumNodes++;
+
+    if ( it.IsLeaf() )
+    {
+      const int numFacets = data.z() - data.y() + 1;
+
+      m_stats.NumLeaves++;
+      m_stats.NumFacets += numFacets;
+      m_stats.MaxDepth   = Max(m_stats.MaxDepth, depth);
+      m_stats.LeafSizes[numFacets]++;
+
+      if ( int( m_stats.LeafDepths.size() ) <= depth )
+        m_stats.LeafDepths.resize(depth + 1, 0);
+      //
+      m_stats.LeafDepths[depth]++;
+      sumLeafDepth += depth;
+    }
+    else
+    {
+      const int left  = data.y();
+      const int right = data.z();
+
+      depths[left]  = depth + 1;
+      depths[right] = depth + 1;
+
+      // Overlap of the child boxes.
+      const BVH_Vec3d overlapMin = bvh->MinPoint(left).cwiseMax( bvh->MinPoint(right) );
+      const BVH_Vec3d overlapMax = bvh->MaxPoint(left).cwiseMin( bvh->MaxPoint(right) );
+      //
+      m_stats.OverlapVolume += boxVolume(overlapMin, overlapMax);
+    }
+  }
+
+  m_stats.SAHCost      = ComputeSAH(bvh.get(), m_fTraverseCost, m_fIntersectCost);
+  m_stats.AvgLeafDepth = m_stats.NumLeaves ? sumLeafDepth/m_stats.NumLeaves : 0.;
+  m_stats.OverlapRatio = (rootVol > 0.) ? m_stats.OverlapVolume/rootVol : 0.;
+
+  m_stats.NodesMemory  = bvh->NodeInfoBuffer().capacity()*sizeof(BVH_Vec4i)
+                       + bvh->MinPointBuffer().capacity()*sizeof(BVH_Vec3d)
+                       + bvh->MaxPointBuffer().capacity()*sizeof(BVH_Vec3d);
+  m_stats.FacetsMemory = size_t( m_facets->Size() )*sizeof(BVHFacets::t_facet);
+
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+void BVHProfiler::DumpJSON(std::ostream& out,
+                           const int     indent) const
+{
+  const std::string pad   (indent, ' ');
+  const std::string padEnd(Max(indent - 2, 0), ' ');
+
+  out << "{\n"
+      << pad << "\"num_nodes\": "          << m_stats.NumNodes      << ",\n"
+      << pad << "\"num_leaves\": "         << m_stats.NumLeaves     << ",\n"
+      << pad << "\"num_facets\": "         << m_stats.NumFacets     << ",\n"
+      << pad << "\"max_depth\": "          << m_stats.MaxDepth      << ",\n"
+      << pad << "\"avg_leaf_depth\": "     << m_stats.AvgLeafDepth  << ",\n"
+      << pad << "\"sah_cost\": "           << m_stats.SAHCost       << ",\n"
+      << pad << "\"overlap_volume\": "     << m_stats.OverlapVolume << ",\n"
+      << pad << "\"overlap_ratio\": "      << m_stats.OverlapRatio  << ",\n"
+      << pad << "\"nodes_memory\": "       << m_stats.NodesMemory   << ",\n"
+      << pad << "\"facets_memory\": "      << m_stats.FacetsMemory  << ",\n";
+
+  out << pad << "\"leaf_size_histogram\": {";
+  //
+  for ( auto it = m_stats.LeafSizes.cbegin(); it != m_stats.LeafSizes.cend(); ++it )
+    out << (it == m_stats.LeafSizes.cbegin() ? "" : ", ") << "\"" << it->first << "\": " << it->second;
+  //
+  out << "},\n";
+
+  out << pad << "\"leaf_depth_histogram\": [";
+  //
+  for ( size_t d = 0; d < m_stats.LeafDepths.size(); ++d )
+    out << (d ? ", " : "") << m_stats.LeafDepths[d];
+  //
+  out << "]\n"
+      << padEnd << "}";
+}
+
+//-----------------------------------------------------------------------------
+
+double BVHProfiler::BoxArea(const BVH_Vec3d& minPt,
+                            const BVH_Vec3d& maxPt)
+{
+  const BVH_Vec3d d = maxPt - minPt;
+  return 2.0*( d.x()*d.y() + d.y()*d.z() + d.z()*d.x() );
+}
+
+//-----------------------------------------------------------------------------
+
+double BVHProfiler::ComputeSAH(const BVH_Tree<double, 3>* bvh,
+                               const double               traverseCost,
+                               const double               intersectCost)
+{
+  if ( bvh == nullptr || bvh->NodeInfoBuffer().empty() )
+    return 0.0;
+
+  // Only a degenerate root box (e.g., of collinear facets) has no area,
+  // so the diagonal square takes its place to keep the cost finite.
+  const BVH_Vec3d& rootMin  = bvh->MinPoint(0);
+  const BVH_Vec3d& rootMax  = bvh->MaxPoint(0);
+  double           rootArea = BoxArea(rootMin, rootMax);
+  //
+  if ( rootArea <= 0. )
+    rootArea = (rootMax - rootMin).SquareModulus();
+  //
+  if ( rootArea <= 0. )
+    return 0.0;
+
+  double sah = 0.0;
+  //
+  for ( int node = 0; node < int( bvh->NodeInfoBuffer().size() ); ++node )
+  {
+    const BVH_Vec4i& data = bvh->NodeInfoBuffer()[node];
+    const double     area = BoxArea( bvh->MinPoint(node), bvh->MaxPoint(node) )/rootArea;
+
+    sah += (data.x() == 0) ? traverseCost*area : intersectCost*area*( data.z() - data.y() + 1 );
+  }
+
+  return sah;
+}
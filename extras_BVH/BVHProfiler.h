@@ -0,0 +1,142 @@
+//-----------------------------------------------------------------------------
+// Created on: 16 October 2026
+//-----------------------------------------------------------------------------
+// Copyright (c) 2016-present, Quaoar, https://analysissitus.org
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of the copyright holder(s) nor the
+//      names of all contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//-----------------------------------------------------------------------------
+
+#ifndef BVHProfiler_h
+#define BVHProfiler_h
+
+// BVH includes
+#include "BVHFacets.h"
+
+// Standard includes
+#include <map>
+#include <ostream>
+#include <vector>
+
+//-----------------------------------------------------------------------------
+
+//! Quality metrics of a BVH tree over facets, collected in a single
+//! depth-first pass with BVHIterator. The metrics allow comparing the trees
+//! produced by different builders and their settings:
+//!
+//! - SAH cost: the expected cost of a random ray query, i.e., the sum of the
+//!   node areas relative to the root area, weighted by the traversal cost for
+//!   inner nodes and by the intersection cost times the number of facets for
+//!   leaves.
+//! - Sibling overlap: the total volume of the intersections of the child
+//!   boxes of inner nodes. The overlapping regions are visited twice.
+//! - Leaf size and depth histograms.
+//! - Memory footprint of the nodes and facets.
+class BVHProfiler
+{
+public:
+
+  //! Collected metrics.
+  struct t_stats
+  {
+    int    NumNodes;      //!< Total number of nodes.
+    int    NumLeaves;     //!< Number of leaves.
+    int    NumFacets;     //!< Number of facets referenced by leaves.
+    int    MaxDepth;      //!< Depth of the deepest leaf (root is 0).
+    double AvgLeafDepth;  //!< Average depth of leaves.
+    double SAHCost;       //!< Surface area heuristic cost of the tree.
+    double OverlapVolume; //!< Total volume of sibling overlaps.
+    double OverlapRatio;  //!< Overlap volume relative to the root volume.
+    size_t NodesMemory;   //!< Memory of node buffers in bytes.
+    size_t FacetsMemory;  //!< Memory of facets in bytes.
+
+    std::map<int, int> LeafSizes;  //!< Number of leaves per leaf size.
+    std::vector<int>   LeafDepths; //!< Number of leaves per depth.
+
+    //! Default ctor.
+    t_stats() : NumNodes(0), NumLeaves(0), NumFacets(0), MaxDepth(0), AvgLeafDepth(0.),
+                SAHCost(0.), OverlapVolume(0.), OverlapRatio(0.), NodesMemory(0), FacetsMemory(0) {}
+  };
+
+public:
+
+  //! Ctor.
+  //! \param[in] facets        the facets with the tree to profile.
+  //! \param[in] traverseCost  the SAH cost of visiting an inner node.
+  //! \param[in] intersectCost the SAH cost of testing a facet.
+  BVHProfiler(const Handle(BVHFacets)& facets,
+              const double             traverseCost  = 1.0,
+              const double             intersectCost = 1.0);
+
+public:
+
+  //! Collects the metrics. The tree is built if it is not ready yet.
+  //! \return false if there is no tree to profile.
+  bool
+    Perform();
+
+  //! \return collected metrics.
+  const t_stats& GetStats() const
+  {
+    return m_stats;
+  }
+
+  //! Writes the collected metrics as a JSON object.
+  //! \param[in] out    the output stream.
+  //! \param[in] indent the indentation of the object's keys.
+  void
+    DumpJSON(std::ostream& out,
+             const int     indent = 2) const;
+
+public:
+
+  //! \param[in] minPt the min corner of the box.
+  //! \param[in] maxPt the max corner of the box.
+  //! \return surface area of the box.
+  static double
+    BoxArea(const BVH_Vec3d& minPt,
+            const BVH_Vec3d& maxPt);
+
+  //! Computes the SAH cost of a tree. The node areas are normalized by the
+  //! area of the root box, or by its diagonal square if the root box is
+  //! degenerate and has no area.
+  //! \param[in] bvh           the tree to evaluate.
+  //! \param[in] traverseCost  the cost of visiting an inner node.
+  //! \param[in] intersectCost the cost of testing a facet.
+  //! \return SAH cost or zero if the tree is empty.
+  static double
+    ComputeSAH(const BVH_Tree<double, 3>* bvh,
+               const double               traverseCost  = 1.0,
+               const double               intersectCost = 1.0);
+
+protected:
+
+  Handle(BVHFacets) m_facets;         //!< Facets with the tree to profile.
+  double            m_fTraverseCost;  //!< SAH cost of an inner node.
+  double            m_fIntersectCost; //!< SAH cost of a facet.
+  t_stats           m_stats;          //!< Collected metrics.
+
+};
+
+#endif
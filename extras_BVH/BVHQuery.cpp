@@ -0,0 +1,509 @@
+//-----------------------------------------------------------------------------
+// Created on: 16 October 2026
+//-----------------------------------------------------------------------------
+// Copyright (c) 2016-present, Quaoar, https://analysissitus.org
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of the copyright holder(s) nor the
+//      names of all contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//-----------------------------------------------------------------------------
+
+// Own include
+#include "BVHQuery.h"
+
+// OCCT includes
+#include <OSD_Parallel.hxx>
+
+// Standard includes
+#include <algorithm>
+#include <cmath>
+
+//-----------------------------------------------------------------------------
+
+namespace
+{
+  //! Keeps the single closest facet.
+  struct t_nearest
+  {
+    BVHQuery::t_hit Hit;   //!< Best hit with squared distance.
+    double          Bound; //!< Squared distance to prune by.
+
+    t_nearest(const double maxDist2) : Bound(maxDist2) {}
+
+    void Add(const BVHQuery::t_hit& hit)
+    {
+      Hit   = hit;
+      Bound = hit.Distance;
+    }
+  };
+
+  //! Keeps the k closest facets in a max-heap by distance.
+  struct t_kNearest
+  {
+    std::vector<BVHQuery::t_hit>& Heap;  //!< Best hits with squared distances.
+    int                           K;     //!< Max number of hits, non-positive for all.
+    double                        Bound; //!< Squared distance to prune by.
+
+    t_kNearest(std::vector<BVHQuery::t_hit>& heap, const int k, const double maxDist2)
+    : Heap(heap), K(k), Bound(maxDist2) {}
+
+    static bool isCloser(const BVHQuery::t_hit& h1, const BVHQuery::t_hit& h2)
+    {
+      return h1.Distance < h2.Distance;
+    }
+
+    void Add(const BVHQuery::t_hit& hit)
+    {
+      if ( K > 0 && int( Heap.size() ) == K )
+      {
+        std::pop_heap(Heap.begin(), Heap.end(), isCloser);
+        Heap.back() = hit;
+      }
+      else
+      {
+        Heap.push_back(hit);
+      }
+      std::push_heap(Heap.begin(), Heap.end(), isCloser);
+
+      // Once the heap is full, only the facets closer than its farthest
+      // one are of interest.
+      if ( K > 0 && int( Heap.size() ) == K )
+        Bound = Heap.front().Distance;
+    }
+  };
+
+  //! Collects the facets not farther than the bound of the collector.
+  //! The children are visited nearest first, so that the bound shrinks
+  //! as early as possible.
+  template<typename TCollector>
+  void collect(BVHFacets*       pFacets,
+               const BVH_Vec3d& P,
+               TCollector&      collector)
+  {
+    const BVH_Tree<double, 3>* pBVH = pFacets->BVH().get();
+    //
+    if ( pBVH == nullptr || pBVH->NodeInfoBuffer().empty() )
+      return;
+
+    std::pair<int, double> stack[64];
+    int head = -1;
+
+    stack[++head] = std::make_pair( 0, BVHQuery::SquaredDistanceToBox( P, pBVH->MinPoint(0), pBVH->MaxPoint(0) ) );
+
+    while ( head >= 0 )
+    {
+      const std::pair<int, double> entry = stack[head--];
+      //
+      if ( entry.second > collector.Bound )
+        continue;
+
+      const BVH_Vec4i& data = pBVH->NodeInfoBuffer()[entry.first];
+
+      if ( data.x() == 0 ) // Inner node.
+      {
+        const double distToLft = BVHQuery::SquaredDistanceToBox( P, pBVH->MinPoint( data.y() ), pBVH->MaxPoint( data.y() ) );
+        const double distToRgh = BVHQuery::SquaredDistanceToBox( P, pBVH->MinPoint( data.z() ), pBVH->MaxPoint( data.z() ) );
+
+        // The farther child goes first to be popped last.
+        const bool isLftNearer = distToLft < distToRgh;
+        //
+        const std::pair<int, double> nearer  = isLftNearer ? std::make_pair( data.y(), distToLft ) : std::make_pair( data.z(), distToRgh );
+        const std::pair<int, double> farther = isLftNearer ? std::make_pair( data.z(), distToRgh ) : std::make_pair( data.y(), distToLft );
+
+        if ( farther.second <= collector.Bound )
+          stack[++head] = farther;
+        //
+        if ( nearer.second <= collector.Bound )
+          stack[++head] = nearer;
+      }
+      else // Leaf node.
+      {
+        for ( int fidx = data.y(); fidx <= data.z(); ++fidx )
+        {
+          const BVHFacets::t_facet& facet = pFacets->GetFacet(fidx);
+
+          BVHQuery::t_hit hit;
+          //
+          const BVH_Vec3d closest = BVHQuery::ClosestPointOnTriangle(P, facet.P0, facet.P1, facet.P2, hit.U, hit.V, hit.W);
+          //
+          hit.Distance = (closest - P).SquareModulus();
+          //
+          if ( hit.Distance > collector.Bound )
+            continue;
+
+          hit.Point      = gp_XYZ( closest.x(), closest.y(), closest.z() );
+          hit.FacetIndex = fidx;
+          hit.FaceIndex  = facet.FaceIndex;
+
+          collector.Add(hit);
+        }
+      }
+    }
+  }
+
+  //! \return squared max distance without overflow.
+  double squaredMaxDist(const double maxDist)
+  {
+    return (maxDist < std::sqrt(RealLast())) ? maxDist*maxDist : RealLast();
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+BVHQuery::BVHQuery(const Handle(BVHFacets)& facets)
+: m_facets(facets)
+{}
+
+//-----------------------------------------------------------------------------
+
+bool BVHQuery::ClosestPoint(const gp_XYZ& P,
+                            t_hit&        hit,
+                            const double  maxDist) const
+{
+  hit = t_hit();
+
+  if ( m_facets.IsNull() || maxDist < 0. )
+    return false;
+
+  t_nearest nearest( squaredMaxDist(maxDist) );
+  //
+  collect( m_facets.get(), BVH_Vec3d( P.X(), P.Y(), P.Z() ), nearest );
+  //
+  if ( nearest.Hit.FacetIndex < 0 )
+    return false;
+
+  hit          = nearest.Hit;
+  hit.Distance = std::sqrt(hit.Distance);
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+int BVHQuery::NearestFacets(const gp_XYZ&       P,
+                            const int           k,
+                            const double        radius,
+                            std::vector<t_hit>& hits) const
+{
+  hits.clear();
+
+  if ( m_facets.IsNull() || radius < 0. )
+    return 0;
+
+  t_kNearest kNearest( hits, k, squaredMaxDist(radius) );
+  //
+  collect( m_facets.get(), BVH_Vec3d( P.X(), P.Y(), P.Z() ), kNearest );
+
+  // The max-heap turns into the ascending order.
+  std::sort_heap(hits.begin(), hits.end(), t_kNearest::isCloser);
+  //
+  for ( t_hit& hit : hits )
+    hit.Distance = std::sqrt(hit.Distance);
+
+  return int( hits.size() );
+}
+
+//-----------------------------------------------------------------------------
+
+bool BVHQuery::Raycast(const gp_XYZ& origin,
+                       const gp_XYZ& dir,
+                       t_hit&        hit,
+                       const double  maxParam) const
+{
+  hit = t_hit();
+
+  if ( m_facets.IsNull() || dir.SquareModulus() == 0. )
+    return false;
+
+  const BVH_Tree<double, 3>* pBVH = m_facets->BVH().get();
+  //
+  if ( pBVH == nullptr || pBVH->NodeInfoBuffer().empty() )
+    return false;
+
+  const BVH_Vec3d O( origin.X(), origin.Y(), origin.Z() );
+  const BVH_Vec3d D( dir.X(), dir.Y(), dir.Z() );
+
+  // Zero components give infinities, which the slab test handles.
+  const BVH_Vec3d invD( 1./D.x(), 1./D.y(), 1./D.z() );
+
+  double bestParam = maxParam;
+
+  std::pair<int, double> stack[64];
+  int head = -1;
+
+  const double rootParam = RayEnterBox( O, invD, pBVH->MinPoint(0), pBVH->MaxPoint(0), bestParam );
+  //
+  if ( rootParam != RealLast() )
+    stack[++head] = std::make_pair(0, rootParam);
+
+  while ( head >= 0 )
+  {
+    const std::pair<int, double> entry = stack[head--];
+    //
+    if ( entry.second > bestParam )
+      continue;
+
+    const BVH_Vec4i& data = pBVH->NodeInfoBuffer()[entry.first];
+
+    if ( data.x() == 0 ) // Inner node.
+    {
+      const double paramLft = RayEnterBox( O, invD, pBVH->MinPoint( data.y() ), pBVH->MaxPoint( data.y() ), bestParam );
+      const double paramRgh = RayEnterBox( O, invD, pBVH->MinPoint( data.z() ), pBVH->MaxPoint( data.z() ), bestParam );
+
+      // The farther child goes first to be popped last.
+      const bool isLftNearer = paramLft < paramRgh;
+      //
+      const std::pair<int, double> nearer  = isLftNearer ? std::make_pair( data.y(), paramLft ) : std::make_pair( data.z(), paramRgh );
+      const std::pair<int, double> farther = isLftNearer ? std::make_pair( data.z(), paramRgh ) : std::make_pair( data.y(), paramLft );
+
+      if ( farther.second != RealLast() )
+        stack[++head] = farther;
+      //
+      if ( nearer.second != RealLast() )
+        stack[++head] = nearer;
+    }
+    else // Leaf node.
+    {
+      for ( int fidx = data.y(); fidx <= data.z(); ++fidx )
+      {
+        const BVHFacets::t_facet& facet = m_facets->GetFacet(fidx);
+
+        double t, v, w;
+        //
+        if ( !RayTriangle(O, D, facet.P0, facet.P1, facet.P2, t, v, w) || t > bestParam )
+          continue;
+
+        const BVH_Vec3d P = O + D*t;
+
+        bestParam      = t;
+        hit.Point      = gp_XYZ( P.x(), P.y(), P.z() );
+        hit.Distance   = t;
+        hit.FacetIndex = fidx;
+        hit.FaceIndex  = facet.FaceIndex;
+        hit.U          = 1. - v - w;
+        hit.V          = v;
+        hit.W          = w;
+      }
+    }
+  }
+
+  return hit.FacetIndex >= 0;
+}
+
+//-----------------------------------------------------------------------------
+
+void BVHQuery::ClosestPointBatch(const std::vector<gp_XYZ>& points,
+                                 std::vector<t_hit>&        hits,
+                                 const double               maxDist,
+                                 const bool                 isParallel) const
+{
+  hits.assign( points.size(), t_hit() );
+
+  if ( m_facets.IsNull() )
+    return;
+
+  // Build the tree before the threads share it.
+  m_facets->BVH();
+
+  OSD_Parallel::For( 0, int( points.size() ), [&](const int i)
+  {
+    this->ClosestPoint(points[i], hits[i], maxDist);
+  }, !isParallel );
+}
+
+//-----------------------------------------------------------------------------
+
+void BVHQuery::NearestFacetsBatch(const std::vector<gp_XYZ>&         points,
+                                  const int                          k,
+                                  const double                       radius,
+                                  std::vector< std::vector<t_hit> >& hits,
+                                  const bool                         isParallel) const
+{
+  hits.assign( points.size(), std::vector<t_hit>() );
+
+  if ( m_facets.IsNull() )
+    return;
+
+  // Build the tree before the threads share it.
+  m_facets->BVH();
+
+  OSD_Parallel::For( 0, int( points.size() ), [&](const int i)
+  {
+    this->NearestFacets(points[i], k, radius, hits[i]);
+  }, !isParallel );
+}
+
+//-----------------------------------------------------------------------------
+
+double BVHQuery::SquaredDistanceToBox(const BVH_Vec3d& P,
+                                      const BVH_Vec3d& boxMin,
+                                      const BVH_Vec3d& boxMax)
+{
+  const BVH_Vec3d nearest = P.cwiseMax(boxMin).cwiseMin(boxMax);
+  return (nearest - P).SquareModulus();
+}
+
+//-----------------------------------------------------------------------------
+
+double BVHQuery::RayEnterBox(const BVH_Vec3d& O,
+                             const BVH_Vec3d& invD,
+                             const BVH_Vec3d& boxMin,
+                             const BVH_Vec3d& boxMax,
+                             const double     maxParam)
+{
+  const BVH_Vec3d t1 = (boxMin - O)*invD;
+  const BVH_Vec3d t2 = (boxMax - O)*invD;
+
+  const BVH_Vec3d tNear = t1.cwiseMin(t2);
+  const BVH_Vec3d tFar  = t1.cwiseMax(t2);
+
+  const double tEnter = Max( 0., Max( tNear.x(), Max( tNear.y(), tNear.z() ) ) );
+  const double tExit  = Min( maxParam, Min( tFar.x(), Min( tFar.y(), tFar.z() ) ) );
+
+  return (tEnter <= tExit) ? tEnter : RealLast();
+}
+
+//-----------------------------------------------------------------------------
+
+BVH_Vec3d BVHQuery::ClosestPointOnTriangle(const BVH_Vec3d& P,
+                                           const BVH_Vec3d& A,
+                                           const BVH_Vec3d& B,
+                                           const BVH_Vec3d& C,
+                                           double&          u,
+                                           double&          v,
+                                           double&          w)
+{
+  const BVH_Vec3d AB = B - A;
+  const BVH_Vec3d AC = C - A;
+  const BVH_Vec3d AP = P - A;
+
+  // Node A.
+  const double d1 = AB.Dot(AP);
+  const double d2 = AC.Dot(AP);
+  //
+  if ( d1 <= 0. && d2 <= 0. )
+  {
+    u = 1.; v = 0.; w = 0.;
+    return A;
+  }
+
+  // Node B.
+  const BVH_Vec3d BP = P - B;
+  const double    d3 = AB.Dot(BP);
+  const double    d4 = AC.Dot(BP);
+  //
+  if ( d3 >= 0. && d4 <= d3 )
+  {
+    u = 0.; v = 1.; w = 0.;
+    return B;
+  }
+
+  // Edge AB.
+  const double vc = d1*d4 - d3*d2;
+  //
+  if ( vc <= 0. && d1 >= 0. && d3 <= 0. )
+  {
+    v = d1/(d1 - d3); u = 1. - v; w = 0.;
+    return A + AB*v;
+  }
+
+  // Node C.
+  const BVH_Vec3d CP = P - C;
+  const double    d5 = AB.Dot(CP);
+  const double    d6 = AC.Dot(CP);
+  //
+  if ( d6 >= 0. && d5 <= d6 )
+  {
+    u = 0.; v = 0.; w = 1.;
+    return C;
+  }
+
+  // Edge AC.
+  const double vb = d5*d2 - d1*d6;
+  //
+  if ( vb <= 0. && d2 >= 0. && d6 <= 0. )
+  {
+    w = d2/(d2 - d6); u = 1. - w; v = 0.;
+    return A + AC*w;
+  }
+
+  // Edge BC.
+  const double va = d3*d6 - d5*d4;
+  //
+  if ( va <= 0. && (d4 - d3) >= 0. && (d5 - d6) >= 0. )
+  {
+    w = (d4 - d3)/( (d4 - d3) + (d5 - d6) ); v = 1. - w; u = 0.;
+    return B + (C - B)*w;
+  }
+
+  // Interior. A degenerated triangle has no interior, and all its
+  // points are covered by the cases above except for rounding.
+  const double denom = va + vb + vc;
+  //
+  if ( denom <= 0. )
+  {
+    u = 1.; v = 0.; w = 0.;
+    return A;
+  }
+
+  v = vb/denom;
+  w = vc/denom;
+  u = 1. - v - w;
+  return A + AB*v + AC*w;
+}
+
+//-----------------------------------------------------------------------------
+
+bool BVHQuery::RayTriangle(const BVH_Vec3d& O,
+                           const BVH_Vec3d& D,
+                           const BVH_Vec3d& A,
+                           const BVH_Vec3d& B,
+                           const BVH_Vec3d& C,
+                           double&          t,
+                           double&          v,
+                           double&          w)
+{
+  const BVH_Vec3d AB   = B - A;
+  const BVH_Vec3d AC   = C - A;
+  const BVH_Vec3d pVec = BVH_Vec3d::Cross(D, AC);
+  const double    det  = AB.Dot(pVec);
+  //
+  if ( det == 0. ) // The ray is parallel to the triangle.
+    return false;
+
+  const BVH_Vec3d tVec = O - A;
+  //
+  v = tVec.Dot(pVec)/det;
+  //
+  if ( v < 0. || v > 1. )
+    return false;
+
+  const BVH_Vec3d qVec = BVH_Vec3d::Cross(tVec, AB);
+  //
+  w = D.Dot(qVec)/det;
+  //
+  if ( w < 0. || v + w > 1. )
+    return false;
+
+  t = AC.Dot(qVec)/det;
+  return t >= 0.;
+}
@@ -0,0 +1,220 @@
+//-----------------------------------------------------------------------------
+// Created on: 16 October 2026
+//-----------------------------------------------------------------------------
+// Copyright (c) 2016-present, Quaoar, https://analysissitus.org
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of the copyright holder(s) nor the
+//      names of all contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//-----------------------------------------------------------------------------
+
+#ifndef BVHQuery_h
+#define BVHQuery_h
+
+// BVH includes
+#include "BVHFacets.h"
+
+// OCCT includes
+#include <gp_XYZ.hxx>
+
+// Standard includes
+#include <vector>
+
+//-----------------------------------------------------------------------------
+
+//! Proximity queries against the facets of BVHFacets: the closest point
+//! of the mesh, the k nearest facets within a radius and the nearest
+//! intersection with a ray. The tree is
+//! traversed nearest child first, and the subtrees farther than the
+//! current bound (the best distance for the closest point, the k-th best
+//! distance for the nearest facets) are pruned.
+//!
+//! The queries are read-only, so a single instance can serve any number
+//! of threads once the tree is built. The batch variants build the tree
+//! beforehand and process the points in parallel.
+class BVHQuery
+{
+public:
+
+  //! Facet found by a query.
+  struct t_hit
+  {
+    gp_XYZ Point;      //!< Closest point on the facet or intersection point of the ray.
+    double Distance;   //!< Distance from the query point or parameter along the ray.
+    int    FacetIndex; //!< 0-based index of the facet in BVHFacets.
+    int    FaceIndex;  //!< Index of the host face, see BVHFacets::t_facet.
+    double U, V, W;    //!< Barycentric coordinates of the point for the facet nodes P0, P1, P2.
+
+    //! Default ctor.
+    t_hit() : Distance(RealLast()), FacetIndex(-1), FaceIndex(-1), U(0.), V(0.), W(0.) {}
+  };
+
+public:
+
+  //! Ctor.
+  //! \param[in] facets the facets to query.
+  BVHQuery(const Handle(BVHFacets)& facets);
+
+public:
+
+  //! Finds the closest point of the mesh.
+  //! \param[in]  P       the query point.
+  //! \param[out] hit     the closest point with its facet.
+  //! \param[in]  maxDist the max distance to search within.
+  //! \return false if there is no facet within the max distance.
+  bool
+    ClosestPoint(const gp_XYZ& P,
+                 t_hit&        hit,
+                 const double  maxDist = RealLast()) const;
+
+  //! Finds the facets nearest to the point.
+  //! \param[in]  P      the query point.
+  //! \param[in]  k      the max number of facets to find, non-positive
+  //!                    values for all facets within the radius.
+  //! \param[in]  radius the max distance to search within.
+  //! \param[out] hits   the found facets sorted by distance.
+  //! \return number of found facets.
+  int
+    NearestFacets(const gp_XYZ&       P,
+                  const int           k,
+                  const double        radius,
+                  std::vector<t_hit>& hits) const;
+
+  //! Finds the nearest intersection of the ray with the facets. Both sides
+  //! of the facets are hit. The direction is not normalized, so the found
+  //! parameter is measured in its lengths. This keeps the parameter the
+  //! same for a ray transformed with scaling.
+  //! \param[in]  origin   the origin of the ray.
+  //! \param[in]  dir      the direction of the ray.
+  //! \param[out] hit      the intersection point with its facet, the
+  //!                      distance field holds the ray parameter.
+  //! \param[in]  maxParam the max parameter along the ray.
+  //! \return false if the ray misses all facets.
+  bool
+    Raycast(const gp_XYZ& origin,
+            const gp_XYZ& dir,
+            t_hit&        hit,
+            const double  maxParam = RealLast()) const;
+
+  //! Finds the closest points of the mesh for the batch of points. The
+  //! points without facets within the max distance get empty hits with
+  //! FacetIndex of -1.
+  //! \param[in]  points     the query points.
+  //! \param[out] hits       the closest points in the order of the query ones.
+  //! \param[in]  maxDist    the max distance to search within.
+  //! \param[in]  isParallel whether to process the points in parallel.
+  void
+    ClosestPointBatch(const std::vector<gp_XYZ>& points,
+                      std::vector<t_hit>&        hits,
+                      const double               maxDist    = RealLast(),
+                      const bool                 isParallel = true) const;
+
+  //! Finds the nearest facets for the batch of points.
+  //! \param[in]  points     the query points.
+  //! \param[in]  k          the max number of facets to find per point.
+  //! \param[in]  radius     the max distance to search within.
+  //! \param[out] hits       the found facets in the order of the query points.
+  //! \param[in]  isParallel whether to process the points in parallel.
+  void
+    NearestFacetsBatch(const std::vector<gp_XYZ>&         points,
+                       const int                          k,
+                       const double                       radius,
+                       std::vector< std::vector<t_hit> >& hits,
+                       const bool                         isParallel = true) const;
+
+public:
+
+  //! \return squared distance from the point to the box, zero for the
+  //!         points inside.
+  static double
+    SquaredDistanceToBox(const BVH_Vec3d& P,
+                         const BVH_Vec3d& boxMin,
+                         const BVH_Vec3d& boxMax);
+
+  //! Clips the ray by the box.
+  //! \param[in] O        the origin of the ray.
+  //! \param[in] invD     the inverted direction of the ray.
+  //! \param[in] boxMin   the min corner of the box.
+  //! \param[in] boxMax   the max corner of the box.
+  //! \param[in] maxParam the max parameter along the ray.
+  //! \return parameter of the ray entering the box or RealLast() if the
+  //!         ray misses the box.
+  static double
+    RayEnterBox(const BVH_Vec3d& O,
+                const BVH_Vec3d& invD,
+                const BVH_Vec3d& boxMin,
+                const BVH_Vec3d& boxMax,
+                const double     maxParam);
+
+  //! Finds the point of a triangle closest to the given point by the
+  //! Voronoi regions of its nodes and edges.
+  //! \param[in]  P       the point to project.
+  //! \param[in]  A       the first node of the triangle.
+  //! \param[in]  B       the second node of the triangle.
+  //! \param[in]  C       the third node of the triangle.
+  //! \param[out] u, v, w the barycentric coordinates of the closest point.
+  //! \return closest point.
+  static BVH_Vec3d
+    ClosestPointOnTriangle(const BVH_Vec3d& P,
+                           const BVH_Vec3d& A,
+                           const BVH_Vec3d& B,
+                           const BVH_Vec3d& C,
+                           double&          u,
+                           double&          v,
+                           double&          w);
+
+  //! Intersects the ray with a triangle (Moller-Trumbore).
+  //! \param[in]  O    the origin of the ray.
+  //! \param[in]  D    the direction of the ray.
+  //! \param[in]  A    the first node of the triangle.
+  //! \param[in]  B    the second node of the triangle.
+  //! \param[in]  C    the third node of the triangle.
+  //! \param[out] t    the parameter of the intersection point.
+  //! \param[out] v, w the barycentric coordinates of the intersection
+  //!                  point for the nodes B and C.
+  //! \return true if the ray hits the triangle.
+  static bool
+    RayTriangle(const BVH_Vec3d& O,
+                const BVH_Vec3d& D,
+                const BVH_Vec3d& A,
+                const BVH_Vec3d& B,
+                const BVH_Vec3d& C,
+                double&          t,
+                double&          v,
+                double&          w);
+
+public:
+
+  //! \return queried facets.
+  const Handle(BVHFacets)& GetFacets() const
+  {
+    return m_facets;
+  }
+
+protected:
+
+  Handle(BVHFacets) m_facets; //!< Facets to query.
+
+};
+
+#endif
@@ -29,8 +29,12 @@
 //-----------------------------------------------------------------------------
 
 // BVH
+#include "BVHClash.h"
 #include "BVHFacets.h"
+#include "BVHInstances.h"
 #include "BVHIterator.h"
+#include "BVHProfiler.h"
+#include "BVHQuery.h"
 
 // Viewer
 #include "Viewer.h"
@@ -38,14 +42,36 @@
 // OpenCascade includes
 #include <BRep_Tool.hxx>
 #include <BRepMesh_IncrementalMesh.hxx>
+#include <OSD_Timer.hxx>
 #include <STEPControl_Reader.hxx>
 #include <TopExp_Explorer.hxx>
 #include <TopoDS.hxx>
 #include <TopoDS_Face.hxx>
+#include <gp_Ax1.hxx>
 
 // Standard includes
+#include <fstream>
 #include <iostream>
 #include <map>
+#include <random>
+#include <string>
+
+namespace
+{
+  //! \return the string escaped for a JSON literal.
+  std::string jsonEscape(const char* str)
+  {
+    std::string res;
+    for ( const char* c = str; *c; ++c )
+    {
+      if ( *c == '"' || *c == '\\' )
+        res += '\\';
+
+      res += *c;
+    }
+    return res;
+  }
+}
 
 //! See discussion at
 //!
@@ -55,9 +81,9 @@
 //! providing the sample code.
 int main(int argc, char** argv)
 {
-  if ( argc != 2 )
+  if ( argc != 2 && argc != 3 )
   {
-    std::cerr << "Usage: model.step\n";
+    std::cerr << "Usage: model.step [profile.json]\n";
     return 1;
   }
 
@@ -102,11 +128,20 @@ int main(int argc, char** argv)
     }
   }
 
-  // Construct a BVH tree.
-  Handle(BVHFacets) bvh = new BVHFacets(shape, BVHBuilder_Binned, &vout);
+  // Construct a BVH tree. The subtrees are built in all available threads.
+  BVHBuildParams buildParams(BVHBuilder_Binned);
+  buildParams.NumThreads = -1;
+  //
+  Handle(BVHFacets) bvh = new BVHFacets(shape, buildParams, &vout);
+  //
+  OSD_Timer buildTimer;
+  buildTimer.Start();
   //
   const opencascade::handle<BVH_Tree<double, 3>>& bvhTree = bvh->BVH();
   //
+  buildTimer.Stop();
+  std::cout << "BVH built in " << buildTimer.ElapsedTime() << " sec.\n";
+  //
   if ( bvhTree.IsNull() )
   {
     std::cerr << "Failed to build BVH\n";
@@ -156,5 +191,243 @@ int main(int argc, char** argv)
 
   std::cout << "BVH size: " << bvh->Size() << std::endl;
 
+  // Profile the tree.
+  BVHProfiler profiler(bvh);
+  //
+  if ( profiler.Perform() )
+  {
+    const BVHProfiler::t_stats& stats = profiler.GetStats();
+
+    std::cout << "SAH cost: "        << stats.SAHCost
+              << ", max depth: "     << stats.MaxDepth
+              << ", overlap ratio: " << stats.OverlapRatio
+              << ", memory: "        << stats.NodesMemory + stats.FacetsMemory << " bytes\n";
+  }
+
+  // Query the closest points and the nearest facets for random points
+  // around the model.
+  {
+    const int numPts = 100000;
+
+    const BVH_Box<double, 3> box  = bvh->Box();
+    const BVH_Vec3d          size = box.CornerMax() - box.CornerMin();
+
+    std::mt19937                           gen(1);
+    std::uniform_real_distribution<double> dist(-0.1, 1.1);
+    //
+    std::vector<gp_XYZ> points;
+    //
+    for ( int i = 0; i < numPts; ++i )
+      points.push_back( gp_XYZ( box.CornerMin().x() + dist(gen)*size.x(),
+                                box.CornerMin().y() + dist(gen)*size.y(),
+                                box.CornerMin().z() + dist(gen)*size.z() ) );
+
+    BVHQuery query(bvh);
+
+    OSD_Timer queryTimer;
+    queryTimer.Start();
+    //
+    std::vector<BVHQuery::t_hit> hits;
+    query.ClosestPointBatch(points, hits);
+    //
+    queryTimer.Stop();
+
+    double maxDist = 0.;
+    //
+    for ( const BVHQuery::t_hit& hit : hits )
+      maxDist = Max(maxDist, hit.Distance);
+
+    std::cout << "Closest points for " << numPts << " points found in "
+              << queryTimer.ElapsedTime() << " sec, max distance: " << maxDist << '\n';
+
+    std::vector<BVHQuery::t_hit> nearest;
+    query.NearestFacets( points[0], 5, 0.1*bvh->GetBoundingDiag(), nearest );
+
+    std::cout << "Nearest facets within 10% of the model size:";
+    //
+    for ( const BVHQuery::t_hit& hit : nearest )
+      std::cout << " #" << hit.FacetIndex << " (face " << hit.FaceIndex << ", " << hit.Distance << ")";
+    //
+    std::cout << '\n';
+  }
+
+  // Share the trees of the repeated parts in a two-level BVH.
+  {
+    OSD_Timer instancesTimer;
+    instancesTimer.Start();
+    //
+    BVHInstances instances(shape, buildParams);
+    //
+    instancesTimer.Stop();
+
+    std::cout << "Two-level BVH built in " << instancesTimer.ElapsedTime() << " sec: "
+              << instances.GetNumParts()     << " unique parts, "
+              << instances.GetNumInstances() << " instances, "
+              << instances.GetNumFacets()    << " facets stored ("
+              << bvh->Size()                 << " in the flat BVH).\n";
+
+    // Shoot a ray through the model's box.
+    const BVH_Box<double, 3> box = bvh->Box();
+    const BVH_Vec3d          O   = box.CornerMin();
+    const BVH_Vec3d          D   = box.CornerMax() - box.CornerMin();
+
+    BVHInstances::t_hit hit;
+    //
+    if ( instances.Raycast( gp_XYZ( O.x(), O.y(), O.z() ), gp_XYZ( D.x(), D.y(), D.z() ), hit ) )
+      std::cout << "Diagonal ray hits instance " << hit.Instance << " at parameter " << hit.Hit.Distance << '\n';
+    else
+      std::cout << "Diagonal ray misses the model.\n";
+  }
+
+  // Check the model against its copies shifted by a fraction of the
+  // model size.
+  {
+    const BVH_Box<double, 3> box  = bvh->Box();
+    const BVH_Vec3d          size = box.CornerMax() - box.CornerMin();
+
+    for ( const double shift : { 0.1, 1.5 } )
+    {
+      gp_Trsf trsf;
+      trsf.SetTranslation( gp_Vec(shift*size.x(), 0., 0.) );
+
+      BVHClash clash(bvh, bvh, trsf);
+
+      OSD_Timer clashTimer;
+      clashTimer.Start();
+      //
+      std::vector<BVHClash::t_pair> contacts;
+      clash.FindContacts(contacts);
+
+      BVHClash::t_pair closest;
+      clash.MinDistance(closest);
+      //
+      clashTimer.Stop();
+
+      std::cout << "Copy shifted by " << shift*100. << "% along X: "
+                << contacts.size()  << " intersecting facet pairs, "
+                << "min distance "  << closest.Distance << " ("
+                << clashTimer.ElapsedTime() << " sec)\n";
+    }
+  }
+
+  // Compare refitting the tree to a rotating model with rebuilding it
+  // from scratch. Rotation inflates the node boxes, so the SAH cost of
+  // the refitted tree grows until the rebuild heuristic kicks in.
+  {
+    const int    numSteps = 12;
+    const double angle    = 5.0*M_PI/180.0;
+
+    const BVH_Box<double, 3> box    = bvh->Box();
+    const BVH_Vec3d          center = box.Center();
+    const gp_Ax1             axis( gp_Pnt( center.x(), center.y(), center.z() ), gp_Dir(1, 1, 1) );
+
+    gp_Trsf stepTrsf;
+    stepTrsf.SetRotation(axis, angle);
+
+    Handle(BVHFacets) moving = new BVHFacets(shape, buildParams);
+    moving->BVH();
+
+    std::cout << "Refit versus rebuild (" << numSteps << " rotation steps):\n";
+
+    for ( int step = 1; step <= numSteps; ++step )
+    {
+      OSD_Timer refitTimer;
+      refitTimer.Start();
+      //
+      const BVHRefitResult res = moving->Refit(stepTrsf);
+      //
+      refitTimer.Stop();
+
+      gp_Trsf totalTrsf;
+      totalTrsf.SetRotation(axis, angle*step);
+
+      OSD_Timer rebuildTimer;
+      rebuildTimer.Start();
+      //
+      Handle(BVHFacets) rebuilt = new BVHFacets( shape.Moved( TopLoc_Location(totalTrsf) ), buildParams );
+      rebuilt->BVH();
+      //
+      rebuildTimer.Stop();
+
+      std::cout << "  step "         << step
+                << ": refit "        << refitTimer.ElapsedTime()   << " sec"
+                << (res == BVHRefit_Rebuilt ? " (rebuilt)" : "")
+                << ", SAH "          << moving->ComputeSAH()
+                << "; rebuild "      << rebuildTimer.ElapsedTime() << " sec"
+                << ", SAH "          << rebuilt->ComputeSAH()      << '\n';
+    }
+  }
+
+  // Compare the builders and their settings if the output file is given.
+  if ( argc == 3 )
+  {
+    std::ofstream out(argv[2]);
+    //
+    if ( !out.is_open() )
+    {
+      std::cerr << "Cannot open file '" << argv[2] << "' for writing.\n";
+      return 1;
+    }
+
+    std::vector<BVHBuildParams> variants;
+    //
+    for ( const int leafSize : {2, 5, 8} )
+    {
+      for ( const int numBins : {16, 32, 64} )
+      {
+        BVHBuildParams params(BVHBuilder_Binned);
+        params.LeafSize   = leafSize;
+        params.NumBins    = numBins;
+        params.NumThreads = -1;
+        //
+        variants.push_back(params);
+      }
+
+      BVHBuildParams params(BVHBuilder_Linear);
+      params.LeafSize   = leafSize;
+      params.NumThreads = -1;
+      //
+      variants.push_back(params);
+    }
+
+    out << "{\n  \"model\": \"" << jsonEscape(argv[1]) << "\",\n  \"trees\": [\n";
+
+    bool isFirst = true;
+    //
+    for ( const BVHBuildParams& params : variants )
+    {
+      Handle(BVHFacets) variant = new BVHFacets(shape, params);
+      //
+      OSD_Timer timer;
+      timer.Start();
+      //
+      variant->BVH();
+      //
+      timer.Stop();
+
+      BVHProfiler variantProfiler(variant);
+      //
+      if ( !variantProfiler.Perform() )
+        continue;
+
+      out << (isFirst ? "" : ",\n")
+          << "    {\n"
+          << "      \"builder\": \""  << (params.Builder == BVHBuilder_Linear ? "linear" : "binned") << "\",\n"
+          << "      \"leaf_size\": "  << params.LeafSize                                           << ",\n"
+          << "      \"num_bins\": "   << (params.Builder == BVHBuilder_Linear ? 0 : params.NumBins)  << ",\n"
+          << "      \"build_sec\": "  << timer.ElapsedTime()                                       << ",\n"
+          << "      \"profile\": ";
+      //
+      variantProfiler.DumpJSON(out, 8);
+      //
+      out << "\n    }";
+      isFirst = false;
+    }
+
+    out << "\n  ]\n}\n";
+
+    std::cout << "BVH profiles written to '" << argv[2] << "'.\n";
+  }
+
   vout.StartMessageLoop();
 }